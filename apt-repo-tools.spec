@@ -12,9 +12,7 @@ Provides: apt-utils = 0.5.15lorg4
 Obsoletes: apt-utils <= 0.5.15lorg4
 
 BuildRequires: gcc-c++ libapt-devel librpm-devel liblz4-devel
-
-# dd iflag=fullblock
-Requires: coreutils >= 7.0
+BuildRequires: liblzma-devel bzlib-devel libzstd-devel
 
 %description
 This package contains the utility programs that can prepare a repository
@@ -33,11 +31,22 @@ generating the indices): genbasedir, genpkglist, gensrclist.
 %makeinstall_std
 mkdir -p %buildroot/var/cache/apt/gen{pkg,src}list
 
+%check
+%make_build check
+
 %files
 /usr/bin/genpkglist
 /usr/bin/gensrclist
+/usr/bin/genlists
 /usr/bin/genbasedir
 /usr/bin/pkglist-query
+/usr/bin/pkglist-queryd
+/usr/bin/pkglist-unmet
+/usr/bin/pkglist-snapshot
+/usr/bin/pkglist-diff
+/usr/bin/pkglist-delta
+/usr/bin/basehash
+%_includedir/%name/snapshot.h
 %defattr(2770,root,rpm,2770)
 %dir /var/cache/apt/genpkglist
 %dir /var/cache/apt/gensrclist
@@ -0,0 +1,222 @@
+/*
+ * Compute release hashes for the lists in base/
+ */
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <lz4frame.h>
+#include <rpm/rpmpgp.h>
+#include "xwrite.h"
+
+// The size and digests of the file, or of its uncompressed contents
+// if the file is .lz4: the release describes the lists as if they were
+// not compressed.
+struct Hash {
+    const char *file;
+    const char *name;
+    bool missing;
+    std::string err;
+    unsigned long long size;
+    std::string md5;
+    std::string sha256;
+};
+
+struct Digests {
+    DIGEST_CTX md5;
+    DIGEST_CTX sha256;
+    Digests(bool sha) : md5(rpmDigestInit(PGPHASHALGO_MD5, RPMDIGEST_NONE)),
+	sha256(sha ? rpmDigestInit(PGPHASHALGO_SHA256, RPMDIGEST_NONE) : NULL)
+    { }
+    void update(const void *buf, size_t size)
+    {
+	rpmDigestUpdate(md5, buf, size);
+	if (sha256)
+	    rpmDigestUpdate(sha256, buf, size);
+    }
+    static std::string hex(DIGEST_CTX ctx)
+    {
+	char *hex = NULL;
+	rpmDigestFinal(ctx, (void **) &hex, NULL, 1);
+	std::string ret(hex ? hex : "");
+	free(hex);
+	return ret;
+    }
+    void finish(Hash& h)
+    {
+	h.md5 = hex(md5);
+	if (sha256)
+	    h.sha256 = hex(sha256);
+	md5 = sha256 = NULL;
+    }
+    ~Digests()
+    {
+	if (md5)
+	    hex(md5);
+	if (sha256)
+	    hex(sha256);
+    }
+};
+
+static bool endsWith(const char *s, const char *suffix)
+{
+    size_t len = strlen(s), slen = strlen(suffix);
+    return len >= slen && strcmp(s + len - slen, suffix) == 0;
+}
+
+// Decodes the frames, one after another, into a small buffer.
+static bool unlz4(const char *zbuf, size_t zsize, Digests& dd, Hash& h)
+{
+    LZ4F_decompressionContext_t dctx;
+    size_t ret = LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
+    if (LZ4F_isError(ret))
+	return h.err = LZ4F_getErrorName(ret), false;
+    char buf[256 << 10];
+    size_t size = 0;
+    while (zsize) {
+	size_t bufsize = sizeof buf;
+	size_t zread = zsize;
+	ret = LZ4F_decompress(dctx, buf, &bufsize, zbuf, &zread, NULL);
+	if (LZ4F_isError(ret))
+	    break;
+	zbuf += zread, zsize -= zread;
+	dd.update(buf, bufsize);
+	size += bufsize;
+    }
+    LZ4F_freeDecompressionContext(dctx);
+    if (LZ4F_isError(ret))
+	return h.err = LZ4F_getErrorName(ret), false;
+    // ret is the hint for the next input size, non-zero within a frame
+    if (ret)
+	return h.err = "truncated lz4 frame", false;
+    h.size = size;
+    return true;
+}
+
+// One read per file: the file is mapped, and the digests are computed
+// on the fly, while decoding.
+static void hash(Hash& h, bool sha)
+{
+    int fd = open(h.file, O_RDONLY);
+    if (fd < 0) {
+	if (errno == ENOENT)
+	    h.missing = true;
+	else
+	    h.err = xstrerror(errno);
+	return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+	h.err = xstrerror(errno);
+	close(fd);
+	return;
+    }
+    if (!S_ISREG(st.st_mode)) {
+	h.missing = true;
+	close(fd);
+	return;
+    }
+    Digests dd(sha);
+    size_t size = st.st_size;
+    void *map = NULL;
+    if (size) {
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+	    h.err = xstrerror(errno);
+	    close(fd);
+	    return;
+	}
+	madvise(map, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    bool ok = true;
+    if (endsWith(h.file, ".lz4"))
+	ok = unlz4((const char *) map, size, dd, h);
+    else {
+	dd.update(map, size);
+	h.size = size;
+    }
+    if (map)
+	munmap(map, size);
+    if (ok)
+	dd.finish(h);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *progname = argv[0];
+    bool sha = false;
+    int ix = 1;
+    if (ix < argc && strcmp(argv[ix], "--sha256") == 0)
+	sha = true, ix++;
+    if ((argc - ix) % 2) {
+	fprintf(stderr, "Usage: %s [--sha256] [<file> <name>]...\n", progname);
+	return 2;
+    }
+    rpmInitCrypto();
+
+    std::vector<Hash> hh;
+    for (; ix < argc; ix += 2) {
+	Hash h = { argv[ix], argv[ix+1], false, std::string(), 0 };
+	hh.push_back(h);
+    }
+
+    // Files are taken by the threads one by one.
+    std::atomic<size_t> next(0);
+    auto run = [&]()
+    {
+	size_t i;
+	while ((i = next++) < hh.size())
+	    hash(hh[i], sha);
+    };
+    size_t nthreads = std::thread::hardware_concurrency();
+    if (nthreads < 1)
+	nthreads = 1;
+    if (nthreads > hh.size())
+	nthreads = hh.size();
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < nthreads; i++)
+	threads.push_back(std::thread(run));
+    run();
+    for (size_t i = 0; i < threads.size(); i++)
+	threads[i].join();
+
+    // The output goes to the MD5Sum: block of the release, in order.
+    int rc = 0;
+    for (size_t i = 0; i < hh.size(); i++) {
+	const Hash& h = hh[i];
+	if (h.err.size()) {
+	    fprintf(stderr, "%s: %s: %s\n", progname, h.file, h.err.c_str());
+	    rc = 1;
+	}
+	else if (!h.missing)
+	    printf(" %s %llu %s\n", h.md5.c_str(), h.size, h.name);
+    }
+    if (sha) {
+	printf("SHA256:\n");
+	for (size_t i = 0; i < hh.size(); i++) {
+	    const Hash& h = hh[i];
+	    if (h.err.empty() && !h.missing)
+		printf(" %s %llu %s\n", h.sha256.c_str(), h.size, h.name);
+	}
+    }
+    if (fflush(stdout) != 0) {
+	fprintf(stderr, "%s: stdout: %s\n", progname, strerror(errno));
+	rc = 1;
+    }
+    return rc;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
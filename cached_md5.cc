@@ -62,7 +62,12 @@ CachedMD5::CachedMD5(string DirName, string Domain)
 
 CachedMD5::~CachedMD5()
 {
-   FILE *f = fopen(CacheFileName.c_str(), "w+");
+   // The cache is written to a temporary file which is then renamed,
+   // so that concurrent runs never see it half-written.
+   char suffix[32];
+   sprintf(suffix, ".%d", (int) getpid());
+   string TmpFileName = CacheFileName + suffix;
+   FILE *f = fopen(TmpFileName.c_str(), "w+");
    if (f)
    {
       for (map<string,FileData>::const_iterator I = MD5Table.begin();
@@ -73,29 +78,40 @@ CachedMD5::~CachedMD5()
          fprintf(f, "%s %s %lu\n",
 	         File.c_str(), Data.MD5.c_str(), Data.TimeStamp );
       }
-      fclose(f);
+      if (fclose(f) != 0 || rename(TmpFileName.c_str(), CacheFileName.c_str()) != 0)
+	 unlink(TmpFileName.c_str());
    }
 }
 
 void CachedMD5::MD5ForFile(string FileName, time_t TimeStamp, char *buf)
 {
-   if (MD5Table.find(FileName) != MD5Table.end()
-       && TimeStamp == MD5Table[FileName].TimeStamp )
-   {
-      strcpy(buf, MD5Table[FileName].MD5.c_str());
-   }
-   else
+   MD5ForFile(FileName, FileName, TimeStamp, buf);
+}
+
+void CachedMD5::MD5ForFile(string FileName, string Path, time_t TimeStamp, char *buf)
+{
    {
-      MD5Summation MD5;
-      FileFd File(FileName, FileFd::ReadOnly);
-      MD5.AddFD(File.Fd(), File.Size());
-      File.Close();
-      FileData Data;
-      Data.MD5 = MD5.Result().Value();
-      Data.TimeStamp = TimeStamp;
-      MD5Table[FileName] = Data;
-      strcpy(buf, Data.MD5.c_str());
+      lock_guard<mutex> Guard(Lock);
+      map<string,FileData>::const_iterator I = MD5Table.find(FileName);
+      if (I != MD5Table.end() && TimeStamp == I->second.TimeStamp)
+      {
+	 strcpy(buf, I->second.MD5.c_str());
+	 return;
+      }
    }
+
+   // the file is read without holding the lock
+   MD5Summation MD5;
+   FileFd File(Path, FileFd::ReadOnly);
+   MD5.AddFD(File.Fd(), File.Size());
+   File.Close();
+   FileData Data;
+   Data.MD5 = MD5.Result().Value();
+   Data.TimeStamp = TimeStamp;
+   strcpy(buf, Data.MD5.c_str());
+
+   lock_guard<mutex> Guard(Lock);
+   MD5Table[FileName] = Data;
 }
 
 // vim:sts=3:sw=3
@@ -42,6 +42,7 @@
 #include <sys/types.h>
 #include <string>
 #include <map>
+#include <mutex>
 
 using namespace std;
 
@@ -54,10 +55,14 @@ class CachedMD5
       time_t TimeStamp;
    };
    map<string, FileData> MD5Table;
+   // MD5ForFile can be called from a few threads at once
+   mutex Lock;
 
    public:
 
    void MD5ForFile(string FileName, time_t TimeStamp, char *buf);
+   // the file is read from Path, but cached under FileName
+   void MD5ForFile(string FileName, string Path, time_t TimeStamp, char *buf);
 
    CachedMD5(string DirName, string Domain);
    ~CachedMD5();
@@ -0,0 +1,246 @@
+/*
+ * The reverse dependency index: which packages provide each name,
+ * and which packages have each file.  pkglist-unmet makes the index
+ * from the lists, and resolves the requirements against it.
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// As with the srpm index, the index is compiled into a single blob, which
+// is also the file format: the header, the package table, the provides
+// sorted by name, the files sorted by path, and the string pool.  The pool
+// starts with the empty string, so that the unversioned provides have
+// the version at offset 0.  Integers are in native byte order.
+struct DepIndexHeader {
+    char magic[8];
+    uint32_t npkg;
+    uint32_t nprov;
+    uint32_t nfile;
+    uint32_t poolsize;
+};
+
+struct DepIndexProv {
+    uint32_t name; // offsets in the pool
+    uint32_t version;
+    uint32_t flags;
+    uint32_t pkg;
+};
+
+struct DepIndexFile {
+    uint32_t path;
+    uint32_t pkg;
+};
+
+static const char depIndexMagic[8] = { 'd', 'e', 'p', 'i', 'd', 'x', '0', '1' };
+
+class DepIndex
+{
+    // the entries as they are added, with the strings interned
+    StrIntern strs;
+    std::vector<unsigned> pkgv;
+    std::vector<struct DepIndexProv> provv;
+    std::vector<struct DepIndexFile> filev;
+    // the compiled index, either in memory or mapped
+    std::vector<char> blob;
+    const char *base;
+    size_t size;
+    void *map;
+    const struct DepIndexHeader *hdr;
+    const uint32_t *pkgs;
+    const struct DepIndexProv *provs;
+    const struct DepIndexFile *files;
+    const char *pool;
+    bool setup(const char *b, size_t n)
+    {
+	if (n < sizeof *hdr)
+	    return false;
+	const struct DepIndexHeader *h = (const struct DepIndexHeader *) b;
+	if (memcmp(h->magic, depIndexMagic, sizeof h->magic))
+	    return false;
+	size_t need = sizeof *h + (size_t) h->npkg * sizeof *pkgs +
+		      (size_t) h->nprov * sizeof *provs +
+		      (size_t) h->nfile * sizeof *files + h->poolsize;
+	if (need != n)
+	    return false;
+	const uint32_t *k = (const uint32_t *) (h + 1);
+	const struct DepIndexProv *pr = (const struct DepIndexProv *) (k + h->npkg);
+	const struct DepIndexFile *f = (const struct DepIndexFile *) (pr + h->nprov);
+	const char *p = (const char *) (f + h->nfile);
+	if (h->poolsize == 0 || p[0] || p[h->poolsize-1])
+	    return false;
+	for (uint32_t i = 0; i < h->npkg; i++)
+	    if (k[i] >= h->poolsize)
+		return false;
+	for (uint32_t i = 0; i < h->nprov; i++)
+	    if (pr[i].name >= h->poolsize || pr[i].version >= h->poolsize ||
+		pr[i].pkg >= h->npkg ||
+		(i && strcmp(p + pr[i-1].name, p + pr[i].name) > 0))
+		return false;
+	for (uint32_t i = 0; i < h->nfile; i++)
+	    if (f[i].path >= h->poolsize || f[i].pkg >= h->npkg ||
+		(i && strcmp(p + f[i-1].path, p + f[i].path) > 0))
+		return false;
+	base = b, size = n;
+	hdr = h, pkgs = k, provs = pr, files = f, pool = p;
+	return true;
+    }
+public:
+    DepIndex() : base(NULL), size(0), map(NULL), hdr(NULL), pkgs(NULL),
+	provs(NULL), files(NULL), pool(NULL)
+    {
+	strs.intern("");
+    }
+    ~DepIndex()
+    {
+	if (map)
+	    munmap(map, size);
+    }
+    // Producer side: a package, then its provides and files.
+    unsigned addPackage(const char *nvra)
+    {
+	pkgv.push_back(strs.intern(nvra));
+	return pkgv.size() - 1;
+    }
+    void addProvide(unsigned pkg, const char *name, uint32_t flags, const char *version)
+    {
+	struct DepIndexProv pr = { strs.intern(name), strs.intern(version ? : ""), flags, pkg };
+	provv.push_back(pr);
+    }
+    void addFile(unsigned pkg, const char *path)
+    {
+	struct DepIndexFile f = { strs.intern(path), pkg };
+	filev.push_back(f);
+    }
+    // Compile the index from what has been added.
+    void finish()
+    {
+	std::vector<unsigned> ranks;
+	strs.rank(ranks);
+	// the provides of a name stay in the order they were added
+	std::stable_sort(provv.begin(), provv.end(),
+		[&](const struct DepIndexProv &a, const struct DepIndexProv &b)
+		{ return ranks[a.name] < ranks[b.name]; });
+	std::stable_sort(filev.begin(), filev.end(),
+		[&](const struct DepIndexFile &a, const struct DepIndexFile &b)
+		{ return ranks[a.path] < ranks[b.path]; });
+	// the empty string ranks first, and gets offset 0
+	std::vector<unsigned> order(strs.count());
+	for (unsigned id = 0; id < order.size(); id++)
+	    order[ranks[id]] = id;
+	StrPool out;
+	std::vector<unsigned> offs(strs.count());
+	for (unsigned r = 0; r < order.size(); r++)
+	    offs[order[r]] = out.add(strs.str(order[r]));
+	struct DepIndexHeader h;
+	memcpy(h.magic, depIndexMagic, sizeof h.magic);
+	h.npkg = pkgv.size();
+	h.nprov = provv.size();
+	h.nfile = filev.size();
+	h.poolsize = out.size();
+	blob.clear();
+	auto put = [&](const void *p, size_t n)
+	{
+	    blob.insert(blob.end(), (const char *) p, (const char *) p + n);
+	};
+	put(&h, sizeof h);
+	for (unsigned id : pkgv) {
+	    uint32_t off = offs[id];
+	    put(&off, sizeof off);
+	}
+	for (struct DepIndexProv pr : provv) {
+	    pr.name = offs[pr.name], pr.version = offs[pr.version];
+	    put(&pr, sizeof pr);
+	}
+	for (struct DepIndexFile f : filev) {
+	    f.path = offs[f.path];
+	    put(&f, sizeof f);
+	}
+	put(out.get(0), out.size());
+	bool ok = setup(blob.data(), blob.size());
+	assert(ok);
+	(void) ok;
+    }
+    // Map the index written by save.
+    bool load(const char *path, std::string &err)
+    {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	    return err = strerror(errno), false;
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+	    err = strerror(errno);
+	    close(fd);
+	    return false;
+	}
+	if (st.st_size < (off_t) sizeof(struct DepIndexHeader)) {
+	    close(fd);
+	    return err = "bad index", false;
+	}
+	void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED)
+	    return err = strerror(errno), false;
+	if (!setup((const char *) m, st.st_size)) {
+	    munmap(m, st.st_size);
+	    return err = "bad index", false;
+	}
+	map = m;
+	return true;
+    }
+    // Write the compiled index.
+    bool save(FILE *fp) const
+    {
+	return fwrite(base, 1, size, fp) == size;
+    }
+    // Lookups, only valid after finish or load.
+    const char *package(unsigned pkg) const
+    {
+	return pool + pkgs[pkg];
+    }
+    // The provides of the name are provide(first) ... provide(first + count - 1).
+    void findProvides(const char *name, unsigned &first, unsigned &count) const
+    {
+	unsigned lo = 0, hi = hdr->nprov;
+	while (lo < hi) {
+	    unsigned mid = lo + (hi - lo) / 2;
+	    if (strcmp(pool + provs[mid].name, name) < 0)
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+	first = lo;
+	for (hi = lo; hi < hdr->nprov && strcmp(pool + provs[hi].name, name) == 0; hi++)
+	    ;
+	count = hi - lo;
+    }
+    const struct DepIndexProv &provide(unsigned i) const
+    {
+	return provs[i];
+    }
+    const char *str(uint32_t off) const
+    {
+	return pool + off;
+    }
+    // A package which has the file.
+    bool findFile(const char *path, unsigned &pkg) const
+    {
+	unsigned lo = 0, hi = hdr->nfile;
+	while (lo < hi) {
+	    unsigned mid = lo + (hi - lo) / 2;
+	    int cmp = strcmp(pool + files[mid].path, path);
+	    if (cmp == 0) {
+		pkg = files[mid].pkg;
+		return true;
+	    }
+	    if (cmp < 0)
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+	return false;
+    }
+};
+
+// ex:set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,187 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "fingerprint.h"
+
+#include <apt-pkg/configuration.h>
+
+// The fingerprint file lives next to the md5 cache.
+Fingerprint::Fingerprint(string DirName, string Domain) : Failed(false)
+{
+   string fname = DirName;
+   for (string::iterator i = fname.begin(); i != fname.end(); ++i)
+      if ('/' == *i)
+	 *i = '_';
+   FileName = _config->FindDir("Dir::Cache", "/var/cache/apt") + '/' +
+	      Domain + '/' + fname + ".fingerprint";
+
+   FILE *f = fopen(FileName.c_str(), "r");
+   if (!f)
+      return;
+
+   char buf[BUFSIZ];
+   while (fgets(buf, sizeof(buf), f))
+   {
+      char *nl = strchr(buf, '\n');
+      if (nl)
+	 *nl = '\0';
+      if (strncmp(buf, "digest ", 7) == 0)
+	 OldDigest = buf + 7;
+      else if (strncmp(buf, "output ", 7) == 0)
+	 OldOutputs.push_back(buf + 7);
+      else if (strncmp(buf, "stat ", 5) == 0)
+	 OldStat = buf + 5;
+   }
+
+   fclose(f);
+}
+
+// Strings are null-terminated in the digest, so that the concatenation
+// is unambiguous.
+void Fingerprint::Add(const string &Str)
+{
+   Sum.Add((const unsigned char *) Str.c_str(), Str.size() + 1);
+}
+
+// A file which cannot be read makes the digest incomplete: it never
+// matches then.
+bool Fingerprint::AddFile(const char *Path)
+{
+   int fd = open(Path, O_RDONLY);
+   if (fd < 0)
+      return Failed = true, false;
+   struct stat st;
+   bool ok = fstat(fd, &st) == 0 && Sum.AddFD(fd, st.st_size);
+   close(fd);
+   if (!ok)
+      Failed = true;
+   return ok;
+}
+
+void Fingerprint::AddStat(const char *Name, const struct stat &St)
+{
+   char buf[128];
+   snprintf(buf, sizeof(buf), " %llu %lld %llu",
+	    (unsigned long long) St.st_size, (long long) St.st_mtime,
+	    (unsigned long long) St.st_ino);
+   Add(string(Name) + buf);
+}
+
+static string FileMD5(const string &Path)
+{
+   int fd = open(Path.c_str(), O_RDONLY);
+   if (fd < 0)
+      return string();
+   MD5Summation MD5;
+   struct stat st;
+   bool ok = fstat(fd, &st) == 0 && MD5.AddFD(fd, st.st_size);
+   close(fd);
+   return ok ? MD5.Result().Value() : string();
+}
+
+// An output is stamped with its size, mtime, inode and md5.  If the file
+// is the same, it still matches by the contents: genbasedir puts back the
+// old file, with its mtime, if the contents are the same.
+string Fingerprint::OutputStamp(const string &Path, const struct stat &St,
+				const string &MD5)
+{
+   char buf[128];
+   snprintf(buf, sizeof(buf), "%llu %lld %llu %s ",
+	    (unsigned long long) St.st_size, (long long) St.st_mtime,
+	    (unsigned long long) St.st_ino, MD5.c_str());
+   return buf + Path;
+}
+
+// The stamp of the output, if it matches the old one; empty if not.
+string Fingerprint::MatchOutput(const string &Path, const string &Old)
+{
+   struct stat st;
+   if (stat(Path.c_str(), &st) != 0)
+      return string();
+   unsigned long long size, ino;
+   long long mtime;
+   char md5[33];
+   int n = 0;
+   if (sscanf(Old.c_str(), "%llu %lld %llu %32s %n", &size, &mtime, &ino, md5, &n) != 4 ||
+       n == 0 || Old.compare(n, string::npos, Path) != 0 ||
+       size != (unsigned long long) st.st_size)
+      return string();
+   if (mtime == (long long) st.st_mtime && ino == (unsigned long long) st.st_ino)
+      return Old;
+   if (FileMD5(Path) != md5)
+      return string();
+   return OutputStamp(Path, st, md5);
+}
+
+bool Fingerprint::Matches(const vector<string> &Outputs)
+{
+   if (Digest.empty())
+      Digest = Sum.Result().Value();
+   if (Failed || Digest != OldDigest || Outputs.size() != OldOutputs.size())
+      return false;
+   vector<string> Stamps;
+   for (size_t i = 0; i < Outputs.size(); i++)
+   {
+      Stamps.push_back(MatchOutput(Outputs[i], OldOutputs[i]));
+      if (Stamps.back().empty())
+	 return false;
+   }
+   // the outputs which have been put back are stamped anew, so that
+   // they are not read again next time; this is only an optimization
+   if (Stamps != OldOutputs)
+      Write(Stamps, OldStat);
+   return true;
+}
+
+// The fingerprint is written to a temporary file which is then renamed.
+bool Fingerprint::Write(const vector<string> &Stamps, const string &Stat)
+{
+   char suffix[32];
+   sprintf(suffix, ".%d", (int) getpid());
+   string TmpFileName = FileName + suffix;
+   FILE *f = fopen(TmpFileName.c_str(), "w");
+   if (!f)
+      return false;
+   fprintf(f, "digest %s\n", Digest.c_str());
+   for (size_t i = 0; i < Stamps.size(); i++)
+      fprintf(f, "output %s\n", Stamps[i].c_str());
+   if (Stat.size())
+      fprintf(f, "stat %s\n", Stat.c_str());
+   bool ok = true;
+   if (fclose(f) != 0)
+      ok = false;
+   if (!(ok && rename(TmpFileName.c_str(), FileName.c_str()) == 0))
+   {
+      unlink(TmpFileName.c_str());
+      return false;
+   }
+   return true;
+}
+
+bool Fingerprint::Save(const vector<string> &Outputs, const string &Stat)
+{
+   if (Digest.empty())
+      Digest = Sum.Result().Value();
+   // the digest is incomplete; neither is the old one of any use
+   if (Failed)
+      return unlink(FileName.c_str()), false;
+   vector<string> Stamps;
+   for (size_t i = 0; i < Outputs.size(); i++)
+   {
+      struct stat st;
+      string MD5;
+      if (stat(Outputs[i].c_str(), &st) != 0 || (MD5 = FileMD5(Outputs[i])).empty())
+	 return false;
+      Stamps.push_back(OutputStamp(Outputs[i], st, MD5));
+   }
+   return Write(Stamps, Stat);
+}
+
+// vim:sts=3:sw=3
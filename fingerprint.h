@@ -0,0 +1,63 @@
+/*
+ * A digest of everything the output of a generator depends on: the options,
+ * the contents of auxiliary input files, and the name, size, mtime and
+ * inode of each package.  If the digest matches the one saved by the
+ * previous run, and the outputs are still in place and the same, there
+ * is nothing to do.
+ */
+
+#ifndef	__FINGERPRINT_H__
+#define	__FINGERPRINT_H__
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+
+#include <apt-pkg/md5.h>
+
+using namespace std;
+
+class Fingerprint
+{
+   string FileName;
+   MD5Summation Sum;
+   string Digest;
+   // some file could not be added
+   bool Failed;
+
+   // as saved by the previous run
+   string OldDigest;
+   vector<string> OldOutputs;
+   string OldStat;
+
+   static string OutputStamp(const string &Path, const struct stat &St,
+			     const string &MD5);
+   static string MatchOutput(const string &Path, const string &Old);
+   bool Write(const vector<string> &Stamps, const string &Stat);
+
+   public:
+
+   void Add(const string &Str);
+   bool AddFile(const char *Path);
+   void AddStat(const char *Name, const struct stat &St);
+
+   // Outputs are the files written by the generator.
+   bool Matches(const vector<string> &Outputs);
+   bool Save(const vector<string> &Outputs, const string &Stat);
+
+   // The md5sum and size of the uncompressed list, as saved.
+   const string &SavedStat() { return OldStat; }
+   // Where to keep other things along with the fingerprint.
+   string SideFile(const char *Suffix) { return FileName + Suffix; }
+
+   Fingerprint(string DirName, string Domain);
+};
+
+#endif	/* __FINGERPRINT_H__ */
+
+// vim:sts=3:sw=3
@@ -0,0 +1,96 @@
+/*
+ * Make both pkglist and srclist of a component in one process.
+ */
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <iostream>
+
+#include <apt-pkg/configuration.h>
+
+#include "strtab.h"
+#include "srpmindex.h"
+
+using namespace std;
+
+int genpkglist(int argc, char ** argv, SrpmIndex *srpmIndex);
+int gensrclist(int argc, char ** argv, SrpmIndex *srpmIndex);
+
+static
+void usage()
+{
+   cerr << "genlists " << VERSION << endl;
+   cerr << "usage: genlists <genpkglist args> -- <gensrclist args>" << endl;
+   cerr << "The gensrclist arguments are <dir> <suffix> without <srpm index>," << endl;
+   cerr << "the index is passed from genpkglist in memory.  The SRPMS are read" << endl;
+   cerr << "while the RPMS are being processed." << endl;
+}
+
+// The exit status is 2 if both lists are up to date (see --fingerprint).
+// On errors, it tells which side has failed: 1 if genpkglist, 3 if
+// gensrclist, 4 if both.
+int main(int argc, char ** argv)
+{
+   int sep;
+   for (sep = 1; sep < argc; sep++)
+      if (strcmp(argv[sep], "--") == 0)
+	 break;
+   if (sep == argc) {
+      usage();
+      exit(1);
+   }
+
+   // both sides get argv[0], and their own arguments
+   vector<char *> pkgargv(argv, argv + sep);
+   vector<char *> srcargv(1, argv[0]);
+   srcargv.insert(srcargv.end(), argv + sep + 1, argv + argc);
+   pkgargv.push_back(NULL);
+   srcargv.push_back(NULL);
+
+   // The environment and the configuration are global, and the sides
+   // only read them: the cache directory is set here, before the srclist
+   // thread starts, for the fingerprints and the md5 caches of both.
+   putenv((char *)"LC_ALL=");
+   for (int i = 1; i + 1 < argc; i++)
+      if (i != sep && i + 1 != sep && strcmp(argv[i], "--cachedir") == 0)
+	 _config->Set("Dir::Cache", argv[++i]);
+
+   SrpmIndex srpmIndex;
+   int srcrc = 1;
+   thread srcThread([&]()
+   {
+      srcrc = gensrclist(srcargv.size() - 1, &srcargv[0], &srpmIndex);
+      // in case gensrclist has returned early
+      srpmIndex.attach();
+   });
+
+   // gensrclist first resolves its paths, then genpkglist can chdir
+   srpmIndex.waitAttached();
+   int pkgrc = genpkglist(pkgargv.size() - 1, &pkgargv[0], &srpmIndex);
+   srpmIndex.finish(pkgrc == 0 || pkgrc == 2);
+   srcThread.join();
+
+   if (pkgrc == 2 && srcrc == 2)
+      return 2;
+   bool pkgok = pkgrc == 0 || pkgrc == 2;
+   bool srcok = srcrc == 0 || srcrc == 2;
+   if (pkgok && srcok)
+      return 0;
+   if (pkgok)
+      return 3;
+   return srcok ? 1 : 4;
+}
+
+// vim:sts=3:sw=3
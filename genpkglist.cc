@@ -30,8 +30,10 @@
 #include "rapt-compat.h"
 #include "crpmtag.h"
 #include "cached_md5.h"
+#include "fingerprint.h"
 #include "genutil.h"
 
+static
 raptTag tags[] =  {
        RPMTAG_NAME, 
        RPMTAG_EPOCH,
@@ -65,6 +67,7 @@ raptTag tags[] =  {
        RPMTAG_OBSOLETEFLAGS,
        RPMTAG_OBSOLETEVERSION
 };
+static
 int numTags = sizeof(tags) / sizeof(tags[0]);
 
 static
@@ -299,6 +302,7 @@ void addInfoTags(Header h, const char *fname,
 }
 
 
+static
 void usage()
 {
    cerr << "genpkglist " << VERSION << endl;
@@ -320,6 +324,17 @@ void usage()
    cerr << "                 newer than seconds since the Epoch, and also" <<endl;
    cerr << "                 one preceding entry (if any)" <<endl;
    cerr << " --prev-stdin    read previous (bloated) output from stdin and use it as a cache" << endl;
+   cerr << " --mem-limit <MiB>" << endl;
+   cerr << "                 keep at most that much compressed headers in memory;" << endl;
+   cerr << "                 spill the rest to a temporary file" << endl;
+   cerr << " --compress <formats>" << endl;
+   cerr << "                 also write pkglist in the given formats (xz,bz2,zst)" << endl;
+   cerr << " --stat <file>   write md5sum and size of the uncompressed pkglist to file" << endl;
+   cerr << " --zcache <dir>  reuse compressed chunks from the cache in dir" << endl;
+   cerr << " --threads <n>   compress with n threads (default: one per core)" << endl;
+   cerr << " --fingerprint   exit with status 2, leaving the output as is, if the" << endl;
+   cerr << "                 packages and options are the same as on the previous run" << endl;
+   cerr << " --seekable      append the index of the frames to pkglist" << endl;
 }
 
 
@@ -328,28 +343,136 @@ void usage()
 // in a single chunk.  The overall genpkglist algorithm is to load the groups,
 // sort them by source rpm, and finally to spew them out.
 struct group {
-   const char *rpm; // the first rpm in a group, for collation
-   const char *srpm;
+   unsigned rpm; // the first rpm in a group, index in asciisort order
+   unsigned srpm; // interned srpm name
    void *zblob;
    size_t zsize;
+   off_t zoff; // offset in the spill file, or -1 if not spilled
 };
 
-static
-int groupCmp(const void *g1_, const void *g2_)
-{
-   const struct group *g1 = (const struct group *) g1_;
-   const struct group *g2 = (const struct group *) g2_;
-   int cmp = strcmp(g1->srpm, g2->srpm);
-   if (cmp)
-      return cmp;
-   return strcmp(g1->rpm, g2->rpm);
-}
+// no group has been started yet
+#define NOSRPM (~0U)
 
 #include <vector>
+#include <queue>
+#include <algorithm>
 #include "zhdr.h"
+#include "teewriter.h"
 #include "slab.h"
+#include "strtab.h"
+#include "radix.h"
+#include "srpmindex.h"
+#include "rawhdr.h"
+#include "zindex.h"
+
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// Compresses groups of serialized headers and writes them out, in order,
+// on a thread of its own.  Only the serialized headers are passed in,
+// so that the headers themselves are never touched from two threads.
+class BgWriter
+{
+   FD_t fd;
+   bool error;
+   bool done;
+   std::deque<std::vector<char> > queue;
+   // buffers to be reused
+   std::vector<std::vector<char> > spare;
+   std::mutex mutex;
+   std::condition_variable cond;
+   std::thread thread;
+   // how many groups may be pending
+   static const size_t maxQueue = 8;
+   void run()
+   {
+      std::vector<char> zbuf;
+      std::unique_lock<std::mutex> lock(mutex);
+      while (true) {
+	 while (queue.empty() && !done)
+	    cond.wait(lock);
+	 if (queue.empty())
+	    break;
+	 std::vector<char> raw;
+	 raw.swap(queue.front());
+	 queue.pop_front();
+	 cond.notify_all();
+	 lock.unlock();
+	 // raw's size is exact, its capacity is what is reused
+	 size_t bound = zhdrBound(raw.size());
+	 if (zbuf.size() < bound)
+	    zbuf.resize(bound);
+	 size_t zsize = zhdrCompressRaw(raw.data(), raw.size(), zbuf.data(), bound);
+	 Fwrite(zbuf.data(), zsize, 1, fd);
+	 bool ok = !Ferror(fd);
+	 lock.lock();
+	 if (!ok)
+	    error = true;
+	 spare.push_back(std::vector<char>());
+	 spare.back().swap(raw);
+      }
+   }
+public:
+   BgWriter(FD_t fd) : fd(fd), error(false), done(false),
+      thread(&BgWriter::run, this)
+   { }
+   ~BgWriter()
+   {
+      close();
+   }
+   void write(const void *raw, size_t size)
+   {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (queue.size() >= maxQueue)
+	 cond.wait(lock);
+      std::vector<char> buf;
+      if (spare.size()) {
+	 buf.swap(spare.back());
+	 spare.pop_back();
+      }
+      buf.assign((const char *) raw, (const char *) raw + size);
+      queue.push_back(std::vector<char>());
+      queue.back().swap(buf);
+      cond.notify_all();
+   }
+   // wait for the queue to drain; returns false on write errors
+   bool close()
+   {
+      std::unique_lock<std::mutex> lock(mutex);
+      done = true;
+      cond.notify_all();
+      lock.unlock();
+      if (thread.joinable())
+	 thread.join();
+      return !error;
+   }
+};
+
+// When the compressed groups do not fit in memory, they are written
+// to an anonymous temporary file, in sorted runs.
+static
+FILE *spillOpen()
+{
+   const char *tmpdir = getenv("TMPDIR");
+   if (tmpdir == NULL || *tmpdir == '\0')
+      tmpdir = "/tmp";
+   string path = string(tmpdir) + "/genpkglist.XXXXXX";
+   int fd = mkstemp(&path[0]);
+   if (fd < 0)
+      return NULL;
+   unlink(path.c_str());
+   FILE *fp = fdopen(fd, "w+");
+   if (fp == NULL)
+      close(fd);
+   return fp;
+}
 
-int main(int argc, char ** argv) 
+// With a shared srpm index, the index is also passed to the srclist side
+// of the combined generator, as soon as the RPMS are processed.
+int genpkglist(int argc, char ** argv, SrpmIndex *shared)
 {
    string rpmsdir;
    string pkglist_path;
@@ -368,8 +491,18 @@ int main(int argc, char ** argv)
    bool progressBar = false;
    const char *pkgListSuffix = NULL;
    bool prevStdin = false;
+   size_t memLimit = 0;
+   const char *op_compress = NULL;
+   char *op_stat = NULL;
+   const char *op_zcache = NULL;
+   int op_threads = 0;
+   bool op_fingerprint = false;
+   bool op_seekable = false;
    
-   putenv((char *)"LC_ALL="); // Is this necessary yet (after i18n was supported)?
+   // with genlists, the environment and the configuration are set up
+   // before the threads start (see genlists.cc)
+   if (!shared)
+      putenv((char *)"LC_ALL="); // Is this necessary yet (after i18n was supported)?
    for (i = 1; i < argc; i++) {
       if (strcmp(argv[i], "--index") == 0) {
 	 i++;
@@ -377,7 +510,7 @@ int main(int argc, char ** argv)
 	    op_index = argv[i];
 	 } else {
 	    cerr << "genpkglist: filename missing for option --index"<<endl;
-	    exit(1);
+	    return 1;
 	 }
       } else if (strcmp(argv[i], "--info") == 0) {
 	 i++;
@@ -385,7 +518,7 @@ int main(int argc, char ** argv)
 	    op_update = argv[i];
 	 } else {
 	    cerr << "genpkglist: filename missing for option --info"<<endl;
-	    exit(1);
+	    return 1;
 	 }
       } else if (strcmp(argv[i], "--useful-files") == 0) {
 	 i++;
@@ -401,7 +534,7 @@ int main(int argc, char ** argv)
 	    changelog_since = atol(argv[i]);
 	 } else {
 	    cerr << "genpkglist: argument missing for option --changelog-since" <<endl;
-	    exit(1);
+	    return 1;
 	 }
       } else if (strcmp(argv[i], "--bloat") == 0) {
 	 fullFileList = true;
@@ -417,18 +550,63 @@ int main(int argc, char ** argv)
 	    pkgListSuffix = argv[i];
 	 } else {
 	    cerr << "genpkglist: argument missing for option --meta"<<endl;
-	    exit(1);
+	    return 1;
 	 }
       } else if (strcmp(argv[i], "--cachedir") == 0) {
 	 i++;
 	 if (i < argc) {
-            _config->Set("Dir::Cache", argv[i]);
+	    if (!shared)
+	       _config->Set("Dir::Cache", argv[i]);
 	 } else {
             cerr << "genpkglist: argument missing for option --cachedir"<<endl;
-	    exit(1);
+	    return 1;
 	 }
       } else if (strcmp(argv[i], "--prev-stdin") == 0) {
 	 prevStdin = true;
+      } else if (strcmp(argv[i], "--mem-limit") == 0) {
+	 i++;
+	 if (i < argc) {
+	    memLimit = (size_t) atol(argv[i]) << 20;
+	 } else {
+	    cerr << "genpkglist: argument missing for option --mem-limit"<<endl;
+	    return 1;
+	 }
+      } else if (strcmp(argv[i], "--compress") == 0) {
+	 i++;
+	 if (i < argc) {
+	    op_compress = argv[i];
+	 } else {
+	    cerr << "genpkglist: argument missing for option --compress"<<endl;
+	    return 1;
+	 }
+      } else if (strcmp(argv[i], "--stat") == 0) {
+	 i++;
+	 if (i < argc) {
+	    op_stat = argv[i];
+	 } else {
+	    cerr << "genpkglist: argument missing for option --stat"<<endl;
+	    return 1;
+	 }
+      } else if (strcmp(argv[i], "--fingerprint") == 0) {
+	 op_fingerprint = true;
+      } else if (strcmp(argv[i], "--seekable") == 0) {
+	 op_seekable = true;
+      } else if (strcmp(argv[i], "--zcache") == 0) {
+	 i++;
+	 if (i < argc) {
+	    op_zcache = argv[i];
+	 } else {
+	    cerr << "genpkglist: argument missing for option --zcache"<<endl;
+	    return 1;
+	 }
+      } else if (strcmp(argv[i], "--threads") == 0) {
+	 i++;
+	 if (i < argc) {
+	    op_threads = atoi(argv[i]);
+	 } else {
+	    cerr << "genpkglist: argument missing for option --threads"<<endl;
+	    return 1;
+	 }
       } else {
 	 break;
       }
@@ -437,13 +615,13 @@ int main(int argc, char ** argv)
        op_dir = argv[i++];
    else {
       usage();
-      exit(1);
+      return 1;
    }
    if (argc - i > 0)
        op_suf = argv[i++];
    else {
       usage();
-      exit(1);
+      return 1;
    }
    if (argc != i) {
       usage();
@@ -458,17 +636,38 @@ int main(int argc, char ** argv)
       if (!loadUpdateInfo(op_update, updateInfo)) {
 	 cerr << "genpkglist: error reading update info from file " << op_update << endl;
 	 _error->DumpErrors();
-	 exit(1);
+	 return 1;
       }
    }
 
    FILE *idxfp = NULL;
    if (op_index) {
-      idxfp = fopen(op_index, "w+");
+      idxfp = fopen(op_index, "w");
       if (!idxfp) {
 	 cerr << "genpkglist: could not open " << op_index << " for writing";
 	 perror("");
-	 exit(1);
+	 return 1;
+      }
+   }
+   SrpmIndex localIndex;
+   SrpmIndex *srpmIndex = shared ? shared : &localIndex;
+   // write the compiled srpm index to op_index
+   auto saveIndex = [&]()
+   {
+      if (!(srpmIndex->save(idxfp) && fclose(idxfp) == 0)) {
+	 cerr << "genpkglist: " << op_index << ": " << strerror(errno) << endl;
+	 return false;
+      }
+      return true;
+   };
+
+   FILE *statfp = NULL;
+   if (op_stat) {
+      statfp = fopen(op_stat, "w");
+      if (!statfp) {
+	 cerr << "genpkglist: could not open " << op_stat << " for writing";
+	 perror("");
+	 return 1;
       }
    }
 
@@ -478,7 +677,7 @@ int main(int argc, char ** argv)
       if (getcwd(cwd, PATH_MAX) == 0)
       {
          cerr << argv[0] << ": " << strerror(errno) << endl;
-         exit(1);
+         return 1;
       }
       if (*op_dir != '/') {
 	 rpmsdir = string(cwd) + "/" + string(op_dir);
@@ -498,22 +697,160 @@ int main(int argc, char ** argv)
       return 1;
    }
 
+   // rpm file names, still in asciisort order, packed into a single pool;
+   // from now on, rpms are referred to by their index
+   StrPool rpmpool;
+   std::vector<unsigned> rpmoff(entry_no);
+   for (entry_cur = 0; entry_cur < entry_no; entry_cur++) {
+      rpmoff[entry_cur] = rpmpool.add(dirEntries[entry_cur]->d_name);
+      free(dirEntries[entry_cur]);
+   }
+   free(dirEntries);
+   auto rpmName = [&](unsigned ix)
+   {
+      return rpmpool.get(rpmoff[ix]);
+   };
+
    std::string bloater_path;
    bloater_path = pkglist_path + "/base/pkglist." + (pkgListSuffix ? : op_suf) + "+bloat" ZHDR_SUFFIX;
    pkglist_path = pkglist_path + "/base/pkglist." + (pkgListSuffix ? : op_suf) + ZHDR_SUFFIX;
 
-   FD_t outfd = Fopen(pkglist_path.c_str(), "w+");
+   // all the files written, for the fingerprint
+   vector<string> outputs;
+   outputs.push_back(pkglist_path);
+   if (bloater)
+      outputs.push_back(bloater_path);
+   for (const char *p = op_compress; p && *p; ) {
+      size_t len = strcspn(p, ",");
+      outputs.push_back(pkglist_path.substr(0, pkglist_path.size() - strlen(ZHDR_SUFFIX))
+			+ "." + string(p, len));
+      p += len;
+      if (*p == ',')
+	 p++;
+   }
+
+   Fingerprint *fp = NULL;
+   if (op_fingerprint) {
+      fp = new Fingerprint(string(op_dir) + string(op_suf), "genpkglist");
+      char opts[256];
+      snprintf(opts, sizeof(opts), "genpkglist %s bloat=%d bloater=%d noscan=%d "
+	       "changelog=%ld meta=%s compress=%s seekable=%d",
+	       VERSION, fullFileList, bloater, noScan, changelog_since,
+	       pkgListSuffix ? : "", op_compress ? : "", op_seekable);
+      fp->Add(opts);
+      fp->Add(dirtag);
+      fp->Add(op_update ? "info" : "");
+      if (op_update)
+	 fp->AddFile(op_update);
+      fp->Add(op_usefulFiles ? "useful-files" : "");
+      if (op_usefulFiles)
+	 fp->AddFile(op_usefulFiles);
+      for (entry_cur = 0; entry_cur < entry_no; entry_cur++) {
+	 const char *rpm = rpmName(entry_cur);
+	 struct stat sb;
+	 if (stat(rpm, &sb) != 0) {
+	    cerr << "genpkglist: " << rpm << ": " << strerror(errno) << endl;
+	    return 1;
+	 }
+	 fp->AddStat(rpm, sb);
+      }
+      // The srpm index and the stat file are restored from the previous run.
+      string loadErr;
+      bool match = fp->Matches(outputs) &&
+		   (!statfp || fp->SavedStat().size()) &&
+		   (!(idxfp || shared) ||
+		    srpmIndex->load(fp->SideFile(".index").c_str(), loadErr));
+      if (match && idxfp && !saveIndex())
+	 return 1;
+      if (match && statfp) {
+	 fprintf(statfp, "%s\n", fp->SavedStat().c_str());
+	 if (fclose(statfp) != 0) {
+	    cerr << "genpkglist: " << op_stat << ": " << strerror(errno) << endl;
+	    return 1;
+	 }
+      }
+      if (match)
+	 return 2;
+   }
+
+   // The output is written to temporary files, and renamed in place
+   // when done.
+   string pkglist_tmp = pkglist_path + ".tmp";
+   string bloater_tmp = bloater_path + ".tmp";
+
+   FD_t outfd = Fopen(pkglist_tmp.c_str(), "w+");
    if (!outfd) {
-      cerr << "genpkglist: error creating file " << pkglist_path << ": "
+      cerr << "genpkglist: error creating file " << pkglist_tmp << ": "
 	  << strerror(errno) << endl;
       return 1;
    }
 
+   // On any failure return, the partial outputs are removed.  The files
+   // are not closed: the background writer may still be writing them.
+   struct teewriter *tw = NULL;
+   struct TmpGuard {
+      std::function<void()> drop;
+      ~TmpGuard() { drop(); }
+   } tmpGuard = { [&]()
+   {
+      if (tw)
+	 teewriter_abort(tw);
+      unlink(pkglist_tmp.c_str());
+      if (bloater)
+	 unlink(bloater_tmp.c_str());
+   } };
+
+   // the uncompressed stream also goes to the other formats
+   const char *err[2];
+   if (op_compress || statfp) {
+      string base(pkglist_path, 0, pkglist_path.size() - strlen(ZHDR_SUFFIX));
+      tw = teewriter_open(base.c_str(), op_compress ? : "", op_zcache, op_threads, err);
+      if (!tw) {
+	 cerr << "genpkglist: " << err[0] << ": " << err[1] << endl;
+	 return 1;
+      }
+   }
+
+   // with --seekable, the frames are indexed as they are written
+   ZIndexWriter *zidx = op_seekable ? new ZIndexWriter : NULL;
+   uint64_t outpos = 0;
+
+   // The helpers below do not exit on errors: with genlists, gensrclist
+   // is running in another thread.  The error is reported, and the
+   // loops check failed.
+   bool failed = false;
+
+   // write a compressed group to pkglist; raw is the uncompressed group,
+   // if at hand
+   auto output = [&](const void *zblob, size_t zsize, const void *raw, size_t rawSize)
+   {
+      if (failed)
+	 return;
+      Fwrite(zblob, zsize, 1, outfd);
+      if (!tw && !zidx)
+	 return;
+      if (!raw)
+	 raw = unzhdrRaw(zblob, zsize, rawSize);
+      if (zidx) {
+	 zidx->addFrame(outpos, zsize);
+	 if (!zidx->addRaw(raw, rawSize)) {
+	    cerr << "genpkglist: cannot index the headers" << endl;
+	    failed = true;
+	    return;
+	 }
+      }
+      outpos += zsize;
+      if (tw && !teewriter_write(tw, raw, rawSize, err)) {
+	 cerr << "genpkglist: " << err[0] << ": " << err[1] << endl;
+	 failed = true;
+      }
+   };
+
    FD_t bloaterfd = NULL;
    if (bloater) {
-      bloaterfd = Fopen(bloater_path.c_str(), "w+");
+      bloaterfd = Fopen(bloater_tmp.c_str(), "w+");
       if (!bloaterfd) {
-	 cerr << "genpkglist: error creating file " << bloater_path << ": "
+	 cerr << "genpkglist: error creating file " << bloater_tmp << ": "
 	     << strerror(errno) << endl;
 	 return 1;
       }
@@ -542,40 +879,53 @@ int main(int argc, char ** argv)
 
    CachedMD5 md5cache(string(op_dir) + string(op_suf), "genpkglist");
 
-   auto processHeader = [&](Header h, const char *rpm, bool bloat)
+   // make the stripped and/or the bloated header out of a package header
+   auto processHeaders = [&](Header h, const char *rpm, Header *stripped, Header *bloated)
    {
       struct stat sb;
       int statrc = stat(rpm, &sb);
       assert(statrc == 0);
 
-      Header newHeader = headerNew();
-      assert(newHeader);
-      copyTags(h, newHeader, numTags, tags);
-      if (!bloat)
-	 copyStrippedFileList(h, newHeader, usefulFiles);
-      else {
-	 copyTag(h, newHeader, RPMTAG_BASENAMES);
-	 copyTag(h, newHeader, RPMTAG_DIRNAMES);
-	 copyTag(h, newHeader, RPMTAG_DIRINDEXES);
-      }
-      if (changelog_since > 0)
-	 copyChangelog(h, newHeader, changelog_since);
-
-      addAptTags(newHeader, dirtag.c_str(), rpm, sb.st_size);
-      if (op_update)
-	 addInfoTags(newHeader, rpm, updateInfo);
-
       char md5[34];
       md5cache.MD5ForFile(rpm, sb.st_mtime, md5);
-      headerPutString(newHeader, CRPMTAG_MD5, md5);
 
-      if (idxfp) {
-	 const char *srpm = headerGetString(h, RPMTAG_SOURCERPM);
-	 const char *name = headerGetString(h, RPMTAG_NAME);
-	 if (srpm && name)
-	    fprintf(idxfp, "%s %s\n", srpm, name);
+      for (int bloat = 0; bloat < 2; bloat++) {
+	 Header *out = bloat ? bloated : stripped;
+	 if (out == NULL)
+	    continue;
+
+	 Header newHeader = headerNew();
+	 assert(newHeader);
+	 copyTags(h, newHeader, numTags, tags);
+	 if (!bloat)
+	    copyStrippedFileList(h, newHeader, usefulFiles);
+	 else {
+	    copyTag(h, newHeader, RPMTAG_BASENAMES);
+	    copyTag(h, newHeader, RPMTAG_DIRNAMES);
+	    copyTag(h, newHeader, RPMTAG_DIRINDEXES);
+	 }
+	 if (changelog_since > 0)
+	    copyChangelog(h, newHeader, changelog_since);
+
+	 addAptTags(newHeader, dirtag.c_str(), rpm, sb.st_size);
+	 if (op_update)
+	    addInfoTags(newHeader, rpm, updateInfo);
+
+	 headerPutString(newHeader, CRPMTAG_MD5, md5);
+	 *out = newHeader;
       }
+
+      const char *srpm = headerGetString(h, RPMTAG_SOURCERPM);
+      const char *name = headerGetString(h, RPMTAG_NAME);
+      if (srpm && name)
+	 srpmIndex->add(srpm, name);
       headerFree(h);
+   };
+
+   auto processHeader = [&](Header h, const char *rpm, bool bloat)
+   {
+      Header newHeader = NULL;
+      processHeaders(h, rpm, bloat ? NULL : &newHeader, bloat ? &newHeader : NULL);
       return newHeader;
    };
 
@@ -607,30 +957,98 @@ int main(int argc, char ** argv)
       return newHeader;
    };
 
+   // In --bloater mode, unless the previous output is reused, both lists
+   // are made in the second pass from the same package headers, once the
+   // set of dependency files is known.
+   bool dualOutput = bloater && !prevStdin;
+
+   // compressed groups go to the slab, which can be spilled
    Slab slab;
 
+   // srpm names are interned, and the groups are sorted by their ranks
+   StrIntern srpms;
+   std::vector<unsigned> srpmRanks;
+   auto groupKey = [&](const struct group &g)
+   {
+      return (uint64_t) srpmRanks[g.srpm] << 32 | g.rpm;
+   };
+   std::vector<struct group> sortbuf;
+   auto sortGroups = [&](struct group *gg, int n)
+   {
+      srpms.rank(srpmRanks);
+      sortbuf.resize(n);
+      radixSort(gg, sortbuf.data(), n, groupKey);
+   };
+
    struct group *groups = NULL;
    int ngroup = 0;
 
    if (entry_no > 0) {
       groups = new struct group[entry_no+1];
-      groups[0].srpm = NULL;
+      groups[0].srpm = NOSRPM;
    }
 
    // a few headers grouped by SOURCERPM
    std::vector<Header> hh;
    hh.reserve(128);
 
+   // Sorted runs of groups, each run being a range in groups[].
+   // All but the last run have their zblobs in the spill file.
+   std::vector<std::pair<int, int> > runs;
+   int runStart = 0;
+   FILE *spillfp = NULL;
+   off_t spillpos = 0;
+
+   // sort the groups loaded since the last spill and move their zblobs
+   // to the spill file, in that order
+   auto spill = [&]()
+   {
+      if (failed)
+	 return;
+      if (spillfp == NULL) {
+	 spillfp = spillOpen();
+	 if (spillfp == NULL) {
+	    cerr << "genpkglist: cannot create temporary file: "
+		 << strerror(errno) << endl;
+	    failed = true;
+	    return;
+	 }
+      }
+      sortGroups(groups + runStart, ngroup - runStart);
+      for (int gi = runStart; gi < ngroup; gi++) {
+	 struct group *g = &groups[gi];
+	 if (g->zblob == NULL)
+	    continue;
+	 if (fwrite(g->zblob, g->zsize, 1, spillfp) != 1) {
+	    cerr << "genpkglist: cannot write temporary file: "
+		 << strerror(errno) << endl;
+	    failed = true;
+	    return;
+	 }
+	 g->zblob = NULL;
+	 g->zoff = spillpos;
+	 spillpos += g->zsize;
+      }
+      runs.push_back(std::make_pair(runStart, ngroup));
+      runStart = ngroup;
+      slab.clear();
+   };
+
    // how to merge a group
    auto mergeGroup = [&]()
    {
-      void *zblob = zhdrv(hh, groups[ngroup].zsize);
-      groups[ngroup].zblob = slab.put(zblob, groups[ngroup].zsize);
-      free(zblob);
+      // compress right into the slab
+      size_t bound = zhdrPrepare(hh);
+      size_t zsize = zhdrCompress(slab.reserve(bound), bound);
+      groups[ngroup].zblob = slab.commit(zsize);
+      groups[ngroup].zsize = zsize;
+      groups[ngroup].zoff = -1;
       for (size_t i = 0; i < hh.size(); i++)
 	 headerFree(hh[i]);
       hh.clear();
-      groups[++ngroup].srpm = NULL;
+      groups[++ngroup].srpm = NOSRPM;
+      if (memLimit && slab.size() > memLimit)
+	 spill();
    };
 
    // Sometimes the merge has to be forced, to keep the headers
@@ -645,8 +1063,10 @@ int main(int argc, char ** argv)
    };
 
    // what to do with a header when it's loaded
-   auto loaded = [&](Header h, const char *rpm, const char *srpm, bool fromStdin)
+   auto loaded = [&](Header h, unsigned rpm, const char *srpmName, bool fromStdin)
    {
+      unsigned srpm = srpms.intern(srpmName);
+
       if (!(fullFileList || noScan)) {
 	 findDepFiles(h, usefulFiles, RPMTAG_REQUIRENAME);
 	 findDepFiles(h, usefulFiles, RPMTAG_PROVIDENAME);
@@ -658,30 +1078,27 @@ int main(int argc, char ** argv)
       // if it is possible to compress it now and then output the compressed
       // chunk as is.  The exception is when the header is read from stdin:
       // need to keep it anyway.
-      if (!(fullFileList || bloater || noScan || fromStdin)) {
+      if (dualOutput || !(fullFileList || bloater || noScan || fromStdin)) {
 	 // The headers will be reloaded on the second pass; make simple
-	 // 1-element groups (actual grouping is only detected to avoid
-	 // slab.strdup).
-	 bool group = ngroup && strcmp(groups[ngroup-1].srpm, srpm) == 0;
-	 srpm = group ? groups[ngroup-1].srpm : slab.strdup(srpm);
+	 // 1-element groups.
 	 headerFree(h);
 	 groups[ngroup++] = (struct group) { .rpm = rpm, .srpm = srpm,
-					     .zblob = NULL, .zsize = 0 };
+					     .zblob = NULL, .zsize = 0,
+					     .zoff = -1 };
+	 groups[ngroup].srpm = NOSRPM;
 	 return;
       }
 
       // see if there is a grouping (ngroup works here more like gi:
-      // groups[ngroup].srpm must exist, except for the very beginning;
+      // groups[ngroup].srpm is NOSRPM unless a group has been started;
       // ngroup is only increased after the group is finished)
-      bool group =   groups[ngroup].srpm &&
-	      strcmp(groups[ngroup].srpm, srpm) == 0;
-      srpm = group ? groups[ngroup].srpm : slab.strdup(srpm);
+      bool group = groups[ngroup].srpm == srpm;
 
       if (!fromStdin) {
 	 // either bloat/bloater or noScan
 	 if (!(fullFileList || bloater))
 	    assert(noScan);
-	 h = processHeader(h, rpm, fullFileList || bloater);
+	 h = processHeader(h, rpmName(rpm), fullFileList || bloater);
       } else if (!(fullFileList || bloater) && noScan) {
 	 // Assume the input from stdin is bloated; strip it now unless
 	 // bloat/bloater is required, and further if --no-scan option
@@ -704,10 +1121,8 @@ int main(int argc, char ** argv)
 
    // load the groups
    if (prevStdin) {
-      // Will use d_off to indicate that a header has already been
-      // read from stdin.
-      for (entry_cur = 0; entry_cur < entry_no; entry_cur++)
-	 dirEntries[entry_cur]->d_off = 0;
+      // which headers have already been read from stdin
+      std::vector<char> seen(entry_no, 0);
       Header h;
       int previx = -1;
       int progress = 1;
@@ -725,26 +1140,15 @@ int main(int argc, char ** argv)
 	 }
 
 	 // check if the rpm is among the directory entries
-	 auto direntCmp = [](const void *a, const void *b)
-	 {
-	    struct dirent *de1 = *(struct dirent **) a;
-	    struct dirent *de2 = *(struct dirent **) b;
-	    return strcmp(de1->d_name, de2->d_name);
-	 };
-	 struct dirent key_s, *key = &key_s;
-	 size_t len = strlen(rpm);
-	 if (len >= sizeof key->d_name) {
-	    cerr << "genpkglist: bad input from stdin (len)" << endl;
-	    headerFree(h);
-	    break;
-	 }
-	 memcpy(key->d_name, rpm, len + 1);
-	 void *found = bsearch(&key, dirEntries, entry_no, sizeof dirEntries[0], direntCmp);
-	 if (!found) {
+	 auto found = std::lower_bound(rpmoff.begin(), rpmoff.end(), rpm,
+	       [&](unsigned off, const char *fn)
+	       { return strcmp(rpmpool.get(off), fn) < 0; });
+	 if (found == rpmoff.end() || strcmp(rpmpool.get(*found), rpm) != 0) {
 	    headerFree(h);
 	    continue;
 	 }
-	 rpm = (*((struct dirent **) found))->d_name;
+	 int ix = found - rpmoff.begin();
+	 rpm = rpmName(ix);
 	 struct stat st;
 	 if (stat(rpm, &st)) {
 	    cerr << "genpkglist: " << rpm << ": stat failed" << endl;
@@ -755,7 +1159,6 @@ int main(int argc, char ** argv)
 	    forceMerge();
 	    continue;
 	 }
-	 int ix = (struct dirent **) found - dirEntries;
 	 if (ix != previx + 1)
 	    forceMerge();
 	 previx = ix;
@@ -766,21 +1169,21 @@ int main(int argc, char ** argv)
 	    break;
 	 }
 	 progress++;
-	 dirEntries[ix]->d_off = 1;
-	 loaded(h, rpm, srpm, true);
+	 seen[ix] = 1;
+	 loaded(h, ix, srpm, true);
       }
       forceMerge();
 
       // load the rest from fs
       for (entry_cur = 0; entry_cur < entry_no; entry_cur++) {
-	 if (dirEntries[entry_cur]->d_off) {
+	 if (seen[entry_cur]) {
 	    forceMerge();
 	    continue;
 	 }
 	 if (progressBar)
 	    simpleProgress(progress, entry_no);
 
-	 const char *rpm = dirEntries[entry_cur]->d_name;
+	 const char *rpm = rpmName(entry_cur);
 	 Header h = readHeader(rpm);
 	 if (h == NULL) {
 	    cerr << "genpkglist: " << rpm << ": cannot read package header" << endl;
@@ -793,7 +1196,7 @@ int main(int argc, char ** argv)
 	    return 1;
 	 }
 	 progress++;
-	 loaded(h, rpm, srpm, false);
+	 loaded(h, entry_cur, srpm, false);
       }
       // progress should be part of loop control, which isn't possible in this case
       progress--;
@@ -806,7 +1209,7 @@ int main(int argc, char ** argv)
 	 if (progressBar)
 	    simpleProgress(entry_cur + 1, entry_no);
 
-	 const char *rpm = dirEntries[entry_cur]->d_name;
+	 const char *rpm = rpmName(entry_cur);
 	 Header h = readHeader(rpm);
 	 if (h == NULL) {
 	    cerr << "genpkglist: " << rpm << ": cannot read package header" << endl;
@@ -818,61 +1221,152 @@ int main(int argc, char ** argv)
 	    headerFree(h);
 	    return 1;
 	 }
-	 loaded(h, rpm, srpm, false);
+	 loaded(h, entry_cur, srpm, false);
       }
       forceMerge();
    }
 
-   if (ngroup > 1)
-      qsort(groups, ngroup, sizeof(groups[0]), groupCmp);
+   if (failed)
+      return 1;
+
+   if (runs.empty()) {
+      sortGroups(groups, ngroup);
+   } else {
+      // the last run stays in memory
+      sortGroups(groups + runStart, ngroup - runStart);
+      runs.push_back(std::make_pair(runStart, ngroup));
+      // k-way merge of the runs; within each run, the spilled zblobs
+      // are then read sequentially (the earlier runs were sorted with
+      // fewer srpms known, but the ranks still agree on their order)
+      auto runCmp = [&](const std::pair<int, int> &r1, const std::pair<int, int> &r2)
+      {
+	 return groupKey(groups[r1.first]) > groupKey(groups[r2.first]);
+      };
+      std::priority_queue<std::pair<int, int>, std::vector<std::pair<int, int> >,
+			  decltype(runCmp)> heads(runCmp);
+      for (size_t ri = 0; ri < runs.size(); ri++)
+	 if (runs[ri].first < runs[ri].second)
+	    heads.push(runs[ri]);
+      struct group *merged = new struct group[ngroup+1];
+      int mi = 0;
+      while (!heads.empty()) {
+	 std::pair<int, int> r = heads.top();
+	 heads.pop();
+	 merged[mi++] = groups[r.first++];
+	 if (r.first < r.second)
+	    heads.push(r);
+      }
+      assert(mi == ngroup);
+      delete[] groups;
+      groups = merged;
+      if (fflush(spillfp) != 0) {
+	 cerr << "genpkglist: cannot write temporary file: "
+	      << strerror(errno) << endl;
+	 return 1;
+      }
+   }
+
+   // the compressed group, possibly read back from the spill file
+   std::vector<char> spillbuf;
+   auto zblobOf = [&](const struct group *g) -> void *
+   {
+      if (g->zoff < 0)
+	 return g->zblob;
+      if (spillbuf.size() < g->zsize)
+	 spillbuf.resize(g->zsize);
+      ssize_t n = pread(fileno(spillfp), &spillbuf[0], g->zsize, g->zoff);
+      if (n != (ssize_t) g->zsize) {
+	 cerr << "genpkglist: cannot read temporary file: "
+	      << (n < 0 ? strerror(errno) : "short read") << endl;
+	 failed = true;
+	 return NULL;
+      }
+      return &spillbuf[0];
+   };
+
+   // the bloated counterparts of hh, with dualOutput
+   std::vector<Header> hhb;
+   BgWriter *bloatWriter = NULL;
+   if (dualOutput)
+      bloatWriter = new BgWriter(bloaterfd);
 
    for (int gi = 0; gi < ngroup; gi++) {
 
-      if (bloater) {
-	 Fwrite(groups[gi].zblob, groups[gi].zsize, 1, bloaterfd);
+      void *zblob = zblobOf(&groups[gi]);
+      if (failed)
+	 return 1;
+
+      if (zblob && bloater) {
+	 Fwrite(zblob, groups[gi].zsize, 1, bloaterfd);
 	 // proceed
-      } else if (fullFileList || noScan) {
+      } else if (zblob && (fullFileList || noScan)) {
 	 // only left to write
-	 Fwrite(groups[gi].zblob, groups[gi].zsize, 1, outfd);
+	 output(zblob, groups[gi].zsize, NULL, 0);
 	 continue;
       }
 
       if (progressBar)
 	 simpleProgress(gi + 1, ngroup);
 
+      // the bloated group gets compressed in the background; unlike
+      // the stripped groups, it is never coalesced, so that the bloated
+      // list has one frame per srpm, as with the first pass
+      auto mergeBloated = [&]()
+      {
+	 if (hhb.empty())
+	    return;
+	 size_t rawSize;
+	 zhdrPrepare(hhb);
+	 const void *raw = zhdrRaw(rawSize);
+	 bloatWriter->write(raw, rawSize);
+	 for (size_t i = 0; i < hhb.size(); i++)
+	    headerFree(hhb[i]);
+	 hhb.clear();
+      };
+
       // merge writes directly to outfd
       auto mergeGroup = [&]()
       {
-	 size_t zsize;
-	 void *zblob = zhdrv(hh, zsize);
-	 Fwrite(zblob, zsize, 1, outfd);
-	 free(zblob);
+	 mergeBloated();
+	 size_t zsize, rawSize;
+	 const void *zblob = zhdrv(hh, zsize);
+	 const void *raw = zhdrRaw(rawSize);
+	 output(zblob, zsize, raw, rawSize);
 	 for (size_t i = 0; i < hh.size(); i++)
 	    headerFree(hh[i]);
 	 hh.clear();
       };
 
       // can coalesce a few groups, preferably with the same sourcerpm
-      bool group = gi && strcmp(groups[gi-1].srpm, groups[gi].srpm) == 0;
+      bool group = gi && groups[gi-1].srpm == groups[gi].srpm;
+      if (!group)
+	 mergeBloated();
       if (!group && hh.size() > 1)
 	 mergeGroup();
-      if (groups[gi].zblob == NULL) {
-	 const char *rpm = groups[gi].rpm;
+      if (zblob == NULL) {
+	 const char *rpm = rpmName(groups[gi].rpm);
 	 Header h = readHeader(rpm);
 	 if (h == NULL) {
 	    cerr << "genpkglist: " << rpm << ": cannot read package header" << endl;
 	    return 1;
 	 }
-	 assert(!bloater);
-	 h = processHeader(h, rpm, fullFileList);
-	 hh.push_back(h);
+	 if (dualOutput) {
+	    Header stripped, bloated;
+	    processHeaders(h, rpm, &stripped, &bloated);
+	    hh.push_back(stripped);
+	    hhb.push_back(bloated);
+	 } else {
+	    assert(!bloater);
+	    h = processHeader(h, rpm, fullFileList);
+	    hh.push_back(h);
+	 }
       } else {
 	 bool pp = !(fullFileList || noScan) || bloater;
 	 // this branch is only taken when headers are read from stdin
 	 // and need postprocessing, or when --bloater mode is enabled
 	 assert((prevStdin || bloater) && pp);
 	 size_t i = hh.size();
-	 unzhdrv(hh, groups[gi].zblob, groups[gi].zsize);
+	 unzhdrv(hh, zblob, groups[gi].zsize);
 	 for (; pp && i < hh.size(); i++)
 	    hh[i] = postproc(hh[i]);
       }
@@ -880,10 +1374,87 @@ int main(int argc, char ** argv)
       if (gi == ngroup - 1)
 	 mergeGroup();
    }
+   if (failed)
+      return 1;
 #if 0
    system("ps up $PPID");
 #endif
-   Fclose(outfd);
+   // the srclist side can proceed
+   srpmIndex->finish(true);
+   if (idxfp && !saveIndex())
+      return 1;
+   if (bloatWriter && !bloatWriter->close()) {
+      cerr << "genpkglist: error writing " << bloater_path << endl;
+      return 1;
+   }
+   delete bloatWriter;
+   if (zidx) {
+      std::vector<char> zbuf;
+      zidx->finish(zbuf);
+      Fwrite(zbuf.data(), zbuf.size(), 1, outfd);
+      delete zidx;
+   }
+   if (Fclose(outfd) != 0 || (bloaterfd && Fclose(bloaterfd) != 0)) {
+      cerr << "genpkglist: error writing " << pkglist_tmp << endl;
+      return 1;
+   }
+   string statline;
+   if (tw) {
+      char md5[33];
+      uint64_t size;
+      bool ok = teewriter_close(tw, md5, &size, err);
+      tw = NULL;
+      if (!ok) {
+	 cerr << "genpkglist: " << err[0] << ": " << err[1] << endl;
+	 return 1;
+      }
+      char buf[64];
+      snprintf(buf, sizeof(buf), "%s %llu", md5, (unsigned long long) size);
+      statline = buf;
+      if (statfp) {
+	 fprintf(statfp, "%s\n", statline.c_str());
+	 if (fclose(statfp) != 0) {
+	    cerr << "genpkglist: " << op_stat << ": " << strerror(errno) << endl;
+	    return 1;
+	 }
+      }
+   }
+   if (rename(pkglist_tmp.c_str(), pkglist_path.c_str()) != 0 ||
+       (bloater && rename(bloater_tmp.c_str(), bloater_path.c_str()) != 0)) {
+      cerr << "genpkglist: cannot rename " << pkglist_tmp << ": " << strerror(errno) << endl;
+      return 1;
+   }
+   tmpGuard.drop = []() { };
+
+   // Save the fingerprint, along with a copy of the srpm index.
+   // Failing to do so only means that the next run is not skipped.
+   if (fp) {
+      bool ok = true;
+      if (idxfp || shared) {
+	 string idxcopy = fp->SideFile(".index");
+	 string idxtmp = idxcopy + ".tmp";
+	 FILE *f = fopen(idxtmp.c_str(), "w");
+	 ok = f && srpmIndex->save(f);
+	 if (f && fclose(f) != 0)
+	    ok = false;
+	 if (!(ok && rename(idxtmp.c_str(), idxcopy.c_str()) == 0)) {
+	    unlink(idxtmp.c_str());
+	    ok = false;
+	 }
+      }
+      if (!(ok && fp->Save(outputs, statline)))
+	 cerr << "genpkglist: warning: cannot save the fingerprint" << endl;
+      delete fp;
+   }
+   if (spillfp)
+      fclose(spillfp);
 
    return 0;
 }
+
+#ifndef GENLISTS
+int main(int argc, char ** argv)
+{
+   return genpkglist(argc, argv, NULL);
+}
+#endif
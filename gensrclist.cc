@@ -17,11 +17,17 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <assert.h>
+#include <sys/mman.h>
 
 #include <map>
 #include <list>
 #include <vector>
+#include <algorithm>
 #include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 
 #include <apt-pkg/error.h>
 #include <apt-pkg/tagfile.h>
@@ -34,6 +40,7 @@
 
 using namespace std;
 
+static
 raptTag tags[] =  {
        RPMTAG_NAME,
        RPMTAG_EPOCH,
@@ -53,25 +60,11 @@ raptTag tags[] =  {
        RPMTAG_REQUIRENAME,
        RPMTAG_REQUIREVERSION
 };
-int numTags = sizeof(tags) / sizeof(tags[0]);
-
 static
-void readIndex(FILE *fp, map<string, vector<const char *> > &table)
-{
-   char line[512];
-   while (fgets(line, sizeof(line), fp)) {
-      line[strlen(line)-1] = '\0'; // trim newline
-      char *val = strchr(line, ' ');
-      assert(val);
-      *val++ = '\0';
-      const char *srpm = line;
-      const char *rpm = strdup(val);
-      assert(rpm);
-      table[srpm].push_back(rpm);
-   }
-}
+int numTags = sizeof(tags) / sizeof(tags[0]);
 
 
+static
 void usage()
 {
    cerr << "gensrclist " << VERSION << endl;
@@ -84,6 +77,17 @@ void usage()
    cerr << " --progress      show a progress bar" << endl;
    cerr << " --cachedir=DIR  use a custom directory for package md5sum cache"<<endl;
    cerr << " --prev-stdin    read previous output from stdin and use it as a cache" << endl;
+   cerr << " --compress <formats>" << endl;
+   cerr << "                 also write srclist in the given formats (xz,bz2,zst)" << endl;
+   cerr << " --stat <file>   write md5sum and size of the uncompressed srclist to file" << endl;
+   cerr << " --zcache <dir>  reuse compressed chunks from the cache in dir" << endl;
+   cerr << " --threads <n>   compress with n threads (default: one per core)" << endl;
+   cerr << " --fingerprint   exit with status 2, leaving the output as is, if the" << endl;
+   cerr << "                 packages and options are the same as on the previous run" << endl;
+   cerr << " --frames        write each srpm header as a separate lz4 frame" << endl;
+   cerr << " --prev <file>   with --frames, copy the frames of unchanged srpms from" << endl;
+   cerr << "                 the previous srclist" << endl;
+   cerr << " --seekable      with --frames, append the index of the frames to srclist" << endl;
 }
 
 class HdlistReader {
@@ -138,8 +142,20 @@ public:
 
 #include <lz4frame.h>
 #include "lz4writer.h"
-
-int main(int argc, char ** argv) 
+#include "teewriter.h"
+#include "xwrite.h"
+#include "zhdr.h"
+#include "zframe.h"
+#include "fingerprint.h"
+#include "strtab.h"
+#include "srpmindex.h"
+#include "rawhdr.h"
+#include "zindex.h"
+
+// With a shared srpm index, this is the srclist side of the combined
+// generator: the index is made by genpkglist in another thread, and
+// there is no <srpm index> argument.
+int gensrclist(int argc, char ** argv, SrpmIndex *shared)
 {
    char buf[PATH_MAX];
    char cwd[PATH_MAX];
@@ -153,8 +169,19 @@ int main(int argc, char ** argv)
    char *arg_dir, *arg_suffix, *arg_srpmindex;
    const char *srcListSuffix = NULL;
    bool prevStdin = false;
-
-   putenv((char *)"LC_ALL="); // Is this necessary yet (after i18n was supported)?
+   const char *op_compress = NULL;
+   const char *op_stat = NULL;
+   const char *op_zcache = NULL;
+   int op_threads = 0;
+   bool op_fingerprint = false;
+   bool op_frames = false;
+   const char *op_prev = NULL;
+   bool op_seekable = false;
+
+   // with genlists, the environment and the configuration are set up
+   // before the threads start (see genlists.cc)
+   if (!shared)
+      putenv((char *)"LC_ALL="); // Is this necessary yet (after i18n was supported)?
    for (i = 1; i < argc; i++) {
       if (strcmp(argv[i], "--mapi") == 0) {
 	 mapi = true;
@@ -173,35 +200,107 @@ int main(int argc, char ** argv)
       } else if (strcmp(argv[i], "--cachedir") == 0) {
 	 i++;
 	 if (i < argc) {
-            _config->Set("Dir::Cache", argv[i]);
+	    if (!shared)
+	       _config->Set("Dir::Cache", argv[i]);
 	 } else {
             cerr << "genpkglist: argument missing for option --cachedir"<<endl;
 	    exit(1);
 	 }
       } else if (strcmp(argv[i], "--prev-stdin") == 0) {
 	 prevStdin = true;
+      } else if (strcmp(argv[i], "--compress") == 0) {
+	 i++;
+	 if (i < argc) {
+	    op_compress = argv[i];
+	 } else {
+	    cerr << "gensrclist: argument missing for option --compress"<<endl;
+	    exit(1);
+	 }
+      } else if (strcmp(argv[i], "--stat") == 0) {
+	 i++;
+	 if (i < argc) {
+	    op_stat = argv[i];
+	 } else {
+	    cerr << "gensrclist: argument missing for option --stat"<<endl;
+	    exit(1);
+	 }
+      } else if (strcmp(argv[i], "--fingerprint") == 0) {
+	 op_fingerprint = true;
+      } else if (strcmp(argv[i], "--zcache") == 0) {
+	 i++;
+	 if (i < argc) {
+	    op_zcache = argv[i];
+	 } else {
+	    cerr << "gensrclist: argument missing for option --zcache"<<endl;
+	    exit(1);
+	 }
+      } else if (strcmp(argv[i], "--threads") == 0) {
+	 i++;
+	 if (i < argc) {
+	    op_threads = atoi(argv[i]);
+	 } else {
+	    cerr << "gensrclist: argument missing for option --threads"<<endl;
+	    exit(1);
+	 }
+      } else if (strcmp(argv[i], "--frames") == 0) {
+	 op_frames = true;
+      } else if (strcmp(argv[i], "--seekable") == 0) {
+	 op_seekable = true;
+      } else if (strcmp(argv[i], "--prev") == 0) {
+	 i++;
+	 if (i < argc) {
+	    op_prev = argv[i];
+	 } else {
+	    cerr << "gensrclist: argument missing for option --prev"<<endl;
+	    exit(1);
+	 }
       } else {
 	 break;
       }
    }
-   if (argc - i == 3) {
+   if (argc - i == (shared ? 2 : 3)) {
       arg_dir = argv[i++];
       arg_suffix = argv[i++];
-      arg_srpmindex = argv[i++];
+      arg_srpmindex = shared ? NULL : argv[i++];
    }
    else {
       usage();
       exit(1);
    }
-   
-   map<string, vector<const char *> > srpm2rpms;
-   FILE *fp = fopen(arg_srpmindex, "r");
-   if (fp == NULL) {
-      cerr << "gensrclist: " << arg_srpmindex << ": " << strerror(errno) << endl;
+   if (op_prev && !op_frames) {
+      cerr << "gensrclist: --prev requires --frames" << endl;
+      return 1;
+   }
+   if (op_seekable && !op_frames) {
+      cerr << "gensrclist: --seekable requires --frames" << endl;
+      return 1;
+   }
+   if (shared && prevStdin) {
+      cerr << "gensrclist: --prev-stdin cannot be used with genlists" << endl;
       return 1;
    }
-   readIndex(fp, srpm2rpms);
-   fclose(fp);
+   // the progress bar is genpkglist's
+   if (shared)
+      progressBar = false;
+
+   SrpmIndex localIndex;
+   SrpmIndex *srpmIndex = shared ? shared : &localIndex;
+   if (!shared) {
+      string loadErr;
+      if (!localIndex.load(arg_srpmindex, loadErr)) {
+	 cerr << "gensrclist: " << arg_srpmindex << ": " << loadErr << endl;
+	 return 1;
+      }
+   }
+
+   FILE *statfp = NULL;
+   if (op_stat) {
+      statfp = fopen(op_stat, "w");
+      if (statfp == NULL) {
+	 cerr << "gensrclist: " << op_stat << ": " << strerror(errno) << endl;
+	 return 1;
+      }
+   }
    
    if(getcwd(cwd, PATH_MAX) == 0)
    {
@@ -256,22 +355,113 @@ int main(int argc, char ** argv)
       return 1;
    }
 
-   if(chdir(buf) != 0)
+   // The packages are referred to by their full paths, so that
+   // the working directory can be changed by another thread.
+   string srpmpath = buf;
+   auto path = [&](const char *fname)
    {
-      cerr << argv[0] << ":" << strerror(errno) << endl;
-      exit(1);
+      return srpmpath + "/" + fname;
+   };
+
+   // all the files written, for the fingerprint
+   vector<string> outputs;
+   sprintf(buf, "%s/srclist.%s", cwd, srcListSuffix ? : arg_suffix);
+   string srclist_base = buf;
+   string srclist_path = srclist_base + ".lz4";
+   outputs.push_back(srclist_path);
+   for (const char *p = op_compress; p && *p; ) {
+      size_t len = strcspn(p, ",");
+      outputs.push_back(srclist_base + "." + string(p, len));
+      p += len;
+      if (*p == ',')
+	 p++;
    }
-   
-   sprintf(buf, "%s/srclist.%s.lz4", cwd, srcListSuffix ? : arg_suffix);
-   
-   int outfd = open(buf, O_RDWR | O_CREAT | O_TRUNC, 0666);
+
+   string zcache;
+   if (op_zcache) {
+      zcache = op_zcache;
+      if (*op_zcache != '/')
+	 zcache = string(cwd) + "/" + zcache;
+   }
+   string prevPath;
+   if (op_prev) {
+      prevPath = op_prev;
+      if (*op_prev != '/')
+	 prevPath = string(cwd) + "/" + prevPath;
+   }
+
+   // nothing depends on the working directory from now on
+   if (shared)
+      shared->attach();
+
+   Fingerprint *fpr = NULL;
+   if (op_fingerprint) {
+      fpr = new Fingerprint(string(arg_dir) + string(arg_suffix), "gensrclist");
+      char opts[256];
+      snprintf(opts, sizeof(opts), "gensrclist %s mapi=%d meta=%s compress=%s frames=%d "
+	       "seekable=%d", VERSION, mapi, srcListSuffix ? : "", op_compress ? : "",
+	       op_frames, op_seekable);
+      fpr->Add(opts);
+      fpr->Add(srpmdir);
+      for (entry_cur = 0; entry_cur < entry_no; entry_cur++) {
+	 const char *fname = dirEntries[entry_cur]->d_name;
+	 struct stat sb;
+	 if (stat(path(fname).c_str(), &sb) < 0) {
+	    cerr << "gensrclist: " << fname << ": " << strerror(errno) << endl;
+	    return 1;
+	 }
+	 fpr->AddStat(fname, sb);
+      }
+      // The binaries go to the srclist too.  With genlists, this means
+      // waiting for the RPMS pass before the SRPMS are read.
+      if (!srpmIndex->wait()) {
+	 cerr << "gensrclist: the srpm index is incomplete" << endl;
+	 return 1;
+      }
+      size_t idxSize;
+      const char *idxData = (const char *) srpmIndex->data(idxSize);
+      fpr->Add(string(idxData, idxSize));
+      // the stat file is restored from the previous run
+      if (fpr->Matches(outputs) && (!statfp || fpr->SavedStat().size())) {
+	 if (statfp) {
+	    fprintf(statfp, "%s\n", fpr->SavedStat().c_str());
+	    if (fclose(statfp) != 0) {
+	       cerr << "gensrclist: " << op_stat << ": " << strerror(errno) << endl;
+	       return 1;
+	    }
+	 }
+	 return 2;
+      }
+   }
+
+   // The output is written to a temporary file, and renamed in place
+   // when done.
+   string srclist_tmp = srclist_path + ".tmp";
+   int outfd = open(srclist_tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
    if (outfd < 0) {
-      cerr << "gensrclist: error creating file " << buf << ": "
+      cerr << "gensrclist: error creating file " << srclist_tmp << ": "
 	  << strerror(errno) << endl;
       return 1;
    }
 
+   // on any failure return, the partial outputs are removed
+   struct lz4writer *zw = NULL;
+   struct teewriter *tw = NULL;
    const char *err[2];
+   struct TmpGuard {
+      function<void()> drop;
+      ~TmpGuard() { drop(); }
+   } tmpGuard = { [&]()
+   {
+      if (zw)
+	 lz4writer_close(zw, err);
+      else if (outfd >= 0)
+	 close(outfd);
+      if (tw)
+	 teewriter_abort(tw);
+      unlink(srclist_tmp.c_str());
+   } };
+
    auto zwError = [err](const char *func)
    {
       if (strcmp(func, err[0]) == 0)
@@ -280,14 +470,28 @@ int main(int argc, char ** argv)
 	 fprintf(stderr, "gensrclist: %s: %s: %s\n", func, err[0], err[1]);
    };
 
-   struct lz4writer *zw = NULL;
-   if (entry_no) {
+   // in the frames mode, the frames are written to outfd directly;
+   // otherwise, the stream is compressed by the lz4writer threads
+   if (entry_no && !op_frames) {
       bool writeContentSize = true, writeChecksum = false;
-      zw = lz4writer_fdopen(outfd, writeContentSize, writeChecksum, err);
+      zw = lz4writer_fdopen_mt(outfd, writeContentSize, writeChecksum,
+			       op_threads > 0 ? op_threads : thread::hardware_concurrency(), err);
       if (!zw)
 	 return zwError("lz4writer_open"), 1;
    }
 
+   // the uncompressed stream also goes to the other formats
+   if (op_compress || statfp) {
+      tw = teewriter_open(srclist_base.c_str(), op_compress ? : "",
+			  op_zcache ? zcache.c_str() : NULL, op_threads, err);
+      if (!tw)
+	 return zwError("teewriter_open"), 1;
+   }
+
+   // with --seekable, the frames are indexed as they are written
+   ZIndexWriter *zidx = op_seekable ? new ZIndexWriter : NULL;
+   uint64_t outpos = 0;
+
    FD_t prevfd = NULL;
    if (prevStdin) {
       prevfd = fdDup(0);
@@ -298,73 +502,435 @@ int main(int argc, char ** argv)
    }
    HdlistReader prevhdlist(prevfd);
 
+   // The single-header frames of the previous srclist, by file name.
+   // A missing or unreadable previous srclist only means no reuse.
+   struct prevFrame {
+      const char *zblob;
+      size_t zsize;
+      unsigned fileSize;
+   };
+   map<string, struct prevFrame> prevFrames;
+   void *prevMap = NULL;
+   size_t prevSize = 0;
+   if (op_prev) {
+      int fd = open(prevPath.c_str(), O_RDONLY);
+      struct stat st;
+      if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+	 prevSize = st.st_size;
+	 prevMap = mmap(NULL, prevSize, PROT_READ, MAP_SHARED, fd, 0);
+	 if (prevMap == MAP_FAILED)
+	    prevMap = NULL;
+      }
+      if (fd >= 0)
+	 close(fd);
+   }
+   for (size_t off = 0; prevMap && off < prevSize; ) {
+      const char *zblob = (const char *) prevMap + off;
+      bool skippable;
+      size_t zsize = zframeSize(zblob, prevSize - off, &skippable);
+      if (zsize == 0)
+	 break;
+      off += zsize;
+      if (skippable)
+	 continue;
+      // the tags are read right from the frame, without headerImport;
+      // the frames which do not decompress to a single header are skipped
+      size_t rawSize;
+      const char *raw = unzhdrFrame(zblob, zsize, rawSize);
+      if (raw == NULL || rawhdrSize(raw, rawSize) != rawSize)
+	 continue;
+      const char *fname = rawhdrString(raw, rawSize, CRPMTAG_FILENAME);
+      const char *dir = rawhdrString(raw, rawSize, CRPMTAG_DIRECTORY);
+      vector<uint32_t> fileSize;
+      if (fname && dir && srpmdir == dir &&
+	  rawhdrInt32s(raw, rawSize, CRPMTAG_FILESIZE, fileSize) && fileSize.size() == 1) {
+	 struct prevFrame pf = { zblob, zsize, fileSize[0] };
+	 prevFrames[fname] = pf;
+      }
+   }
+
    CachedMD5 md5cache(string(arg_dir) + string(arg_suffix), "gensrclist");
 
+   // The headers are read and built by the workers, while the srpm index
+   // may still be in the making.  Once the index is complete, the workers
+   // also add the binaries and serialize or compress the headers.  The
+   // output is written in asciisort order.  The headers from stdin are
+   // looked up beforehand, since stdin can only be read sequentially.
+   struct srcHeader {
+      Header h;
+      bool fresh; // not from stdin, needs the binaries
+      bool ready; // built
+      bool done; // finished: the output is ready
+      const char *err;
+      const struct prevFrame *prev; // the frame to reuse
+      // the compressed frame
+      vector<char> out;
+      // or the exported header, written out without the magic prepended
+      void *blob;
+      unsigned blobSize;
+      // the uncompressed frame, for the teewriter
+      vector<char> raw;
+   };
+   vector<struct srcHeader> srcHeaders(entry_no);
    for (entry_cur = 0; entry_cur < entry_no; entry_cur++) {
+      struct srcHeader &sh = srcHeaders[entry_cur];
+      sh.h = NULL, sh.fresh = true, sh.ready = sh.done = false;
+      sh.err = NULL, sh.prev = NULL;
+      sh.blob = NULL, sh.blobSize = 0;
+   }
 
-      if (progressBar)
-	 simpleProgress(entry_cur + 1, entry_no);
+   if (prevStdin) {
+      for (entry_cur = 0; entry_cur < entry_no; entry_cur++) {
+	 const char *fname = dirEntries[entry_cur]->d_name;
+	 unsigned first, count;
+	 if (mapi && !shared && !srpmIndex->find(fname, first, count))
+	    continue;
+	 struct stat sb;
+	 if (stat(path(fname).c_str(), &sb) < 0) {
+	    cerr << "gensrclist: " << fname << ": " << strerror(errno) << endl;
+	    return 1;
+	 }
+	 Header h = prevhdlist.find(fname, sb);
+	 if (h) {
+	    srcHeaders[entry_cur].h = h;
+	    srcHeaders[entry_cur].fresh = false;
+	    srcHeaders[entry_cur].ready = true;
+	 }
+      }
+   }
 
-      const char *fname = dirEntries[entry_cur]->d_name;
+   auto buildHeader = [&](int ix)
+   {
+      struct srcHeader &sh = srcHeaders[ix];
+      const char *fname = dirEntries[ix]->d_name;
 
-      // Skip this srpm if doesn't have corresponding rpms.
-      map<string, vector<const char *> >::const_iterator I = srpm2rpms.find(fname);
-      if (I == srpm2rpms.end() && mapi)
-	 continue;
+      // Skip this srpm if doesn't have corresponding rpms.  With genlists,
+      // this can only be decided later.
+      unsigned first, count;
+      if (mapi && !shared && !srpmIndex->find(fname, first, count))
+	 return;
 
+      string fpath = path(fname);
       struct stat sb;
-      if (stat(fname, &sb) < 0) {
-	 cerr << "gensrclist: " << fname << ": " << strerror(errno) << endl;
-	 return 1;
+      if (stat(fpath.c_str(), &sb) < 0) {
+	 sh.err = xstrerror(errno);
+	 return;
       }
 
-      Header h = NULL, newHeader = NULL;
-      if (prevStdin)
-	 newHeader = prevhdlist.find(fname, sb);
-      if (newHeader == NULL)
-	 h = readHeader(fname);
-      if (h == NULL && newHeader == NULL) {
-	 cerr << "gensrclist: " << fname << ": cannot read package header" << endl;
-	 return 1;
+      // the previous frame, if the srpm has not changed
+      map<string, struct prevFrame>::const_iterator pf = prevFrames.find(fname);
+      // (imported here, so that a bad frame only means the srpm is read)
+      if (pf != prevFrames.end() && pf->second.fileSize == (unsigned) sb.st_size) {
+	 size_t rawSize;
+	 const char *raw = unzhdrFrame(pf->second.zblob, pf->second.zsize, rawSize);
+	 Header h = NULL;
+	 if (raw)
+	    h = headerImport((void *) (raw + sizeof zhdr_magic), rawSize - sizeof zhdr_magic,
+			     HEADERIMPORT_COPY | HEADERIMPORT_FAST);
+	 if (h) {
+	    sh.h = h, sh.prev = &pf->second;
+	    return;
+	 }
       }
 
-      if (!newHeader) {
-	 newHeader = headerNew();
-	 copyTags(h, newHeader, numTags, tags);
-	 headerFree(h);
-	 addAptTags(newHeader, srpmdir.c_str(), fname, sb.st_size);
-
-	 char md5[34];
-	 md5cache.MD5ForFile(fname, sb.st_mtime, md5);
-	 headerPutString(newHeader, CRPMTAG_MD5, md5);
-
-	 // Assume the set of rpms doesn't change across invocations,
-	 // otherwise caching cannot be used.
-	 if (I != srpm2rpms.end()) {
-	    const vector<const char *> &rpmv = I->second;
-	    assert(rpmv.size() > 0);
-	    headerPutStringArray(newHeader, CRPMTAG_BINARY, (const char **) &rpmv[0], rpmv.size());
+      Header h = readHeader(fpath.c_str());
+      if (h == NULL) {
+	 sh.err = "cannot read package header";
+	 return;
+      }
+
+      Header newHeader = headerNew();
+      copyTags(h, newHeader, numTags, tags);
+      headerFree(h);
+      addAptTags(newHeader, srpmdir.c_str(), fname, sb.st_size);
+
+      char md5[34];
+      md5cache.MD5ForFile(fname, fpath, sb.st_mtime, md5);
+      headerPutString(newHeader, CRPMTAG_MD5, md5);
+      sh.h = newHeader;
+   };
+
+   const unsigned char headerMagic[8] = {
+       0x8e, 0xad, 0xe8, 0x01, 0x00, 0x00, 0x00, 0x00
+   };
+
+   // Add the binaries and make the output; needs the complete index.
+   auto finishHeader = [&](int ix)
+   {
+      struct srcHeader &sh = srcHeaders[ix];
+      sh.done = true;
+      if (sh.err || (sh.h == NULL && sh.prev == NULL))
+	 return;
+      const char *fname = dirEntries[ix]->d_name;
+
+      unsigned first = 0, count = 0;
+      bool found = srpmIndex->find(fname, first, count);
+      if (!found && mapi) {
+	 if (sh.h)
+	    headerFree(sh.h);
+	 sh.h = NULL, sh.prev = NULL;
+	 return;
+      }
+
+      // The previous frame is copied verbatim if the binaries are
+      // the same; otherwise, only the binaries are replaced.
+      if (sh.prev) {
+	 Header h = sh.h;
+	 struct rpmtd_s td;
+	 bool same;
+	 if (headerGet(h, CRPMTAG_BINARY, &td, HEADERGET_MINMEM) == 1) {
+	    const char **bin = (const char **) td.data;
+	    same = found && td.count == count;
+	    for (unsigned k = 0; same && k < count; k++)
+	       same = strcmp(bin[k], srpmIndex->rpm(first + k)) == 0;
+	    rpmtdFreeData(&td);
+	 }
+	 else
+	    same = !found;
+	 if (same) {
+	    headerFree(h);
+	    sh.h = NULL;
+	    if (tw || op_seekable) {
+	       // it has decompressed once, in buildHeader
+	       size_t rawSize;
+	       const char *raw = unzhdrFrame(sh.prev->zblob, sh.prev->zsize, rawSize);
+	       assert(raw);
+	       sh.raw.assign(raw, raw + rawSize);
+	    }
+	    return;
 	 }
+	 headerDel(h, CRPMTAG_BINARY);
+	 sh.fresh = true, sh.prev = NULL;
       }
 
-      const unsigned char headerMagic[8] = {
-	  0x8e, 0xad, 0xe8, 0x01, 0x00, 0x00, 0x00, 0x00
-      };
+      Header newHeader = sh.h;
+      sh.h = NULL;
+
+      // Assume the set of rpms doesn't change across invocations,
+      // otherwise caching cannot be used.
+      if (sh.fresh && found) {
+	 assert(count > 0);
+	 // the binaries of an srpm, pointing into the index
+	 vector<const char *> rpmv(count);
+	 for (unsigned k = 0; k < count; k++)
+	    rpmv[k] = srpmIndex->rpm(first + k);
+	 headerPutStringArray(newHeader, CRPMTAG_BINARY, &rpmv[0], count);
+      }
 
-      unsigned blobSize;
-      void *blob = headerExport(newHeader, &blobSize);
-      assert(blob);
+      if (op_frames) {
+	 vector<Header> hh(1, newHeader);
+	 size_t zsize, rawSize;
+	 const char *zblob = (const char *) zhdrv(hh, zsize);
+	 sh.out.assign(zblob, zblob + zsize);
+	 if (tw || op_seekable) {
+	    const char *raw = (const char *) zhdrRaw(rawSize);
+	    sh.raw.assign(raw, raw + rawSize);
+	 }
+      } else {
+	 sh.blob = headerExport(newHeader, &sh.blobSize);
+	 assert(sh.blob);
+      }
       headerFree(newHeader);
+   };
+
+   // The workers keep only that far ahead of the output, so that the
+   // headers do not pile up in memory.  Until the index is complete,
+   // nothing is output, and they stop after the first maxAhead srpms.
+   const int maxAhead = 1024;
+   mutex mtx;
+   condition_variable cond;
+   int next = 0, emitted = 0;
+   bool indexReady = !shared, stop = false;
+
+   auto work = [&]()
+   {
+      unique_lock<mutex> lock(mtx);
+      while (true) {
+	 while (!stop && next < entry_no && next >= emitted + maxAhead)
+	    cond.wait(lock);
+	 if (stop || next >= entry_no)
+	    break;
+	 int ix = next++;
+	 if (srcHeaders[ix].ready)
+	    continue;
+	 lock.unlock();
+	 buildHeader(ix);
+	 lock.lock();
+	 bool fin = indexReady;
+	 lock.unlock();
+	 if (fin)
+	    finishHeader(ix);
+	 lock.lock();
+	 srcHeaders[ix].ready = true;
+	 cond.notify_all();
+      }
+   };
 
-      if (!(lz4writer_write(zw, headerMagic, 8, err) &&
-	    lz4writer_write(zw, blob, blobSize, err)))
-	 return zwError("lz4writer_write"), 1;
+   // as many as the compressing threads (genbasedir divides --threads
+   // among the jobs)
+   int nthreads = op_threads > 0 ? op_threads : thread::hardware_concurrency();
+   if (nthreads < 1)
+      nthreads = 1;
+   if (nthreads > entry_no)
+      nthreads = entry_no;
+   vector<thread> workers;
+   for (i = 0; i < nthreads; i++)
+      workers.push_back(thread(work));
+
+   // the workers are stopped on any return
+   struct WorkerGuard {
+      function<void()> stop;
+      ~WorkerGuard() { stop(); }
+   } guard = { [&]()
+   {
+      {
+	 lock_guard<mutex> lock(mtx);
+	 stop = true;
+	 cond.notify_all();
+      }
+      for (size_t k = 0; k < workers.size(); k++)
+	 workers[k].join();
+      workers.clear();
+   } };
+
+   if (!srpmIndex->wait()) {
+      cerr << "gensrclist: the srpm index is incomplete" << endl;
+      return 1;
+   }
+   {
+      lock_guard<mutex> lock(mtx);
+      indexReady = true;
+      cond.notify_all();
+   }
+
+   for (entry_cur = 0; entry_cur < entry_no; entry_cur++) {
+
+      if (progressBar)
+	 simpleProgress(entry_cur + 1, entry_no);
+
+      const char *fname = dirEntries[entry_cur]->d_name;
+      struct srcHeader &sh = srcHeaders[entry_cur];
+      {
+	 unique_lock<mutex> lock(mtx);
+	 while (!sh.ready)
+	    cond.wait(lock);
+	 emitted = entry_cur + 1;
+	 cond.notify_all();
+      }
+      if (!sh.done)
+	 finishHeader(entry_cur);
+      if (sh.err) {
+	 cerr << "gensrclist: " << fname << ": " << sh.err << endl;
+	 return 1;
+      }
+
+      if (sh.blob) {
+	 // The magic and the exported header go to both writers as they are,
+	 // without putting them together first.
+	 void *blob = sh.blob;
+	 sh.blob = NULL;
+	 if (!lz4writer_write(zw, headerMagic, sizeof headerMagic, err) ||
+	     !lz4writer_write(zw, blob, sh.blobSize, err))
+	    return free(blob), zwError("lz4writer_write"), 1;
+	 if (tw && (!teewriter_write(tw, headerMagic, sizeof headerMagic, err) ||
+		    !teewriter_write(tw, blob, sh.blobSize, err)))
+	    return free(blob), zwError("teewriter_write"), 1;
+	 free(blob);
+	 continue;
+      }
+      size_t zsize = sh.prev ? sh.prev->zsize : sh.out.size();
+      if (sh.prev) {
+	 if (!xwrite(outfd, sh.prev->zblob, sh.prev->zsize)) {
+	    cerr << "gensrclist: " << srclist_tmp << ": " << strerror(errno) << endl;
+	    return 1;
+	 }
+      } else if (sh.out.empty()) {
+	 continue;
+      } else if (!xwrite(outfd, sh.out.data(), sh.out.size())) {
+	 cerr << "gensrclist: " << srclist_tmp << ": " << strerror(errno) << endl;
+	 return 1;
+      }
+      if (zidx) {
+	 zidx->addFrame(outpos, zsize);
+	 if (!zidx->addRaw(sh.raw.data(), sh.raw.size())) {
+	    cerr << "gensrclist: " << fname << ": cannot index the header" << endl;
+	    return 1;
+	 }
+      }
+      outpos += zsize;
+      if (tw && !teewriter_write(tw, sh.raw.data(), sh.raw.size(), err))
+	 return zwError("teewriter_write"), 1;
+      vector<char>().swap(sh.out);
+      vector<char>().swap(sh.raw);
    } 
    
-   if (zw && !lz4writer_close(zw, err))
-      return zwError("lz4wirter_close"), 1;
+   if (zidx) {
+      vector<char> zbuf;
+      zidx->finish(zbuf);
+      delete zidx;
+      if (!xwrite(outfd, zbuf.data(), zbuf.size())) {
+	 cerr << "gensrclist: " << srclist_tmp << ": " << strerror(errno) << endl;
+	 return 1;
+      }
+   }
+   if (zw) {
+      bool ok = lz4writer_close(zw, err);
+      zw = NULL, outfd = -1;
+      if (!ok)
+	 return zwError("lz4writer_close"), 1;
+   }
+   else {
+      int rc = close(outfd);
+      outfd = -1;
+      if (rc != 0) {
+	 cerr << "gensrclist: " << srclist_tmp << ": " << strerror(errno) << endl;
+	 return 1;
+      }
+   }
+   if (prevMap)
+      munmap(prevMap, prevSize);
+
+   string statline;
+   if (tw) {
+      char md5[33];
+      uint64_t size;
+      bool ok = teewriter_close(tw, md5, &size, err);
+      tw = NULL;
+      if (!ok)
+	 return zwError("teewriter_close"), 1;
+      snprintf(buf, sizeof(buf), "%s %llu", md5, (unsigned long long) size);
+      statline = buf;
+      if (statfp) {
+	 fprintf(statfp, "%s\n", statline.c_str());
+	 if (fclose(statfp) != 0) {
+	    cerr << "gensrclist: " << op_stat << ": " << strerror(errno) << endl;
+	    return 1;
+	 }
+      }
+   }
+
+   if (rename(srclist_tmp.c_str(), srclist_path.c_str()) != 0) {
+      cerr << "gensrclist: cannot rename " << srclist_tmp << ": " << strerror(errno) << endl;
+      return 1;
+   }
+   tmpGuard.drop = []() { };
+
+   // Failing to save the fingerprint only means that the next run
+   // is not skipped.
+   if (fpr) {
+      if (!fpr->Save(outputs, statline))
+	 cerr << "gensrclist: warning: cannot save the fingerprint" << endl;
+      delete fpr;
+   }
 
    return 0;
 }
 
+#ifndef GENLISTS
+int main(int argc, char ** argv)
+{
+   return gensrclist(argc, argv, NULL);
+}
+#endif
+
 // vim:sts=3:sw=3
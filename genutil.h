@@ -64,8 +64,13 @@ void simpleProgress(unsigned int current, unsigned int total)
 
 #if RPM_VERSION >= 0x040100
 #include <rpm/rpmts.h>
+#include <mutex>
 #endif
 
+// Can be called from a few threads at once: the configuration is read
+// only once, and each thread has its own transaction set.  The older
+// rpmReadPackageHeader has no per-thread state, hence configure requires
+// RPM 4.1 or later.
 static
 Header readHeader(const char *path)
 {
@@ -74,9 +79,10 @@ Header readHeader(const char *path)
       return NULL;
    Header h = NULL;
 #if RPM_VERSION >= 0x040100
-   static rpmts ts = NULL;
+   static std::once_flag configOnce;
+   std::call_once(configOnce, []() { rpmReadConfigFiles(NULL, NULL); });
+   static thread_local rpmts ts = NULL;
    if (ts == NULL) {
-      rpmReadConfigFiles(NULL, NULL);
       ts = rpmtsCreate();
       assert(ts);
       rpmtsSetVSFlags(ts, (rpmVSFlags_e)-1);
@@ -84,8 +90,7 @@ Header readHeader(const char *path)
    int rc = rpmReadPackageFile(ts, fd, path, &h);
    bool ok = (rc == RPMRC_OK || rc == RPMRC_NOTTRUSTED || rc == RPMRC_NOKEY);
 #else
-   int rc = rpmReadPackageHeader(fd, &h, NULL, NULL, NULL);
-   bool ok = (rc == 0);
+#error "RPM 4.1 or later is required"
 #endif
    Fclose(fd);
    if (ok)
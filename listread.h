@@ -0,0 +1,130 @@
+/*
+ * Reading the lists in pieces, to be parsed in parallel
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <deque>
+#include <thread>
+
+// A piece of a list: either a compressed frame, or the headers read
+// through rpmio, back to back.  The lists in lz4 are mapped, and split
+// into frames without decompressing them (see zframe.h).
+struct listPiece {
+    const char *list;
+    const char *data;
+    size_t size;
+    bool lz4;
+};
+
+class ListReader
+{
+    std::vector<std::pair<void *, size_t> > maps;
+    // the headers of the lists read with rpmio; a deque, so that
+    // the buffers do not move
+    std::deque<std::string> bufs;
+public:
+    std::vector<struct listPiece> pieces;
+    ~ListReader()
+    {
+	for (size_t i = 0; i < maps.size(); i++)
+	    munmap(maps[i].first, maps[i].second);
+    }
+    bool add(const char *pkglist, std::string &err)
+    {
+	int fd = open(pkglist, O_RDONLY);
+	if (fd < 0)
+	    return err = strerror(errno), false;
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+	    err = strerror(errno);
+	    close(fd);
+	    return false;
+	}
+	void *map = MAP_FAILED;
+	if (S_ISREG(st.st_mode) && st.st_size >= 4)
+	    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	struct listPiece lp = { pkglist, NULL, 0, false };
+	if (map != MAP_FAILED) {
+	    size_t size = st.st_size;
+	    const unsigned char *base = (const unsigned char *) map;
+	    uint32_t magic = zframeLE32(base);
+	    if (magic == 0x184D2204 || (magic & 0xFFFFFFF0) == 0x184D2A50) {
+		maps.push_back(std::make_pair(map, size));
+		for (size_t off = 0; off < size; ) {
+		    bool skippable;
+		    size_t zsize = zframeSize(base + off, size - off, &skippable);
+		    if (zsize == 0)
+			return err = "bad lz4 frame at offset " + std::to_string(off), false;
+		    if (!skippable) {
+			lp.data = (const char *) base + off, lp.size = zsize, lp.lz4 = true;
+			pieces.push_back(lp);
+		    }
+		    off += zsize;
+		}
+		return true;
+	    }
+	    munmap(map, size);
+	}
+	FD_t Fd = Fopen(pkglist, "r.ufdio");
+	if (Ferror(Fd))
+	    return err = Fstrerror(Fd), false;
+	bufs.push_back(std::string());
+	std::string &buf = bufs.back();
+	Header h;
+	while ((h = headerRead(Fd, HEADER_MAGIC_YES)) != NULL) {
+	    unsigned blobSize;
+	    void *blob = headerExport(h, &blobSize);
+	    buf.append((const char *) zhdr_magic, sizeof zhdr_magic);
+	    buf.append((const char *) blob, blobSize);
+	    free(blob);
+	    headerFree(h);
+	}
+	Fclose(Fd);
+	lp.data = buf.data(), lp.size = buf.size();
+	pieces.push_back(lp);
+	return true;
+    }
+};
+
+// The headers of a piece, with magic, back to back; the frames are
+// decompressed into the per-thread buffer.  NULL if the frame does not
+// decompress.
+static const char *listPieceRaw(const struct listPiece &lp, size_t &size)
+{
+    if (lp.lz4)
+	return unzhdrFrame(lp.data, lp.size, size);
+    size = lp.size;
+    return lp.data;
+}
+
+// Run fn(i) for i in 0 ... n - 1, in as many threads as there are CPUs,
+// the threads taking the next batch of indices as they go.
+template<typename Fn>
+static void parallelFor(size_t n, size_t batch, Fn fn)
+{
+    std::atomic<size_t> next(0);
+    auto work = [&]()
+    {
+	size_t i;
+	while ((i = next.fetch_add(batch)) < n)
+	    for (size_t j = i; j < n && j < i + batch; j++)
+		fn(j);
+    };
+    size_t nthreads = std::thread::hardware_concurrency();
+    if (nthreads < 1)
+	nthreads = 1;
+    if (nthreads > (n + batch - 1) / batch)
+	nthreads = (n + batch - 1) / batch;
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < nthreads; i++)
+	threads.push_back(std::thread(work));
+    work();
+    for (size_t i = 0; i < threads.size(); i++)
+	threads[i].join();
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
@@ -18,52 +18,7 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
-#include <stdbool.h>
-#include <assert.h>
-#include <unistd.h>
-#include <errno.h>
-
-// Writes exactly size bytes.
-static bool xwrite(int fd, const void *buf, size_t size)
-{
-    assert(size);
-    bool zero = false;
-    do {
-	ssize_t ret = write(fd, buf, size);
-	if (ret < 0) {
-	    if (errno == EINTR)
-		continue;
-	    return false;
-	}
-	if (ret == 0) {
-	    if (zero) {
-		// write(2) keeps returning zero
-		errno = EAGAIN;
-		return false;
-	    }
-	    zero = true;
-	    continue;
-	}
-	zero = false;
-	assert(ret <= size);
-	buf = (char *) buf + ret;
-	size -= ret;
-    } while (size);
-
-    return true;
-}
-
-#include <stdio.h> // sys_errlist
-
-// A thread-safe strerror(3) replacement.
-static const char *xstrerror(int errnum)
-{
-    // Some of the great minds say that sys_errlist is deprecated.
-    // Well, at least it's thread-safe, and it does not deadlock.
-    if (errnum > 0 && errnum < sys_nerr)
-	return sys_errlist[errnum];
-    return "Unknown error";
-}
+#include "xwrite.h"
 
 // Helpers to fill err[2] arg.
 #define ERRNO(func) err[0] = func, err[1] = xstrerror(errno)
@@ -73,9 +28,31 @@ static const char *xstrerror(int errnum)
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <endian.h>
+#include <pthread.h>
+#include <lz4.h>
 #include <lz4frame.h>
 #include "lz4writer.h"
 
+// Big inputs are processed in 256K chunks.
+#define CHUNK (256 << 10)
+
+// In the threaded mode, the input is cut into CHUNK-sized blocks, which
+// are compressed independently by the threads and written in order by
+// a separate thread.  The blocks go round a ring of slots: the caller
+// fills a slot, the threads compress it, and the writer thread writes
+// it out and gives it back to the caller.  Thus the caller neither
+// compresses nor waits for the disk, as long as there are free slots.
+enum { SLOT_FREE, SLOT_QUEUED, SLOT_BUSY, SLOT_DONE };
+
+struct slot {
+    int state;
+    size_t size;
+    size_t zsize;
+    unsigned char *buf;
+    unsigned char *zbuf;
+};
+
 struct lz4writer {
     int fd;
     bool error;
@@ -84,19 +61,184 @@ struct lz4writer {
     off_t pos0;
     LZ4F_compressionContext_t zctx;
     unsigned char frameHeader[LZ4F_HEADER_SIZE_MAX];
+    // the threaded mode: the compression threads, and the writer thread
+    int nthreads;
+    int nstarted;
+    pthread_t *threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool quit;
+    int werrno;
+    unsigned nslots;
+    struct slot *slots;
+    // the slot being filled, the next one to compress, the next one to write
+    size_t fill, take, flush;
     size_t zbufSize;
     unsigned char zbuf[];
 };
 
-// Big inputs are processed in 256K chunks.
-#define CHUNK (256 << 10)
+static void *compressThread(void *arg)
+{
+    struct lz4writer *zw = arg;
+    pthread_mutex_lock(&zw->mutex);
+    while (1) {
+	struct slot *slot = &zw->slots[zw->take % zw->nslots];
+	if (slot->state != SLOT_QUEUED) {
+	    if (zw->quit)
+		break;
+	    pthread_cond_wait(&zw->cond, &zw->mutex);
+	    continue;
+	}
+	slot->state = SLOT_BUSY;
+	zw->take++;
+	pthread_mutex_unlock(&zw->mutex);
+	// The block is stored uncompressed unless it gets smaller,
+	// see lz4_Frame_format.md.
+	int zsize = LZ4_compress_default((const char *) slot->buf, (char *) slot->zbuf + 4,
+					 slot->size, slot->size - 1);
+	uint32_t bsize = zsize > 0 ? zsize : (0x80000000 | slot->size);
+	if (zsize <= 0)
+	    memcpy(slot->zbuf + 4, slot->buf, slot->size);
+	bsize = htole32(bsize);
+	memcpy(slot->zbuf, &bsize, 4);
+	slot->zsize = 4 + (zsize > 0 ? (size_t) zsize : slot->size);
+	pthread_mutex_lock(&zw->mutex);
+	slot->state = SLOT_DONE;
+	pthread_cond_broadcast(&zw->cond);
+    }
+    pthread_mutex_unlock(&zw->mutex);
+    return NULL;
+}
+
+static void *writeThread(void *arg)
+{
+    struct lz4writer *zw = arg;
+    pthread_mutex_lock(&zw->mutex);
+    while (1) {
+	struct slot *slot = &zw->slots[zw->flush % zw->nslots];
+	if (slot->state != SLOT_DONE) {
+	    if (zw->quit)
+		break;
+	    pthread_cond_wait(&zw->cond, &zw->mutex);
+	    continue;
+	}
+	// after a failed write, the rest is discarded
+	bool failed = zw->werrno;
+	pthread_mutex_unlock(&zw->mutex);
+	int werrno = 0;
+	if (!failed && !xwrite(zw->fd, slot->zbuf, slot->zsize))
+	    werrno = errno;
+	pthread_mutex_lock(&zw->mutex);
+	if (werrno)
+	    zw->werrno = werrno;
+	slot->state = SLOT_FREE;
+	slot->size = 0;
+	zw->flush++;
+	pthread_cond_broadcast(&zw->cond);
+    }
+    pthread_mutex_unlock(&zw->mutex);
+    return NULL;
+}
+
+// Wait until no more than the given number of slots are pending.
+static bool waitSlots(struct lz4writer *zw, size_t pending, const char *err[2])
+{
+    pthread_mutex_lock(&zw->mutex);
+    while (zw->fill - zw->flush > pending)
+	pthread_cond_wait(&zw->cond, &zw->mutex);
+    int werrno = zw->werrno;
+    pthread_mutex_unlock(&zw->mutex);
+    if (werrno)
+	return err[0] = "write", err[1] = xstrerror(werrno),
+	       zw->error = true, false;
+    return true;
+}
+
+// Hand the slot being filled to the threads, and make sure that the next
+// one is free.
+static bool queueSlot(struct lz4writer *zw, const char *err[2])
+{
+    pthread_mutex_lock(&zw->mutex);
+    zw->slots[zw->fill % zw->nslots].state = SLOT_QUEUED;
+    zw->fill++;
+    pthread_cond_broadcast(&zw->cond);
+    pthread_mutex_unlock(&zw->mutex);
+    return waitSlots(zw, zw->nslots - 1, err);
+}
+
+static void stopThreads(struct lz4writer *zw)
+{
+    pthread_mutex_lock(&zw->mutex);
+    zw->quit = true;
+    pthread_cond_broadcast(&zw->cond);
+    pthread_mutex_unlock(&zw->mutex);
+    for (int i = 0; i < zw->nstarted; i++)
+	pthread_join(zw->threads[i], NULL);
+    zw->nstarted = 0;
+}
+
+static void freeSlots(struct lz4writer *zw)
+{
+    if (zw->slots) {
+	for (unsigned i = 0; i < zw->nslots; i++)
+	    free(zw->slots[i].buf), free(zw->slots[i].zbuf);
+	free(zw->slots);
+    }
+    free(zw->threads);
+}
+
+// Start the threads, with twice as many slots and then some, so that
+// the threads need not wait for the writes, nor the caller for the threads.
+static bool startThreads(struct lz4writer *zw, int nthreads, const char *err[2])
+{
+    zw->nslots = 2 * nthreads + 2;
+    zw->slots = calloc(zw->nslots, sizeof *zw->slots);
+    zw->threads = calloc(nthreads + 1, sizeof *zw->threads);
+    if (!zw->slots || !zw->threads)
+	return ERRNO("calloc"),
+	       freeSlots(zw), false;
+    for (unsigned i = 0; i < zw->nslots; i++) {
+	zw->slots[i].buf = malloc(CHUNK);
+	zw->slots[i].zbuf = malloc(4 + CHUNK);
+	if (!zw->slots[i].buf || !zw->slots[i].zbuf)
+	    return ERRNO("malloc"),
+		   freeSlots(zw), false;
+    }
+    pthread_mutex_init(&zw->mutex, NULL);
+    pthread_cond_init(&zw->cond, NULL);
+    for (int i = 0; i <= nthreads; i++) {
+	int rc = pthread_create(&zw->threads[i], NULL, i ? compressThread : writeThread, zw);
+	if (rc) {
+	    err[0] = "pthread_create", err[1] = xstrerror(rc);
+	    stopThreads(zw);
+	    pthread_mutex_destroy(&zw->mutex);
+	    pthread_cond_destroy(&zw->cond);
+	    return freeSlots(zw), false;
+	}
+	zw->nstarted++;
+    }
+    zw->nthreads = nthreads;
+    return true;
+}
 
 struct lz4writer *lz4writer_fdopen(int fd, bool writeContentSize, bool writeChecksum, const char *err[2])
 {
+    return lz4writer_fdopen_mt(fd, writeContentSize, writeChecksum, 0, err);
+}
+
+struct lz4writer *lz4writer_fdopen_mt(int fd, bool writeContentSize, bool writeChecksum, int nthreads, const char *err[2])
+{
+    // The content checksum must be computed sequentially, which only
+    // LZ4F can do.
+    if (writeChecksum || nthreads < 0)
+	nthreads = 0;
+
     LZ4F_preferences_t pref;
     memset(&pref, 0, sizeof pref);
     pref.frameInfo.blockSizeID = LZ4F_max256KB;
     pref.frameInfo.contentChecksumFlag = writeChecksum;
+    if (nthreads)
+	pref.frameInfo.blockMode = LZ4F_blockIndependent;
 
     size_t zbufSize = LZ4F_compressBound(CHUNK, &pref);
     assert(!LZ4F_isError(zbufSize));
@@ -135,14 +277,37 @@ struct lz4writer *lz4writer_fdopen(int fd, bool writeContentSize, bool writeChec
 	return ERRNO("write"),
 	       LZ4F_freeCompressionContext(zw->zctx), free(zw), NULL;
 
+    if (nthreads && !startThreads(zw, nthreads, err))
+	return LZ4F_freeCompressionContext(zw->zctx), free(zw), NULL;
+
     return zw;
 }
 
+static bool write_mt(struct lz4writer *zw, const void *buf, size_t size, const char *err[2])
+{
+    while (size) {
+	struct slot *slot = &zw->slots[zw->fill % zw->nslots];
+	size_t n = CHUNK - slot->size;
+	if (n > size)
+	    n = size;
+	memcpy(slot->buf + slot->size, buf, n);
+	slot->size += n;
+	size -= n, buf = (const char *) buf + n;
+	if (slot->size == CHUNK && !queueSlot(zw, err))
+	    return false;
+    }
+    return true;
+}
+
 bool lz4writer_write(struct lz4writer *zw, const void *buf, size_t size, const char *err[2])
 {
     if (zw->error)
 	return ERRSTR("previous write failed"), false;
 
+    zw->contentSize += size;
+    if (zw->nthreads)
+	return write_mt(zw, buf, size, err);
+
     while (size) {
 	size_t chunk = size < CHUNK ? size : CHUNK;
 	size_t zsize = LZ4F_compressUpdate(zw->zctx, zw->zbuf, zw->zbufSize, buf, chunk, NULL);
@@ -161,6 +326,12 @@ bool lz4writer_write(struct lz4writer *zw, const void *buf, size_t size, const c
 
 static void justClose(struct lz4writer *zw)
 {
+    if (zw->nthreads) {
+	stopThreads(zw);
+	freeSlots(zw);
+	pthread_mutex_destroy(&zw->mutex);
+	pthread_cond_destroy(&zw->cond);
+    }
     close(zw->fd);
     LZ4F_freeCompressionContext(zw->zctx);
     free(zw);
@@ -174,10 +345,22 @@ bool lz4writer_close(struct lz4writer *zw, const char *err[2])
 	return ERRSTR("previous write failed"),
 	       justClose(zw), false;
 
-    size_t zsize = LZ4F_compressEnd(zw->zctx, zw->zbuf, zw->zbufSize, NULL);
-    if (LZ4F_isError(zsize))
-	return ERRLZ4("LZ4F_compressEnd", zsize),
-	       LZ4F_freeCompressionContext(zw->zctx), free(zw), NULL;
+    size_t zsize;
+    if (zw->nthreads) {
+	// the last partial block, then the EndMark
+	if (zw->slots[zw->fill % zw->nslots].size && !queueSlot(zw, err))
+	    return justClose(zw), false;
+	if (!waitSlots(zw, 0, err))
+	    return justClose(zw), false;
+	memset(zw->zbuf, 0, 4);
+	zsize = 4;
+    }
+    else {
+	zsize = LZ4F_compressEnd(zw->zctx, zw->zbuf, zw->zbufSize, NULL);
+	if (LZ4F_isError(zsize))
+	    return ERRLZ4("LZ4F_compressEnd", zsize),
+		   justClose(zw), false;
+    }
     assert(zsize);
 
     if (!xwrite(zw->fd, zw->zbuf, zsize))
@@ -28,6 +28,10 @@ extern "C" {
 #endif
 
 struct lz4writer *lz4writer_fdopen(int fd, bool writeContentSize, bool writeChecksum, const char *err[2]) __attribute__((nonnull));
+// Compress with nthreads threads, in independent blocks, and write in
+// yet another thread (only without the checksum, otherwise the same as
+// lz4writer_fdopen).
+struct lz4writer *lz4writer_fdopen_mt(int fd, bool writeContentSize, bool writeChecksum, int nthreads, const char *err[2]) __attribute__((nonnull));
 bool lz4writer_write(struct lz4writer *zw, const void *buf, size_t size, const char *err[2]) __attribute__((nonnull));
 bool lz4writer_close(struct lz4writer *zw, const char *err[2]) __attribute__((nonnull));
 
@@ -0,0 +1,101 @@
+#!/bin/sh -efu
+# Round trips of pkglist-delta: the delta made from two lists must
+# rebuild the new one byte for byte, and a bad delta must be rejected.
+
+delta=${PKGLIST_DELTA:-./pkglist-delta}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# An lz4 frame with one uncompressed block (FLG 0x60, BD 0x40, HC 0x82),
+# the payload being shorter than 256 bytes.  pkglist-delta only walks
+# the frames, so any payload will do.
+frame()
+{
+	n=$(printf %s "$1" | wc -c)
+	printf '\004\042\115\030\140\100\202'
+	printf "\\$(printf %03o $((n)))\\000\\000\\200"
+	printf %s "$1"
+	printf '\000\000\000\000'
+}
+
+# A skippable frame, such as the frame index.
+skippable()
+{
+	n=$(printf %s "$1" | wc -c)
+	printf '\120\052\115\030'
+	printf "\\$(printf %03o $((n)))\\000\\000\\000"
+	printf %s "$1"
+}
+
+list()
+{
+	for f; do
+		case $f in
+			skip:*) skippable "${f#skip:}" ;;
+			*) frame "$f" ;;
+		esac
+	done
+}
+
+fail()
+{
+	echo "FAIL: $*" >&2
+	exit 1
+}
+
+roundtrip()
+{
+	name=$1
+	"$delta" "$tmp/old" "$tmp/new" "$tmp/delta" ||
+		fail "$name: cannot make the delta"
+	"$delta" --apply "$tmp/old" "$tmp/delta" "$tmp/out" ||
+		fail "$name: cannot apply the delta"
+	cmp -s "$tmp/new" "$tmp/out" ||
+		fail "$name: the list is not rebuilt"
+	[ ! -e "$tmp/out.tmp" ] ||
+		fail "$name: the tmp file is left"
+	echo "ok: $name"
+}
+
+list foo-1.0 bar-2.0 baz-3.0 qux-4.0 skip:index >"$tmp/old"
+
+cp "$tmp/old" "$tmp/new"
+roundtrip same
+
+list foo-1.0 bar-2.1 baz-3.0 quux-1.0 qux-4.0 skip:index2 >"$tmp/new"
+roundtrip changed
+
+list qux-4.0 baz-3.0 skip:index foo-1.0 bar-2.0 >"$tmp/new"
+roundtrip reordered
+
+: >"$tmp/new"
+roundtrip "empty new"
+
+cp "$tmp/old" "$tmp/new"
+mv "$tmp/old" "$tmp/saved"
+: >"$tmp/old"
+roundtrip "empty old"
+mv "$tmp/saved" "$tmp/old"
+
+# The delta for the changed list, cut short at every length.
+list foo-1.0 bar-2.1 baz-3.0 quux-1.0 qux-4.0 >"$tmp/new"
+"$delta" "$tmp/old" "$tmp/new" "$tmp/delta" ||
+	fail "truncated: cannot make the delta"
+size=$(wc -c <"$tmp/delta")
+n=0
+while [ $n -lt $size ]; do
+	head -c $n "$tmp/delta" >"$tmp/cut"
+	! "$delta" --apply "$tmp/old" "$tmp/cut" "$tmp/out" 2>/dev/null ||
+		fail "truncated: the delta cut at $n is accepted"
+	n=$((n + 1))
+done
+echo "ok: truncated"
+
+# The delta applied to a list other than its base.
+list foo-1.0 bar-2.0 baz-3.1 qux-4.0 >"$tmp/other"
+rm -f "$tmp/out"
+! "$delta" --apply "$tmp/other" "$tmp/delta" "$tmp/out" 2>/dev/null ||
+	fail "wrong base: the delta is accepted"
+[ ! -e "$tmp/out" ] ||
+	fail "wrong base: the list is written"
+echo "ok: wrong base"
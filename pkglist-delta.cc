@@ -0,0 +1,289 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "zframe.h"
+
+// A delta describes the new list in terms of the frames of the old one:
+// the frames which are in the old list are copied by index, and the rest
+// of the bytes are included verbatim, so that the new list is rebuilt
+// byte for byte.  The delta is the header, followed by the ops:
+//	'c' first count		copy the old frames [first, first + count)
+//	'l' size bytes		append the bytes
+//	'e'			the end
+// The numbers are little-endian, the delta being made on one host
+// and applied on another.  In the ops, they are 32-bit: the longer runs
+// of bytes are split, and the old lists with more frames are refused.  The sizes and hashes of both lists are
+// in the header, and are checked when the delta is applied.
+static const char deltaMagic[8] = { 'p', 'k', 'g', 'd', 'e', 'l', 't', '1' };
+
+// magic, old size, old hash, new size, new hash
+#define DELTA_HDRSIZE (8 + 4 * 8)
+
+static const char *progname;
+
+// A file mapped in memory; an empty file has no mapping.
+struct mappedFile {
+    const unsigned char *data;
+    size_t size;
+    mappedFile() : data(NULL), size(0) { }
+    ~mappedFile()
+    {
+	if (size)
+	    munmap((void *) data, size);
+    }
+    bool map(const char *path)
+    {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	    return perr(path, strerror(errno));
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+	    perr(path, strerror(errno));
+	    close(fd);
+	    return false;
+	}
+	if (st.st_size > 0) {
+	    void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	    if (m == MAP_FAILED) {
+		perr(path, strerror(errno));
+		close(fd);
+		return false;
+	    }
+	    data = (const unsigned char *) m, size = st.st_size;
+	}
+	close(fd);
+	return true;
+    }
+    static bool perr(const char *path, const char *msg)
+    {
+	fprintf(stderr, "%s: %s: %s\n", progname, path, msg);
+	return false;
+    }
+};
+
+// The offsets of the frames of a list, skippable frames included,
+// with the end of the list last.
+static bool splitFrames(const char *path, const struct mappedFile &f,
+	std::vector<size_t> &offs)
+{
+    for (size_t off = 0; off < f.size; ) {
+	bool skippable;
+	size_t zsize = zframeSize(f.data + off, f.size - off, &skippable);
+	if (zsize == 0) {
+	    fprintf(stderr, "%s: %s: bad lz4 frame at offset %zu\n", progname, path, off);
+	    return false;
+	}
+	offs.push_back(off);
+	off += zsize;
+    }
+    offs.push_back(f.size);
+    return true;
+}
+
+static void putLE32(std::string &out, uint32_t x)
+{
+    for (int i = 0; i < 4; i++)
+	out += (char) (x >> (8 * i));
+}
+
+static void putLE64(std::string &out, uint64_t x)
+{
+    putLE32(out, x);
+    putLE32(out, x >> 32);
+}
+
+static uint64_t getLE64(const unsigned char *p)
+{
+    return zframeLE32(p) | (uint64_t) zframeLE32(p + 4) << 32;
+}
+
+// The file is written to a temporary file which is then renamed: the list
+// being replaced may be mapped by the readers, or be the old list itself.
+static bool writeFile(const char *path, const std::string &data)
+{
+    std::string tmp = std::string(path) + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "w");
+    if (fp == NULL) {
+	fprintf(stderr, "%s: %s: %s\n", progname, tmp.c_str(), strerror(errno));
+	return false;
+    }
+    fwrite(data.data(), 1, data.size(), fp);
+    if (ferror(fp) | fclose(fp)) {
+	fprintf(stderr, "%s: %s: write error\n", progname, tmp.c_str());
+	unlink(tmp.c_str());
+	return false;
+    }
+    if (rename(tmp.c_str(), path) < 0) {
+	fprintf(stderr, "%s: %s: %s\n", progname, path, strerror(errno));
+	unlink(tmp.c_str());
+	return false;
+    }
+    return true;
+}
+
+static int makeDelta(const char *oldList, const char *newList, const char *delta)
+{
+    struct mappedFile o, n;
+    if (!o.map(oldList) || !n.map(newList))
+	return 2;
+    std::vector<size_t> ooffs, noffs;
+    if (!splitFrames(oldList, o, ooffs) || !splitFrames(newList, n, noffs))
+	return 2;
+    size_t nold = ooffs.size() - 1;
+    if (nold > UINT32_MAX) {
+	fprintf(stderr, "%s: %s: too many frames\n", progname, oldList);
+	return 2;
+    }
+    auto osize = [&](size_t i) { return ooffs[i+1] - ooffs[i]; };
+    std::unordered_multimap<uint64_t, uint32_t> oldFrames;
+    for (size_t i = 0; i < nold; i++)
+	oldFrames.insert(std::make_pair(zframeHash(o.data + ooffs[i], osize(i)), i));
+
+    std::string out(deltaMagic, sizeof deltaMagic);
+    putLE64(out, o.size);
+    putLE64(out, zframeHash(o.data, o.size));
+    putLE64(out, n.size);
+    putLE64(out, zframeHash(n.data, n.size));
+    // the pending op, copy or literal, is flushed when the other one
+    // comes, so that the runs are merged
+    size_t copyFirst = 0, copyCount = 0;
+    size_t litOff = 0, litSize = 0;
+    auto flush = [&]()
+    {
+	if (copyCount) {
+	    out += 'c';
+	    putLE32(out, copyFirst);
+	    putLE32(out, copyCount);
+	    copyCount = 0;
+	}
+	while (litSize) {
+	    size_t size = litSize < UINT32_MAX ? litSize : UINT32_MAX;
+	    out += 'l';
+	    putLE32(out, size);
+	    out.append((const char *) n.data + litOff, size);
+	    litOff += size, litSize -= size;
+	}
+    };
+    for (size_t j = 0; j + 1 < noffs.size(); j++) {
+	const unsigned char *p = n.data + noffs[j];
+	size_t size = noffs[j+1] - noffs[j];
+	auto same = [&](size_t i) { return osize(i) == size && memcmp(o.data + ooffs[i], p, size) == 0; };
+	// the next old frame is the likely match
+	size_t next = copyFirst + copyCount;
+	if (copyCount && next < nold && same(next)) {
+	    copyCount++;
+	    continue;
+	}
+	size_t match = nold;
+	auto range = oldFrames.equal_range(zframeHash(p, size));
+	for (auto it = range.first; it != range.second; ++it)
+	    if (same(it->second)) {
+		match = it->second;
+		break;
+	    }
+	if (match < nold) {
+	    flush();
+	    copyFirst = match, copyCount = 1;
+	}
+	else {
+	    if (copyCount)
+		flush();
+	    if (litSize == 0)
+		litOff = noffs[j];
+	    litSize += size;
+	}
+    }
+    flush();
+    out += 'e';
+    return writeFile(delta, out) ? 0 : 2;
+}
+
+static int applyDelta(const char *oldList, const char *delta, const char *newList)
+{
+    struct mappedFile o, d;
+    if (!o.map(oldList) || !d.map(delta))
+	return 2;
+    auto bad = [&]()
+    {
+	fprintf(stderr, "%s: %s: bad delta\n", progname, delta);
+	return 2;
+    };
+    if (d.size < DELTA_HDRSIZE || memcmp(d.data, deltaMagic, sizeof deltaMagic))
+	return bad();
+    const unsigned char *h = d.data + sizeof deltaMagic;
+    if (getLE64(h) != o.size || getLE64(h + 8) != zframeHash(o.data, o.size)) {
+	fprintf(stderr, "%s: %s: the delta is not for %s\n", progname, delta, oldList);
+	return 2;
+    }
+    uint64_t newSize = getLE64(h + 16);
+    uint64_t newHash = getLE64(h + 24);
+    std::vector<size_t> ooffs;
+    if (!splitFrames(oldList, o, ooffs))
+	return 2;
+    size_t nold = ooffs.size() - 1;
+    std::string out;
+    out.reserve(newSize);
+    const unsigned char *p = d.data + DELTA_HDRSIZE;
+    const unsigned char *end = d.data + d.size;
+    while (1) {
+	if (p == end)
+	    return bad();
+	char op = *p++;
+	if (op == 'e')
+	    break;
+	if (end - p < 4)
+	    return bad();
+	uint32_t a = zframeLE32(p);
+	p += 4;
+	if (op == 'c') {
+	    if (end - p < 4)
+		return bad();
+	    uint32_t count = zframeLE32(p);
+	    p += 4;
+	    if (a > nold || count > nold - a)
+		return bad();
+	    out.append((const char *) o.data + ooffs[a], ooffs[a+count] - ooffs[a]);
+	}
+	else if (op == 'l') {
+	    if ((size_t) (end - p) < a)
+		return bad();
+	    out.append((const char *) p, a);
+	    p += a;
+	}
+	else
+	    return bad();
+    }
+    if (p != end || out.size() != newSize || zframeHash(out.data(), out.size()) != newHash)
+	return bad();
+    return writeFile(newList, out) ? 0 : 2;
+}
+
+int main(int argc, char *argv[])
+{
+    progname = argv[0];
+    if (argc == 5 && strcmp(argv[1], "--apply") == 0)
+	return applyDelta(argv[2], argv[3], argv[4]);
+    if (argc == 4 && argv[1][0] != '-')
+	return makeDelta(argv[1], argv[2], argv[3]);
+    fprintf(stderr, "Usage: %s <old-pkglist> <new-pkglist> <delta>\n"
+		    "       %s --apply <old-pkglist> <delta> <new-pkglist>\n",
+		    progname, progname);
+    return 2;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
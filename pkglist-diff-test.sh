@@ -0,0 +1,100 @@
+#!/bin/sh -efu
+# Round trips of pkglist-diff: the packages must be reported as added,
+# removed, updated or rebuilt, and the packages whose headers have not
+# changed must not be reported, wherever their frames are.
+
+diff=${PKGLIST_DIFF:-./pkglist-diff}
+helper=${PKGLIST_TEST:-./pkglist-test}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+fail()
+{
+	echo "FAIL: $*" >&2
+	exit 1
+}
+
+# name, version, arch, and the size, which is only there to tell
+# the rebuilt headers from the same ones
+pkg()
+{
+	cat <<-EOF
+	s NAME $1
+	s VERSION $2
+	s RELEASE alt1
+	s ARCH $3
+	i SIZE ${4:-1}
+
+	EOF
+}
+
+list()
+{
+	"$helper" mklist "$tmp/$1" ||
+		fail "cannot make the $1 list"
+}
+
+{
+	pkg foo 1.0 x86_64
+	pkg libfoo 1.0 x86_64
+	echo --
+	pkg bar 2.0 noarch
+	echo --
+	pkg baz 3.0 noarch
+	echo --
+	pkg qux 4.0 noarch
+	echo --
+	pkg zed 5.0 noarch
+} | list old
+
+# foo and libfoo are in the same frame, zed is in another one
+{
+	pkg foo 1.0 x86_64
+	pkg libfoo 1.0 x86_64
+	echo --
+	pkg bar 2.1 noarch
+	echo --
+	pkg baz 3.0 noarch 2
+	echo --
+	pkg quux 1.0 noarch
+	pkg zed 5.0 noarch
+	echo --
+	pkg foo 1.0 i586
+} | list new
+
+# all of the old packages, in one frame
+{
+	pkg foo 1.0 x86_64
+	pkg libfoo 1.0 x86_64
+	pkg bar 2.0 noarch
+	pkg baz 3.0 noarch
+	pkg qux 4.0 noarch
+	pkg zed 5.0 noarch
+} | list regrouped
+
+check()
+{
+	name=$1 expect=$2 old=$3 new=$4
+	rc=0
+	"$diff" "$tmp/$old" "$tmp/$new" >"$tmp/out" || rc=$?
+	[ -n "$expect" ] && want=1 || want=0
+	[ $rc = $want ] ||
+		fail "$name: exits with $rc"
+	printf '%s' "$expect" | cmp -s - "$tmp/out" ||
+		fail "$name: $(cat "$tmp/out")"
+	echo "ok: $name"
+}
+check same '' old old
+check regrouped '' old regrouped
+check changed 'updated	bar-2.0-alt1.noarch	bar-2.1-alt1.noarch
+rebuilt	baz-3.0-alt1.noarch
+added	foo-1.0-alt1.i586
+added	quux-1.0-alt1.noarch
+removed	qux-4.0-alt1.noarch
+' old new
+check reversed 'updated	bar-2.1-alt1.noarch	bar-2.0-alt1.noarch
+rebuilt	baz-3.0-alt1.noarch
+removed	foo-1.0-alt1.i586
+removed	quux-1.0-alt1.noarch
+added	qux-4.0-alt1.noarch
+' new old
@@ -0,0 +1,183 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <rpm/rpmlib.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+
+#include "crpmtag.h"
+#include "zhdr.h"
+#include "zframe.h"
+#include "rawhdr.h"
+#include "listread.h"
+
+// The lists are compared frame by frame: the frames whose compressed
+// bytes are the same in both lists, which is most of them, are matched
+// by their hashes without decompressing them.  Only the rest of the frames
+// (the srpm groups which have changed) are decompressed, and their packages
+// are matched by name and arch.  A package whose header has not changed,
+// e.g. because its group was only recompressed, is not reported.
+
+static const char *progname;
+
+// A package of a changed frame.
+struct diffPkg {
+    std::string key; // name and arch, sorted by name
+    std::string nevra;
+    std::string evr;
+    uint64_t hash; // of the header
+};
+
+static bool parsePiece(const struct listPiece &lp, std::vector<struct diffPkg> &pkgs)
+{
+    size_t size;
+    const char *p = listPieceRaw(lp, size);
+    if (p == NULL)
+	return false;
+    while (size) {
+	size_t hsize = rawhdrSize(p, size);
+	if (hsize == 0)
+	    return false;
+	const char *name = rawhdrString(p, hsize, RPMTAG_NAME);
+	const char *version = rawhdrString(p, hsize, RPMTAG_VERSION);
+	const char *release = rawhdrString(p, hsize, RPMTAG_RELEASE);
+	const char *arch = rawhdrString(p, hsize, RPMTAG_ARCH);
+	if (name == NULL || version == NULL || release == NULL)
+	    return false;
+	std::vector<uint32_t> epoch;
+	struct diffPkg pkg;
+	pkg.key = name;
+	if (arch)
+	    pkg.key += std::string(1, '\0') + arch;
+	if (rawhdrInt32s(p, hsize, RPMTAG_EPOCH, epoch) && epoch.size() == 1)
+	    pkg.evr = std::to_string(epoch[0]) + ':';
+	pkg.evr += std::string(version) + '-' + release;
+	pkg.nevra = std::string(name) + '-' + pkg.evr;
+	if (arch)
+	    pkg.nevra += std::string(".") + arch;
+	pkg.hash = zframeHash(p, hsize);
+	pkgs.push_back(pkg);
+	p += hsize, size -= hsize;
+    }
+    return true;
+}
+
+// The packages of the frames which have no match in the other list.
+static bool changedPackages(const ListReader &lr, const std::vector<bool> &matched,
+	std::vector<struct diffPkg> &pkgs)
+{
+    std::vector<size_t> todo;
+    for (size_t i = 0; i < lr.pieces.size(); i++)
+	if (!matched[i])
+	    todo.push_back(i);
+    std::vector<std::vector<struct diffPkg> > out(todo.size());
+    std::vector<char> ok(todo.size());
+    parallelFor(todo.size(), 1, [&](size_t j)
+	    { ok[j] = parsePiece(lr.pieces[todo[j]], out[j]); });
+    for (size_t j = 0; j < todo.size(); j++) {
+	if (!ok[j]) {
+	    fprintf(stderr, "%s: %s: bad frame or header\n", progname, lr.pieces[todo[j]].list);
+	    return false;
+	}
+	pkgs.insert(pkgs.end(), out[j].begin(), out[j].end());
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    progname = argv[0];
+    if (argc != 3) {
+	fprintf(stderr, "Usage: %s <old-pkglist> <new-pkglist>\n"
+		"Prints the packages which have been added, removed, updated\n"
+		"(the version has changed) and rebuilt (the same version).\n"
+		"Exits with 1 if the lists differ.\n", progname);
+	return 2;
+    }
+    ListReader lr[2];
+    std::string err;
+    for (int k = 0; k < 2; k++)
+	if (!lr[k].add(argv[1+k], err)) {
+	    fprintf(stderr, "%s: %s: %s\n", progname, argv[1+k], err.c_str());
+	    return 2;
+	}
+
+    // Match the frames by the hashes of the compressed bytes.
+    std::vector<uint64_t> hashes[2];
+    for (int k = 0; k < 2; k++) {
+	const std::vector<struct listPiece> &pieces = lr[k].pieces;
+	hashes[k].resize(pieces.size());
+	parallelFor(pieces.size(), 64, [&](size_t i)
+		{ hashes[k][i] = zframeHash(pieces[i].data, pieces[i].size); });
+    }
+    std::vector<bool> matched[2];
+    matched[0].resize(lr[0].pieces.size());
+    matched[1].resize(lr[1].pieces.size());
+    std::unordered_multimap<uint64_t, size_t> oldFrames;
+    for (size_t i = 0; i < hashes[0].size(); i++)
+	oldFrames.insert(std::make_pair(hashes[0][i], i));
+    for (size_t j = 0; j < hashes[1].size(); j++) {
+	const struct listPiece &b = lr[1].pieces[j];
+	auto range = oldFrames.equal_range(hashes[1][j]);
+	for (auto it = range.first; it != range.second; ++it) {
+	    const struct listPiece &a = lr[0].pieces[it->second];
+	    if (a.size == b.size && memcmp(a.data, b.data, a.size) == 0) {
+		matched[0][it->second] = matched[1][j] = true;
+		oldFrames.erase(it);
+		break;
+	    }
+	}
+    }
+
+    // Decompress the rest, and match the packages by name and arch.
+    std::vector<struct diffPkg> pkgs[2];
+    for (int k = 0; k < 2; k++)
+	if (!changedPackages(lr[k], matched[k], pkgs[k]))
+	    return 2;
+    std::map<std::string, std::pair<std::vector<size_t>, std::vector<size_t> > > byKey;
+    for (size_t i = 0; i < pkgs[0].size(); i++)
+	byKey[pkgs[0][i].key].first.push_back(i);
+    for (size_t i = 0; i < pkgs[1].size(); i++)
+	byKey[pkgs[1][i].key].second.push_back(i);
+    int rc = 0;
+    for (auto &kv : byKey) {
+	std::vector<size_t> &olds = kv.second.first;
+	std::vector<size_t> &news = kv.second.second;
+	// the same versions first
+	for (size_t a = 0; a < olds.size(); a++)
+	    for (size_t b = 0; b < news.size(); b++) {
+		const struct diffPkg &o = pkgs[0][olds[a]];
+		const struct diffPkg &n = pkgs[1][news[b]];
+		if (o.evr != n.evr)
+		    continue;
+		if (o.hash != n.hash)
+		    printf("rebuilt\t%s\n", n.nevra.c_str()), rc = 1;
+		olds.erase(olds.begin() + a--);
+		news.erase(news.begin() + b);
+		break;
+	    }
+	size_t a = 0, b = 0;
+	for (; a < olds.size() && b < news.size(); a++, b++)
+	    printf("updated\t%s\t%s\n", pkgs[0][olds[a]].nevra.c_str(),
+		    pkgs[1][news[b]].nevra.c_str());
+	for (; a < olds.size(); a++)
+	    printf("removed\t%s\n", pkgs[0][olds[a]].nevra.c_str());
+	for (; b < news.size(); b++)
+	    printf("added\t%s\n", pkgs[1][news[b]].nevra.c_str());
+	if (olds.size() || news.size())
+	    rc = 1;
+    }
+    return rc;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
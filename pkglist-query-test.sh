@@ -0,0 +1,186 @@
+#!/bin/sh -efu
+# Round trips of pkglist-query: the frame index written with the list
+# must find the headers, the formats which are compiled must print what
+# librpm prints, and --where must select the same headers with the frame
+# index as without it.
+
+query=${PKGLIST_QUERY:-./pkglist-query}
+helper=${PKGLIST_TEST:-./pkglist-test}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+fail()
+{
+	echo "FAIL: $*" >&2
+	exit 1
+}
+
+# Three srpm groups, one frame each.  bar has no epoch, and baz has
+# neither the epoch nor the provides and requires.
+cat >"$tmp/desc" <<'EOF'
+s NAME foo
+i EPOCH 1
+s VERSION 1.0
+s RELEASE alt1
+s ARCH x86_64
+s SOURCERPM foo-1.0-alt1.src.rpm
+s CRPMTAG_FILENAME foo-1.0-alt1.x86_64.rpm
+a PROVIDENAME foo
+i PROVIDEFLAGS 8
+a PROVIDEVERSION 1:1.0-alt1
+
+s NAME libfoo
+i EPOCH 1
+s VERSION 1.0
+s RELEASE alt1
+s ARCH x86_64
+s SOURCERPM foo-1.0-alt1.src.rpm
+s CRPMTAG_FILENAME libfoo-1.0-alt1.x86_64.rpm
+a PROVIDENAME libfoo libfoo.so.1()(64bit)
+i PROVIDEFLAGS 8 0
+a PROVIDEVERSION 1:1.0-alt1 ""
+a REQUIRENAME foo
+i REQUIREFLAGS 8
+a REQUIREVERSION 1:1.0-alt1
+--
+s NAME bar
+s VERSION 2.0
+s RELEASE alt1
+s ARCH noarch
+s SOURCERPM bar-2.0-alt1.src.rpm
+s CRPMTAG_FILENAME bar-2.0-alt1.noarch.rpm
+a PROVIDENAME bar
+i PROVIDEFLAGS 8
+a PROVIDEVERSION 2.0-alt1
+a REQUIRENAME /bin/sh libfoo.so.1()(64bit)
+i REQUIREFLAGS 0 0
+a REQUIREVERSION "" ""
+--
+s NAME baz
+s VERSION 3.0
+s RELEASE alt1
+s ARCH noarch
+s SOURCERPM baz-3.0-alt1.src.rpm
+s CRPMTAG_FILENAME baz-3.0-alt1.noarch.rpm
+EOF
+"$helper" mklist "$tmp/list" <"$tmp/desc" ||
+	fail "cannot make the list"
+"$helper" mklist --raw "$tmp/raw" <"$tmp/desc" ||
+	fail "cannot make the raw list"
+
+# The frame index.
+"$helper" index "$tmp/list" "$tmp/seekable" ||
+	fail "index: cannot write the index"
+size=$(wc -c <"$tmp/list")
+head -c $size "$tmp/seekable" | cmp -s - "$tmp/list" ||
+	fail "index: the frames are changed"
+
+lookup()
+{
+	"$helper" lookup "$tmp/seekable" "$1" "$2" >"$tmp/out" ||
+		fail "index: $1 $2 is not found"
+	printf '%s\n' "$3" | cmp -s - "$tmp/out" ||
+		fail "index: $1 $2: $(cat "$tmp/out")"
+}
+lookup name libfoo '0 libfoo foo-1.0-alt1.src.rpm libfoo-1.0-alt1.x86_64.rpm'
+lookup name baz '2 baz baz-3.0-alt1.src.rpm baz-3.0-alt1.noarch.rpm'
+lookup srpm foo-1.0-alt1.src.rpm '0 foo foo-1.0-alt1.src.rpm foo-1.0-alt1.x86_64.rpm
+0 libfoo foo-1.0-alt1.src.rpm libfoo-1.0-alt1.x86_64.rpm'
+lookup file bar-2.0-alt1.noarch.rpm '1 bar bar-2.0-alt1.src.rpm bar-2.0-alt1.noarch.rpm'
+! "$helper" lookup "$tmp/seekable" name qux >"$tmp/out" &&
+	[ ! -s "$tmp/out" ] ||
+	fail "index: qux is found"
+echo "ok: index"
+
+# The index which does not check is not loaded, and the list is read
+# as if it had no index.
+head -c $(($(wc -c <"$tmp/seekable") - 1)) "$tmp/seekable" >"$tmp/cut"
+cp "$tmp/seekable" "$tmp/longer"
+echo >>"$tmp/longer"
+cp "$tmp/seekable" "$tmp/bad"
+# the number of frames, right after the skippable frame header and magic
+printf '\377\000\000\000' | dd of="$tmp/bad" bs=1 seek=$((size + 16)) conv=notrunc 2>/dev/null
+for f in cut longer bad; do
+	! "$helper" lookup "$tmp/$f" name foo >/dev/null 2>&1 ||
+		fail "index: the $f index is loaded"
+done
+"$query" --where NAME=bar '%{NAME}\n' "$tmp/bad" >"$tmp/out" ||
+	fail "index: cannot query the list with the bad index"
+echo bar | cmp -s - "$tmp/out" ||
+	fail "index: the list with the bad index is not read"
+echo "ok: bad index"
+
+# The formats which are compiled are checked against the raw list,
+# which is read with rpmio, and formatted by librpm.  EPOCH is missing
+# from bar and baz, and PROVIDENAME and REQUIRENAME are missing from baz:
+# those headers are left to librpm.
+same()
+{
+	name=$1 format=$2
+	rc=0
+	"$query" "$format" "$tmp/list" >"$tmp/out" 2>"$tmp/err" || rc=$?
+	rawrc=0
+	"$query" "$format" "$tmp/raw" >"$tmp/rawout" 2>/dev/null || rawrc=$?
+	[ $rc = $rawrc ] ||
+		fail "$name: exits with $rc, not $rawrc: $(cat "$tmp/err")"
+	cmp -s "$tmp/rawout" "$tmp/out" ||
+		fail "$name: the output differs from librpm"
+	[ $# -lt 3 ] || printf '%s' "$3" | cmp -s - "$tmp/out" ||
+		fail "$name: $(cat "$tmp/out")"
+	echo "ok: $name"
+}
+same nvra '%{NAME}-%{VERSION}-%{RELEASE}.%{ARCH}\n' 'foo-1.0-alt1.x86_64
+libfoo-1.0-alt1.x86_64
+bar-2.0-alt1.noarch
+baz-3.0-alt1.noarch
+'
+same literals 'name:\t%{NAME}%%\n' 'name:	foo%
+name:	libfoo%
+name:	bar%
+name:	baz%
+'
+same "missing tag" '%{NAME} %{EPOCH}\n'
+same array '%{NAME}:[ %{REQUIRENAME}]\n'
+same "missing array tag" '[%{PROVIDENAME} %{PROVIDEFLAGS} %{PROVIDEVERSION}\n]'
+
+# --where, with the index and without it.
+where()
+{
+	name=$1 expect=$2
+	shift 2
+	for f in list seekable raw; do
+		"$query" "$@" '%{NAME}\n' "$tmp/$f" >"$tmp/out" ||
+			fail "where $name: cannot query the $f list"
+		printf '%s' "$expect" | cmp -s - "$tmp/out" ||
+			fail "where $name: the $f list gives $(cat "$tmp/out")"
+	done
+	echo "ok: where $name"
+}
+where name 'bar
+' --where NAME=bar
+where srpm 'foo
+libfoo
+' --where SOURCERPM=foo-1.0-alt1.src.rpm
+where glob 'foo
+libfoo
+' --where 'NAME=*foo'
+where provides 'libfoo
+' --where 'PROVIDENAME=libfoo.so.*'
+where both '' --where NAME=foo --where ARCH=noarch
+where none '' --where NAME=qux
+
+# With the index, the frames which have none of the selected headers
+# are not read: the last frame is damaged, and only the queries which
+# need it fail.
+sed '/^s NAME baz$/,$d' "$tmp/desc" | "$helper" mklist "$tmp/head" ||
+	fail "cannot make the list without baz"
+printf 'XXXX' | dd of="$tmp/seekable" bs=1 seek=$(wc -c <"$tmp/head") conv=notrunc 2>/dev/null
+"$query" --where NAME=bar '%{NAME}\n' "$tmp/seekable" >"$tmp/out" ||
+	fail "skip: the damaged frame is read"
+echo bar | cmp -s - "$tmp/out" ||
+	fail "skip: $(cat "$tmp/out")"
+! "$query" --where NAME=baz '%{NAME}\n' "$tmp/seekable" >/dev/null 2>&1 ||
+	fail "skip: the damaged frame is not reported"
+! "$query" --where 'PROVIDENAME=bar' '%{NAME}\n' "$tmp/seekable" >/dev/null 2>&1 ||
+	fail "skip: the frames are skipped without the index"
+echo "ok: skip"
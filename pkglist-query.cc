@@ -3,45 +3,283 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <rpm/rpmlib.h>
 
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "crpmtag.h"
+#include "zhdr.h"
+#include "zframe.h"
+#include "strtab.h"
+#include "rawhdr.h"
+#include "zindex.h"
+#include "qformat.h"
+#include "qfilter.h"
+#include "qrpm.h"
+
+static const char *progname;
+
+// The old way, for the lists which are not in lz4: headerRead
+// through rpmio, one header at a time.
+static int queryFd(const char *pkglist, const char *format, const QueryFilter &where)
+{
+    FD_t Fd = Fopen(pkglist, "r.ufdio");
+    if (Ferror(Fd)) {
+	fprintf(stderr, "%s: %s: %s\n", progname, pkglist, Fstrerror(Fd));
+	return 1;
+    }
+    int rc = 0;
+    Header h;
+    std::string raw;
+    while ((h = headerRead(Fd, HEADER_MAGIC_YES)) != NULL) {
+	if (!where.empty()) {
+	    unsigned blobSize;
+	    void *blob = headerExport(h, &blobSize);
+	    raw.assign((const char *) zhdr_magic, sizeof zhdr_magic);
+	    raw.append((const char *) blob, blobSize);
+	    free(blob);
+	    if (!where.match(raw.data(), raw.size())) {
+		headerFree(h);
+		continue;
+	    }
+	}
+	const char *err = "unknown error";
+	char *str = formatHeader(h, format, &err);
+	if (str == NULL) {
+	    rc = 1;
+	    fprintf(stderr, "%s: %s: %s\n", progname, pkglist, err);
+	}
+	else {
+	    fputs(str, stdout);
+	    free(str);
+	}
+	headerFree(h);
+    }
+    Fclose(Fd);
+    return rc;
+}
+
+// The formatted output of a frame, with the error which has stopped it,
+// if any, and the headers which have failed to format.
+struct frameOutput {
+    bool ready;
+    std::string out;
+    const char *err;
+    std::vector<const char *> hdrErrs;
+};
+
+// Format the selected headers of a frame.
+static void queryFrame(const void *zblob, size_t zsize, const char *format,
+	const QueryFormat &qf, const QueryFilter &where, struct frameOutput &fo)
+{
+    size_t size;
+    const char *p = unzhdrFrame(zblob, zsize, size);
+    if (p == NULL) {
+	fo.err = "bad lz4 frame";
+	return;
+    }
+    while (size) {
+	size_t hsize = rawhdrSize(p, size);
+	if (hsize == 0) {
+	    fo.err = "bad header";
+	    return;
+	}
+	if (!where.empty() && !where.match(p, hsize)) {
+	    p += hsize, size -= hsize;
+	    continue;
+	}
+	// as with rpmio, a header which fails is reported, and skipped
+	const char *err;
+	if (!formatRaw(p, hsize, format, qf, fo.out, &err))
+	    fo.hdrErrs.push_back(err);
+	p += hsize, size -= hsize;
+    }
+}
+
+// The frames are decompressed, imported and formatted by the threads,
+// and the output is written in the original order.  The threads only
+// keep that many frames ahead of the output.
+static const size_t maxAhead = 1024;
+
+static int queryFrames(const char *pkglist, const char *format,
+	const QueryFormat &qf, const QueryFilter &where,
+	const std::vector<std::pair<const char *, size_t> > &frames)
+{
+    std::vector<struct frameOutput> outputs(frames.size());
+    for (size_t i = 0; i < outputs.size(); i++)
+	outputs[i].ready = false, outputs[i].err = NULL;
+    std::mutex mtx;
+    std::condition_variable cond;
+    size_t next = 0, written = 0;
+    auto work = [&]()
+    {
+	std::unique_lock<std::mutex> lock(mtx);
+	while (1) {
+	    while (next < frames.size() && next >= written + maxAhead)
+		cond.wait(lock);
+	    if (next >= frames.size())
+		break;
+	    size_t i = next++;
+	    lock.unlock();
+	    queryFrame(frames[i].first, frames[i].second, format, qf, where, outputs[i]);
+	    lock.lock();
+	    outputs[i].ready = true;
+	    cond.notify_all();
+	}
+    };
+    if (frames.empty())
+	return 0;
+    int nthreads = std::thread::hardware_concurrency();
+    if (nthreads < 1)
+	nthreads = 1;
+    if ((size_t) nthreads > frames.size())
+	nthreads = frames.size();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < nthreads; i++)
+	threads.push_back(std::thread(work));
+    int rc = 0;
+    for (size_t i = 0; i < frames.size(); i++) {
+	struct frameOutput &fo = outputs[i];
+	{
+	    std::unique_lock<std::mutex> lock(mtx);
+	    while (!fo.ready)
+		cond.wait(lock);
+	}
+	// what was formatted before the error still goes out
+	fwrite(fo.out.data(), 1, fo.out.size(), stdout);
+	for (const char *err : fo.hdrErrs) {
+	    rc = 1;
+	    fprintf(stderr, "%s: %s: %s\n", progname, pkglist, err);
+	}
+	if (fo.err) {
+	    rc = 1;
+	    fprintf(stderr, "%s: %s: %s\n", progname, pkglist, fo.err);
+	}
+	std::string().swap(fo.out);
+	std::lock_guard<std::mutex> lock(mtx);
+	written = i + 1;
+	cond.notify_all();
+    }
+    for (size_t i = 0; i < threads.size(); i++)
+	threads[i].join();
+    return rc;
+}
+
+// The lists in lz4 are mapped, and split into frames without decompressing
+// them.  With the frame index, only the frames which may have the selected
+// headers are taken.  Returns -1 if the file is not in lz4, and should be
+// read with rpmio.
+static int queryMap(const char *pkglist, const char *format,
+	const QueryFormat &qf, const QueryFilter &where)
+{
+    int fd = open(pkglist, O_RDONLY);
+    if (fd < 0) {
+	fprintf(stderr, "%s: %s: %s\n", progname, pkglist, strerror(errno));
+	return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+	fprintf(stderr, "%s: %s: %s\n", progname, pkglist, strerror(errno));
+	close(fd);
+	return 1;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size < 4) {
+	close(fd);
+	return -1;
+    }
+    size_t size = st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+	return -1;
+    const unsigned char *base = (const unsigned char *) map;
+    uint32_t magic = zframeLE32(base);
+    if (magic != 0x184D2204 && (magic & 0xFFFFFFF0) != 0x184D2A50) {
+	munmap(map, size);
+	return -1;
+    }
+    std::vector<std::pair<const char *, size_t> > frames;
+    ZIndex zi;
+    if (where.useIndex() && zi.load(map, size)) {
+	std::vector<bool> want(zi.frames());
+	for (unsigned i = 0; i < zi.entries(); i++)
+	    if (where.matchEntry(zi.name(i), zi.srpm(i), zi.file(i)))
+		want[zi.frameOf(i)] = true;
+	for (unsigned f = 0; f < want.size(); f++) {
+	    if (!want[f])
+		continue;
+	    size_t zsize;
+	    const void *zblob = zi.frame(f, zsize);
+	    frames.push_back(std::make_pair((const char *) zblob, zsize));
+	}
+	int rc = queryFrames(pkglist, format, qf, where, frames);
+	munmap(map, size);
+	return rc;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    for (size_t off = 0; off < size; ) {
+	bool skippable;
+	size_t zsize = zframeSize(base + off, size - off, &skippable);
+	if (zsize == 0) {
+	    fprintf(stderr, "%s: %s: bad lz4 frame at offset %zu\n", progname, pkglist, off);
+	    munmap(map, size);
+	    return 1;
+	}
+	if (!skippable)
+	    frames.push_back(std::make_pair((const char *) base + off, zsize));
+	off += zsize;
+    }
+    int rc = queryFrames(pkglist, format, qf, where, frames);
+    munmap(map, size);
+    return rc;
+}
+
 int main(int argc, char *argv[])
 {
-    const char *progname = argv[0];
-    if (argc < 3) {
-	fprintf(stderr, "Usage: %s <format> <pkglist>...\n", progname);
+    progname = argv[0];
+    QueryFilter where;
+    int ix = 1;
+    while (argv[ix] && strncmp(argv[ix], "--where", 7) == 0) {
+	const char *expr;
+	if (argv[ix][7] == '=')
+	    expr = argv[ix++] + 8;
+	else if (argv[ix][7] == '\0' && argv[ix+1])
+	    expr = argv[ix+1], ix += 2;
+	else
+	    break;
+	if (!where.add(expr, lookupTag)) {
+	    fprintf(stderr, "%s: bad predicate: %s\n", progname, expr);
+	    return 2;
+	}
+    }
+    if (argc - ix < 2) {
+	fprintf(stderr, "Usage: %s [--where TAG=VALUE]... <format> <pkglist>...\n", progname);
 	return 2;
     }
-    const char *format = argv[1];
+    const char *format = argv[ix++];
+    QueryFormat qf(format, lookupTag);
     int rc = 0;
     const char *pkglist;
-    int ix = 2;
     while ((pkglist = argv[ix++]) != NULL) {
-	FD_t Fd = Fopen(pkglist, "r.ufdio");
-	if (Ferror(Fd)) {
-	    fprintf(stderr, "%s: %s: %s\n", progname, pkglist, Fstrerror(Fd));
+	int ret = queryMap(pkglist, format, qf, where);
+	if (ret < 0)
+	    ret = queryFd(pkglist, format, where);
+	if (ret)
 	    rc = 1;
-	    continue;
-	}
-	Header h;
-	while ((h = headerRead(Fd, HEADER_MAGIC_YES)) != NULL) {
-	    const char *err = "unknown error";
-#ifdef HAVE_HEADERFORMAT
-	    char *str = headerFormat(h, format, &err);
-#else
-	    char *str = headerSprintf(h, format, rpmTagTable, rpmHeaderFormats, &err);
-#endif
-	    if (str == NULL) {
-		rc = 1;
-		fprintf(stderr, "%s: %s: %s\n", progname, pkglist, err);
-	    }
-	    else {
-		fputs(str, stdout);
-		free(str);
-	    }
-	    headerFree(h);
-	}
-	Fclose(Fd);
     }
     return rc;
 }
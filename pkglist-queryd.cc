@@ -0,0 +1,434 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <rpm/rpmlib.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include "crpmtag.h"
+#include "zhdr.h"
+#include "zframe.h"
+#include "strtab.h"
+#include "rawhdr.h"
+#include "listread.h"
+#include "qformat.h"
+#include "qrpm.h"
+
+// The daemon loads the lists once, decompressed, and answers the queries
+// over a Unix socket, one query per connection.  The query is a single
+// line, the kind of the lookup, the key and the query format, separated
+// by tabs:
+//
+//	name<TAB>bash<TAB>%{NAME}-%{VERSION}-%{RELEASE}\n
+//	provides<TAB>libc.so.6<TAB>%{NAME}\n
+//	filename<TAB>bash-4.4.23-alt1.x86_64.rpm<TAB>%{SIZE}\n
+//	all<TAB><TAB>%{NAME}\n
+//
+// The reply is "ok" and then the formatted headers, or "error: ..." and
+// the message, and the connection is closed.  If some of the headers fail
+// to format, they are skipped, and the first line is "partial: ..." with
+// the number of them and the first error.  When the lists (or the file
+// given with --watch, e.g. base/release) change, the lists are loaded
+// again in the background, and the new lists replace the old ones at once:
+// the queries in progress are answered from the old ones.
+
+static const char *progname;
+
+// The lookups by key: the headers with the i-th key (in the order
+// the keys were interned) are ids[first[i]] ... ids[first[i+1]-1].
+class KeyIndex
+{
+    StrIntern keys;
+    std::vector<uint32_t> first, ids;
+    std::vector<std::pair<unsigned, uint32_t> > pairs;
+    std::vector<uint32_t> last;
+public:
+    // The same key is only added once per header.
+    void add(const char *key, uint32_t hdr)
+    {
+	unsigned id = keys.intern(key);
+	if (id == last.size())
+	    last.push_back(UINT32_MAX);
+	if (last[id] == hdr)
+	    return;
+	last[id] = hdr;
+	pairs.push_back(std::make_pair(id, hdr));
+    }
+    // Group the headers by key, keeping their order.
+    void finish()
+    {
+	first.assign(keys.count() + 1, 0);
+	for (const auto &p : pairs)
+	    first[p.first+1]++;
+	for (size_t i = 1; i < first.size(); i++)
+	    first[i] += first[i-1];
+	ids.resize(pairs.size());
+	std::vector<uint32_t> pos(first.begin(), first.end() - 1);
+	for (const auto &p : pairs)
+	    ids[pos[p.first]++] = p.second;
+	std::vector<std::pair<unsigned, uint32_t> >().swap(pairs);
+	std::vector<uint32_t>().swap(last);
+    }
+    const uint32_t *find(const char *key, unsigned &count) const
+    {
+	int id = keys.find(key);
+	if (id < 0) {
+	    count = 0;
+	    return NULL;
+	}
+	count = first[id+1] - first[id];
+	return ids.data() + first[id];
+    }
+};
+
+// The lists, decompressed and indexed.
+class ListDB
+{
+    std::vector<std::vector<char> > bufs;
+    std::vector<std::pair<const char *, size_t> > hdrs;
+public:
+    KeyIndex byName, byProvide, byFileName;
+    bool load(const std::vector<const char *> &lists, std::string &err)
+    {
+	ListReader lr;
+	for (const char *list : lists)
+	    if (!lr.add(list, err))
+		return err = std::string(list) + ": " + err, false;
+	bufs.resize(lr.pieces.size());
+	std::vector<const char *> errs(bufs.size());
+	parallelFor(bufs.size(), 1, [&](size_t i)
+	{
+	    size_t size;
+	    const char *p = listPieceRaw(lr.pieces[i], size);
+	    if (p == NULL)
+		errs[i] = "bad lz4 frame";
+	    else
+		bufs[i].assign(p, p + size);
+	});
+	std::vector<const char *> provides;
+	for (size_t i = 0; i < bufs.size(); i++) {
+	    if (errs[i])
+		return err = std::string(lr.pieces[i].list) + ": " + errs[i], false;
+	    const char *p = bufs[i].data();
+	    size_t size = bufs[i].size();
+	    while (size) {
+		size_t hsize = rawhdrSize(p, size);
+		const char *name = hsize ? rawhdrString(p, hsize, RPMTAG_NAME) : NULL;
+		if (name == NULL)
+		    return err = std::string(lr.pieces[i].list) + ": bad header", false;
+		uint32_t h = hdrs.size();
+		hdrs.push_back(std::make_pair(p, hsize));
+		byName.add(name, h);
+		byProvide.add(name, h);
+		provides.clear();
+		rawhdrStrings(p, hsize, RPMTAG_PROVIDENAME, provides);
+		for (const char *prov : provides)
+		    byProvide.add(prov, h);
+		const char *fname = rawhdrString(p, hsize, CRPMTAG_FILENAME);
+		if (fname)
+		    byFileName.add(fname, h);
+		p += hsize, size -= hsize;
+	    }
+	}
+	byName.finish();
+	byProvide.finish();
+	byFileName.finish();
+	return true;
+    }
+    size_t count() const { return hdrs.size(); }
+    const char *header(uint32_t i, size_t &size) const
+    {
+	size = hdrs[i].second;
+	return hdrs[i].first;
+    }
+};
+
+static std::mutex dbMutex;
+static std::shared_ptr<const ListDB> db;
+
+static std::shared_ptr<const ListDB> currentDB()
+{
+    std::lock_guard<std::mutex> lock(dbMutex);
+    return db;
+}
+
+// Answer the query; false with the message in out if it fails.  The headers
+// which fail to format are counted in nerr, with the first error in herr.
+static bool query(const ListDB &ldb, char *line, std::string &out,
+	unsigned &nerr, const char *&herr)
+{
+    char *key = strchr(line, '\t');
+    char *format = key ? strchr(key + 1, '\t') : NULL;
+    if (format == NULL)
+	return out = "bad query", false;
+    *key++ = '\0', *format++ = '\0';
+    const uint32_t *ids = NULL;
+    unsigned count = 0;
+    if (strcmp(line, "name") == 0)
+	ids = ldb.byName.find(key, count);
+    else if (strcmp(line, "provides") == 0)
+	ids = ldb.byProvide.find(key, count);
+    else if (strcmp(line, "filename") == 0)
+	ids = ldb.byFileName.find(key, count);
+    else if (strcmp(line, "all") == 0)
+	count = ldb.count();
+    else
+	return out = std::string("unknown lookup: ") + line, false;
+    QueryFormat qf(format, lookupTag);
+    nerr = 0, herr = NULL;
+    for (unsigned i = 0; i < count; i++) {
+	size_t size;
+	const char *h = ldb.header(ids ? ids[i] : i, size);
+	const char *err;
+	// as with pkglist-query, a header which fails is skipped
+	if (!formatRaw(h, size, format, qf, out, &err) && nerr++ == 0)
+	    herr = err;
+    }
+    return true;
+}
+
+// The longest query line.
+static const size_t maxQuery = 64 << 10;
+
+// The time a client has to send the query, and to take the reply.  Each
+// read and write also times out, so that a client which does not read
+// cannot hold a worker (and the lists it is answering from) for long.
+static const int ioTimeout = 10;
+static const int replyTimeout = 60;
+
+static bool sendAll(int fd, const char *p, size_t size, time_t deadline)
+{
+    while (size) {
+	if (time(NULL) > deadline)
+	    return false;
+	ssize_t n = write(fd, p, size);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return false;
+	p += n, size -= n;
+    }
+    return true;
+}
+
+static void serve(int fd)
+{
+    struct timeval tv = { ioTimeout, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+    std::string line;
+    char buf[4096];
+    while (line.find('\n') == std::string::npos && line.size() < maxQuery) {
+	ssize_t n = read(fd, buf, sizeof buf);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    break;
+	line.append(buf, n);
+    }
+    size_t eol = line.find('\n');
+    std::string out;
+    bool ok;
+    unsigned nerr = 0;
+    const char *herr = NULL;
+    if (eol == std::string::npos)
+	ok = false, out = "bad query";
+    else {
+	line.resize(eol);
+	// the lists are not held while the reply is being sent
+	std::shared_ptr<const ListDB> ldb = currentDB();
+	ok = query(*ldb, &line[0], out, nerr, herr);
+    }
+    std::string head;
+    if (!ok)
+	head = "error: " + out + "\n";
+    else if (nerr)
+	head = "partial: " + std::to_string(nerr) + " headers failed: " + herr + "\n";
+    else
+	head = "ok\n";
+    time_t deadline = time(NULL) + replyTimeout;
+    if (sendAll(fd, head.data(), head.size(), deadline) && ok)
+	sendAll(fd, out.data(), out.size(), deadline);
+    close(fd);
+}
+
+// The connections accepted and not yet served.
+static std::mutex connMutex;
+static std::condition_variable connCond;
+static std::deque<int> conns;
+
+static void worker()
+{
+    while (1) {
+	int fd;
+	{
+	    std::unique_lock<std::mutex> lock(connMutex);
+	    while (conns.empty())
+		connCond.wait(lock);
+	    fd = conns.front();
+	    conns.pop_front();
+	}
+	serve(fd);
+    }
+}
+
+// The state of the watched files, to tell when they change.
+static std::string watchState(const std::vector<const char *> &files)
+{
+    std::string state;
+    for (const char *file : files) {
+	struct stat st;
+	char buf[128];
+	if (stat(file, &st) < 0)
+	    snprintf(buf, sizeof buf, "-;");
+	else
+	    snprintf(buf, sizeof buf, "%lu:%lu:%lld:%lld.%09ld;",
+		    (unsigned long) st.st_dev, (unsigned long) st.st_ino,
+		    (long long) st.st_size, (long long) st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+	state += buf;
+    }
+    return state;
+}
+
+// Load the lists again when the watched files change, and have settled.
+static void reloader(std::vector<const char *> lists, std::vector<const char *> watch,
+	std::string state, int interval)
+{
+    while (1) {
+	sleep(interval);
+	std::string now = watchState(watch);
+	if (now == state)
+	    continue;
+	// still being written
+	sleep(interval);
+	if (watchState(watch) != now)
+	    continue;
+	state = now;
+	std::shared_ptr<ListDB> ldb(new ListDB);
+	std::string err;
+	if (!ldb->load(lists, err)) {
+	    fprintf(stderr, "%s: reload failed: %s\n", progname, err.c_str());
+	    continue;
+	}
+	fprintf(stderr, "%s: reloaded %zu headers\n", progname, ldb->count());
+	std::lock_guard<std::mutex> lock(dbMutex);
+	db = ldb;
+    }
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: %s [<options>] <pkglist>...\n"
+	    "Options:\n"
+	    "   --socket <path>     the Unix socket to listen on (required)\n"
+	    "   --watch <file>      reload when the file changes, e.g. base/release;\n"
+	    "                       by default, when any of the lists changes\n"
+	    "   --interval <secs>   how often to check for changes (default 2)\n",
+	    progname);
+}
+
+int main(int argc, char *argv[])
+{
+    progname = argv[0];
+    const char *sockPath = NULL;
+    std::vector<const char *> watch;
+    int interval = 2;
+    int ix = 1;
+    for (; ix < argc && strncmp(argv[ix], "--", 2) == 0; ix++) {
+	if (strcmp(argv[ix], "--socket") == 0 && ix + 1 < argc)
+	    sockPath = argv[++ix];
+	else if (strcmp(argv[ix], "--watch") == 0 && ix + 1 < argc)
+	    watch.push_back(argv[++ix]);
+	else if (strcmp(argv[ix], "--interval") == 0 && ix + 1 < argc)
+	    interval = atoi(argv[++ix]);
+	else if (strcmp(argv[ix], "--") == 0) {
+	    ix++;
+	    break;
+	}
+	else {
+	    usage();
+	    return 2;
+	}
+    }
+    if (sockPath == NULL || ix == argc || interval < 1) {
+	usage();
+	return 2;
+    }
+    std::vector<const char *> lists(argv + ix, argv + argc);
+    if (watch.empty())
+	watch = lists;
+
+    std::string state = watchState(watch);
+    std::shared_ptr<ListDB> ldb(new ListDB);
+    std::string err;
+    if (!ldb->load(lists, err)) {
+	fprintf(stderr, "%s: %s\n", progname, err.c_str());
+	return 1;
+    }
+    db = ldb;
+    ldb.reset();
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen(sockPath) >= sizeof addr.sun_path) {
+	fprintf(stderr, "%s: %s: socket path too long\n", progname, sockPath);
+	return 1;
+    }
+    strcpy(addr.sun_path, sockPath);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+	fprintf(stderr, "%s: socket: %s\n", progname, strerror(errno));
+	return 1;
+    }
+    // the socket left by the previous run, but nothing else
+    struct stat st;
+    if (lstat(sockPath, &st) == 0 && S_ISSOCK(st.st_mode))
+	unlink(sockPath);
+    if (bind(sock, (struct sockaddr *) &addr, sizeof addr) < 0 || listen(sock, 128) < 0) {
+	fprintf(stderr, "%s: %s: %s\n", progname, sockPath, strerror(errno));
+	return 1;
+    }
+    // the clients which go away should not kill the daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    int nthreads = std::thread::hardware_concurrency();
+    if (nthreads < 1)
+	nthreads = 1;
+    for (int i = 0; i < nthreads; i++)
+	std::thread(worker).detach();
+    std::thread(reloader, lists, watch, state, interval).detach();
+    while (1) {
+	int fd = accept(sock, NULL, NULL);
+	if (fd < 0) {
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    fprintf(stderr, "%s: accept: %s\n", progname, strerror(errno));
+	    return 1;
+	}
+	std::lock_guard<std::mutex> lock(connMutex);
+	conns.push_back(fd);
+	connCond.notify_one();
+    }
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,108 @@
+#!/bin/sh -efu
+# Round trips of pkglist-snapshot: the snapshot of the lists must load
+# and give back the packages, and a snapshot which does not check must
+# be rejected.
+
+snapshot=${PKGLIST_SNAPSHOT:-./pkglist-snapshot}
+helper=${PKGLIST_TEST:-./pkglist-test}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+fail()
+{
+	echo "FAIL: $*" >&2
+	exit 1
+}
+
+cat >"$tmp/desc" <<'EOF'
+s NAME foo
+i EPOCH 1
+s VERSION 1.0
+s RELEASE alt1
+s ARCH x86_64
+s SOURCERPM foo-1.0-alt1.src.rpm
+i SIZE 1000
+i CRPMTAG_FILESIZE 300
+s CRPMTAG_FILENAME foo-1.0-alt1.x86_64.rpm
+a PROVIDENAME foo libfoo.so.1()(64bit)
+i PROVIDEFLAGS 8 0
+a PROVIDEVERSION 1:1.0-alt1 ""
+a OBSOLETENAME oldfoo
+i OBSOLETEFLAGS 2
+a OBSOLETEVERSION 1.0
+--
+s NAME bar
+s VERSION 2.0
+s RELEASE alt1
+s ARCH noarch
+s SOURCERPM bar-2.0-alt1.src.rpm
+i SIZE 20
+i CRPMTAG_FILESIZE 10
+s CRPMTAG_FILENAME bar-2.0-alt1.noarch.rpm
+a REQUIRENAME foo /bin/sh
+a CONFLICTNAME baz
+EOF
+cat >"$tmp/expect" <<'EOF'
+foo 1:1.0-alt1.x86_64 foo-1.0-alt1.src.rpm 1000 300 foo-1.0-alt1.x86_64.rpm
+	P foo 8 1:1.0-alt1
+	P libfoo.so.1()(64bit) 0
+	O oldfoo 2 1.0
+bar 2.0-alt1.noarch bar-2.0-alt1.src.rpm 20 10 bar-2.0-alt1.noarch.rpm
+	R foo 0
+	R /bin/sh 0
+	C baz 0
+foo 1:1.0-alt1.x86_64 foo-1.0-alt1.src.rpm 1000 300 foo-1.0-alt1.x86_64.rpm
+	P foo 8 1:1.0-alt1
+	P libfoo.so.1()(64bit) 0
+	O oldfoo 2 1.0
+bar 2.0-alt1.noarch bar-2.0-alt1.src.rpm 20 10 bar-2.0-alt1.noarch.rpm
+	R foo 0
+	R /bin/sh 0
+	C baz 0
+EOF
+"$helper" mklist "$tmp/list" <"$tmp/desc" ||
+	fail "cannot make the list"
+"$helper" mklist --raw "$tmp/raw" <"$tmp/desc" ||
+	fail "cannot make the raw list"
+
+# The packages of the lz4 list, then the same packages of the list
+# read with rpmio.
+"$snapshot" "$tmp/snap" "$tmp/list" "$tmp/raw" ||
+	fail "cannot make the snapshot"
+[ ! -e "$tmp/snap.tmp" ] ||
+	fail "the tmp file is left"
+"$helper" snapshot "$tmp/snap" >"$tmp/out" ||
+	fail "cannot load the snapshot"
+cmp -s "$tmp/expect" "$tmp/out" ||
+	fail "the snapshot gives $(cat "$tmp/out")"
+echo "ok: snapshot"
+
+# The snapshot is in native byte order: the header is 40 bytes, and
+# then go the columns, npkg entries each: name, epoch, version, release,
+# arch, srpm, ...
+bad()
+{
+	name=$1
+	rc=0
+	"$helper" snapshot "$tmp/bad" >/dev/null 2>"$tmp/err" || rc=$?
+	[ $rc = 2 ] && grep -qs 'bad snapshot' "$tmp/err" ||
+		fail "$name: the snapshot is loaded"
+	echo "ok: $name"
+}
+size=$(wc -c <"$tmp/snap")
+head -c $((size - 1)) "$tmp/snap" >"$tmp/bad"
+bad "truncated snapshot"
+cp "$tmp/snap" "$tmp/bad"
+echo >>"$tmp/bad"
+bad "longer snapshot"
+cp "$tmp/snap" "$tmp/bad"
+printf 'X' | dd of="$tmp/bad" bs=1 conv=notrunc 2>/dev/null
+bad "bad magic"
+cp "$tmp/snap" "$tmp/bad"
+printf '\377\377\377\177' | dd of="$tmp/bad" bs=1 seek=40 conv=notrunc 2>/dev/null
+bad "bad name"
+cp "$tmp/snap" "$tmp/bad"
+# the srpm of the first package, out of the two srpms
+npkg=4
+printf '\007\000\000\000' | dd of="$tmp/bad" bs=1 seek=$((40 + 4 * npkg * 5)) conv=notrunc 2>/dev/null
+bad "bad srpm"
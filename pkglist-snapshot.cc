@@ -0,0 +1,252 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <rpm/rpmlib.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "crpmtag.h"
+#include "zhdr.h"
+#include "zframe.h"
+#include "strtab.h"
+#include "rawhdr.h"
+#include "listread.h"
+#include "snapshot.h"
+
+static const char *progname;
+
+// The name, flags and version tags of each kind of dependencies.
+static const int32_t depTags[SNAP_NDEPKIND][3] = {
+    { RPMTAG_PROVIDENAME, RPMTAG_PROVIDEFLAGS, RPMTAG_PROVIDEVERSION },
+    { RPMTAG_REQUIRENAME, RPMTAG_REQUIREFLAGS, RPMTAG_REQUIREVERSION },
+    { RPMTAG_CONFLICTNAME, RPMTAG_CONFLICTFLAGS, RPMTAG_CONFLICTVERSION },
+    { RPMTAG_OBSOLETENAME, RPMTAG_OBSOLETEFLAGS, RPMTAG_OBSOLETEVERSION },
+};
+
+// The rows of a piece of a list (see listread.h), as parsed by one of
+// the threads.  The strings are offsets into the pool of the piece,
+// including the srpm column; they are interned when the pieces are merged.
+struct pieceRows {
+    std::vector<char> pool;
+    std::vector<uint32_t> cols[SNAP_NCOL];
+    std::vector<uint32_t> ndep[SNAP_NDEPKIND];
+    std::vector<uint32_t> dname[SNAP_NDEPKIND];
+    std::vector<uint32_t> dflags[SNAP_NDEPKIND];
+    std::vector<uint32_t> dversion[SNAP_NDEPKIND];
+    const char *err;
+};
+
+static uint32_t poolAdd(std::vector<char> &pool, const char *s)
+{
+    if (s == NULL || *s == '\0')
+	return 0;
+    uint32_t off = pool.size();
+    pool.insert(pool.end(), s, s + strlen(s) + 1);
+    return off;
+}
+
+// The columns with pool offsets; the srpm column is special.
+static bool isStrCol(int c)
+{
+    return c == SNAP_NAME || c == SNAP_VERSION || c == SNAP_RELEASE ||
+	   c == SNAP_ARCH || c == SNAP_FILENAME;
+}
+
+static uint32_t rawInt32(const char *h, size_t size, int32_t tag, uint32_t dflt)
+{
+    std::vector<uint32_t> v;
+    if (!rawhdrInt32s(h, size, tag, v) || v.size() != 1)
+	return dflt;
+    return v[0];
+}
+
+static bool parseHeader(const char *h, size_t size, struct pieceRows &pr)
+{
+    const char *name = rawhdrString(h, size, RPMTAG_NAME);
+    if (name == NULL)
+	return false;
+    auto &c = pr.cols;
+    c[SNAP_NAME].push_back(poolAdd(pr.pool, name));
+    c[SNAP_EPOCH].push_back(rawInt32(h, size, RPMTAG_EPOCH, SNAP_NONE));
+    c[SNAP_VERSION].push_back(poolAdd(pr.pool, rawhdrString(h, size, RPMTAG_VERSION)));
+    c[SNAP_RELEASE].push_back(poolAdd(pr.pool, rawhdrString(h, size, RPMTAG_RELEASE)));
+    c[SNAP_ARCH].push_back(poolAdd(pr.pool, rawhdrString(h, size, RPMTAG_ARCH)));
+    c[SNAP_SRPM].push_back(poolAdd(pr.pool, rawhdrString(h, size, RPMTAG_SOURCERPM)));
+    c[SNAP_SIZE].push_back(rawInt32(h, size, RPMTAG_SIZE, 0));
+    c[SNAP_FILESIZE].push_back(rawInt32(h, size, CRPMTAG_FILESIZE, 0));
+    c[SNAP_FILENAME].push_back(poolAdd(pr.pool, rawhdrString(h, size, CRPMTAG_FILENAME)));
+    std::vector<const char *> names, versions;
+    std::vector<uint32_t> flags;
+    for (int k = 0; k < SNAP_NDEPKIND; k++) {
+	names.clear(), versions.clear(), flags.clear();
+	rawhdrStrings(h, size, depTags[k][0], names);
+	// the flags and versions need not be there
+	if (!rawhdrInt32s(h, size, depTags[k][1], flags) ||
+	    !rawhdrStrings(h, size, depTags[k][2], versions) ||
+	    flags.size() != names.size() || versions.size() != names.size())
+	    flags.clear(), versions.clear();
+	pr.ndep[k].push_back(names.size());
+	for (size_t i = 0; i < names.size(); i++) {
+	    pr.dname[k].push_back(poolAdd(pr.pool, names[i]));
+	    pr.dflags[k].push_back(flags.size() ? flags[i] : 0);
+	    pr.dversion[k].push_back(versions.size() ? poolAdd(pr.pool, versions[i]) : 0);
+	}
+    }
+    return true;
+}
+
+static void parsePiece(const struct listPiece &lp, struct pieceRows &pr)
+{
+    pr.err = NULL;
+    // the offset 0 is for the missing strings
+    pr.pool.push_back('\0');
+    size_t size;
+    const char *p = listPieceRaw(lp, size);
+    if (p == NULL) {
+	pr.err = "bad lz4 frame";
+	return;
+    }
+    while (size) {
+	size_t hsize = rawhdrSize(p, size);
+	if (hsize == 0 || !parseHeader(p, hsize, pr)) {
+	    pr.err = "bad header";
+	    return;
+	}
+	p += hsize, size -= hsize;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    progname = argv[0];
+    if (argc < 3) {
+	fprintf(stderr, "Usage: %s <snapshot> <pkglist>...\n", progname);
+	return 2;
+    }
+    const char *output = argv[1];
+    ListReader lr;
+    std::string err;
+    for (int ix = 2; ix < argc; ix++)
+	if (!lr.add(argv[ix], err)) {
+	    fprintf(stderr, "%s: %s: %s\n", progname, argv[ix], err.c_str());
+	    return 1;
+	}
+    std::vector<struct pieceRows> rows(lr.pieces.size());
+    parallelFor(rows.size(), 1, [&](size_t i) { parsePiece(lr.pieces[i], rows[i]); });
+
+    // Merge the pieces in order, interning the strings.
+    StrIntern strs, srpmNames;
+    strs.intern("");
+    std::vector<uint32_t> cols[SNAP_NCOL];
+    std::vector<uint32_t> first[SNAP_NDEPKIND];
+    std::vector<uint32_t> dname[SNAP_NDEPKIND], dflags[SNAP_NDEPKIND], dversion[SNAP_NDEPKIND];
+    for (int k = 0; k < SNAP_NDEPKIND; k++)
+	first[k].push_back(0);
+    for (size_t i = 0; i < rows.size(); i++) {
+	const struct pieceRows &pr = rows[i];
+	if (pr.err) {
+	    fprintf(stderr, "%s: %s: %s\n", progname, lr.pieces[i].list, pr.err);
+	    return 1;
+	}
+	const char *pool = pr.pool.data();
+	for (int c = 0; c < SNAP_NCOL; c++)
+	    for (uint32_t v : pr.cols[c]) {
+		if (c == SNAP_SRPM)
+		    v = v ? srpmNames.intern(pool + v) : SNAP_NONE;
+		else if (isStrCol(c))
+		    v = strs.intern(pool + v);
+		cols[c].push_back(v);
+	    }
+	for (int k = 0; k < SNAP_NDEPKIND; k++) {
+	    for (uint32_t n : pr.ndep[k])
+		first[k].push_back(first[k].back() + n);
+	    for (size_t j = 0; j < pr.dname[k].size(); j++) {
+		dname[k].push_back(strs.intern(pool + pr.dname[k][j]));
+		dflags[k].push_back(pr.dflags[k][j]);
+		dversion[k].push_back(strs.intern(pool + pr.dversion[k][j]));
+	    }
+	}
+	std::vector<char>().swap(rows[i].pool);
+    }
+
+    // The srpm names are sorted, and the srpm column refers to them
+    // by rank.
+    std::vector<unsigned> ranks;
+    srpmNames.rank(ranks);
+    std::vector<uint32_t> srpms(srpmNames.count());
+    for (unsigned id = 0; id < srpms.size(); id++)
+	srpms[ranks[id]] = strs.intern(srpmNames.str(id));
+    for (uint32_t &v : cols[SNAP_SRPM])
+	if (v != SNAP_NONE)
+	    v = ranks[v];
+
+    // The ids are replaced with the offsets in the pool, where the empty
+    // string, interned first, is at offset 0.
+    StrPool pool;
+    std::vector<uint32_t> offs(strs.count());
+    for (unsigned id = 0; id < offs.size(); id++)
+	offs[id] = pool.add(strs.str(id));
+    assert(offs[0] == 0);
+    auto remap = [&](std::vector<uint32_t> &v)
+    {
+	for (uint32_t &x : v)
+	    x = offs[x];
+    };
+    for (int c = 0; c < SNAP_NCOL; c++)
+	if (isStrCol(c))
+	    remap(cols[c]);
+    for (int k = 0; k < SNAP_NDEPKIND; k++)
+	remap(dname[k]), remap(dversion[k]);
+    remap(srpms);
+
+    struct SnapshotHeader h;
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, snapshotMagic, sizeof h.magic);
+    h.npkg = cols[SNAP_NAME].size();
+    h.nsrpm = srpms.size();
+    for (int k = 0; k < SNAP_NDEPKIND; k++)
+	h.ndep[k] = dname[k].size();
+    h.poolsize = pool.size();
+    // The snapshot is written to a temporary file which is then renamed:
+    // the readers may have the old one mapped.
+    std::string tmp = std::string(output) + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "w");
+    if (fp == NULL) {
+	fprintf(stderr, "%s: %s: %s\n", progname, tmp.c_str(), strerror(errno));
+	return 1;
+    }
+    auto put = [&](const std::vector<uint32_t> &v)
+    {
+	if (v.size())
+	    fwrite(v.data(), sizeof v[0], v.size(), fp);
+    };
+    fwrite(&h, sizeof h, 1, fp);
+    for (int c = 0; c < SNAP_NCOL; c++)
+	put(cols[c]);
+    for (int k = 0; k < SNAP_NDEPKIND; k++)
+	put(first[k]), put(dname[k]), put(dflags[k]), put(dversion[k]);
+    put(srpms);
+    fwrite(pool.get(0), 1, pool.size(), fp);
+    if (ferror(fp) | fclose(fp)) {
+	fprintf(stderr, "%s: %s: write error\n", progname, tmp.c_str());
+	unlink(tmp.c_str());
+	return 1;
+    }
+    if (rename(tmp.c_str(), output) < 0) {
+	fprintf(stderr, "%s: %s: %s\n", progname, output, strerror(errno));
+	unlink(tmp.c_str());
+	return 1;
+    }
+    return 0;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
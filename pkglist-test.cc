@@ -0,0 +1,319 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <rpm/rpmlib.h>
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+
+#include "crpmtag.h"
+#include "zhdr.h"
+#include "zframe.h"
+#include "strtab.h"
+#include "rawhdr.h"
+#include "zindex.h"
+#include "snapshot.h"
+#include "qformat.h"
+#include "qrpm.h"
+
+// The helper of the tests, not installed: it makes the lists out of
+// a text description, so that the tests need no packages, and it reads
+// back the formats which have no tool of their own to read them.
+
+static const char *progname;
+
+static bool readFile(const char *path, std::string &data)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+	fprintf(stderr, "%s: %s: %s\n", progname, path, strerror(errno));
+	return false;
+    }
+    char buf[BUFSIZ];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof buf, fp)) > 0)
+	data.append(buf, n);
+    if (ferror(fp) | fclose(fp)) {
+	fprintf(stderr, "%s: %s: read error\n", progname, path);
+	return false;
+    }
+    return true;
+}
+
+static bool writeFile(const char *path, const std::string &data)
+{
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+	fprintf(stderr, "%s: %s: %s\n", progname, path, strerror(errno));
+	return false;
+    }
+    fwrite(data.data(), 1, data.size(), fp);
+    if (ferror(fp) | fclose(fp)) {
+	fprintf(stderr, "%s: %s: write error\n", progname, path);
+	return false;
+    }
+    return true;
+}
+
+// A header is described one tag per line:
+//	s TAG value		RPM_STRING_TYPE
+//	a TAG value...		RPM_STRING_ARRAY_TYPE
+//	i TAG number...		RPM_INT32_TYPE
+// An empty line ends the header, and a line with "--" ends the frame.
+// The values have no spaces, and "" is the empty string.  The headers
+// are serialized as headerExport would do it, but without the region,
+// which librpm takes as a legacy header: the entries sorted by tag,
+// and the data in the same order.
+struct tagValue {
+    int32_t tag;
+    uint32_t type;
+    std::vector<std::string> values;
+};
+
+static void putBE32(std::string &out, uint32_t x)
+{
+    for (int i = 3; i >= 0; i--)
+	out += (char) (x >> (8 * i));
+}
+
+static void serialize(std::vector<struct tagValue> &tags, std::string &out)
+{
+    std::stable_sort(tags.begin(), tags.end(),
+	    [](const struct tagValue &a, const struct tagValue &b)
+	    { return a.tag < b.tag; });
+    std::string index, data;
+    for (const struct tagValue &tv : tags) {
+	if (tv.type == RPM_INT32_TYPE)
+	    data.append(-data.size() & 3, '\0');
+	putBE32(index, tv.tag);
+	putBE32(index, tv.type);
+	putBE32(index, data.size());
+	putBE32(index, tv.values.size());
+	for (const std::string &v : tv.values) {
+	    if (tv.type == RPM_INT32_TYPE)
+		putBE32(data, strtoul(v.c_str(), NULL, 0));
+	    else
+		data.append(v.c_str(), v.size() + 1);
+	}
+    }
+    out.append((const char *) zhdr_magic, sizeof zhdr_magic);
+    putBE32(out, tags.size());
+    putBE32(out, data.size());
+    out += index;
+    out += data;
+    tags.clear();
+}
+
+// The headers back to back, as rpmio reads them, or one lz4 frame
+// per group of the headers, as genpkglist writes them.
+static int makeList(const char *path, bool raw)
+{
+    std::string out, group;
+    std::vector<struct tagValue> tags;
+    auto endHeader = [&]()
+    {
+	if (tags.size())
+	    serialize(tags, group);
+    };
+    auto endFrame = [&]()
+    {
+	endHeader();
+	if (group.empty())
+	    return;
+	if (raw)
+	    out += group;
+	else {
+	    size_t bound = zhdrBound(group.size());
+	    std::vector<char> zbuf(bound);
+	    size_t zsize = zhdrCompressRaw(group.data(), group.size(), zbuf.data(), bound);
+	    out.append(zbuf.data(), zsize);
+	}
+	group.clear();
+    };
+    std::string line;
+    while (std::getline(std::cin, line)) {
+	std::istringstream ss(line);
+	std::string kind, name, v;
+	if (!(ss >> kind)) {
+	    endHeader();
+	    continue;
+	}
+	if (kind == "--") {
+	    endFrame();
+	    continue;
+	}
+	struct tagValue tv;
+	tv.type = kind == "s" ? RPM_STRING_TYPE :
+		  kind == "a" ? RPM_STRING_ARRAY_TYPE :
+		  kind == "i" ? RPM_INT32_TYPE : 0;
+	if (!(ss >> name) || tv.type == 0 || (tv.tag = lookupTag(name.c_str())) < 0) {
+	    fprintf(stderr, "%s: bad line: %s\n", progname, line.c_str());
+	    return 2;
+	}
+	while (ss >> v)
+	    tv.values.push_back(v == "\"\"" ? "" : v);
+	if (tv.values.empty() || (tv.type == RPM_STRING_TYPE && tv.values.size() > 1)) {
+	    fprintf(stderr, "%s: bad line: %s\n", progname, line.c_str());
+	    return 2;
+	}
+	tags.push_back(tv);
+    }
+    endFrame();
+    return writeFile(path, out) ? 0 : 2;
+}
+
+// The list with the frame index appended, as with --seekable.
+static int indexList(const char *list, const char *seekable)
+{
+    std::string in;
+    if (!readFile(list, in))
+	return 2;
+    ZIndexWriter zidx;
+    std::string out;
+    const unsigned char *base = (const unsigned char *) in.data();
+    for (size_t off = 0; off < in.size(); ) {
+	bool skippable;
+	size_t zsize = zframeSize(base + off, in.size() - off, &skippable);
+	if (zsize == 0) {
+	    fprintf(stderr, "%s: %s: bad lz4 frame at offset %zu\n", progname, list, off);
+	    return 2;
+	}
+	if (!skippable) {
+	    size_t rawSize;
+	    const char *raw = unzhdrFrame(base + off, zsize, rawSize);
+	    zidx.addFrame(out.size(), zsize);
+	    if (raw == NULL || !zidx.addRaw(raw, rawSize)) {
+		fprintf(stderr, "%s: %s: cannot index the frame at offset %zu\n", progname, list, off);
+		return 2;
+	    }
+	    out.append((const char *) base + off, zsize);
+	}
+	off += zsize;
+    }
+    std::vector<char> zbuf;
+    zidx.finish(zbuf);
+    out.append(zbuf.data(), zbuf.size());
+    return writeFile(seekable, out) ? 0 : 2;
+}
+
+// The entries of the frame index with the name, sourcerpm or file name,
+// "frame name srpm file" per line.
+static int lookupIndex(const char *seekable, const char *key, const char *value)
+{
+    std::string data;
+    if (!readFile(seekable, data))
+	return 2;
+    ZIndex zi;
+    if (!zi.load(data.data(), data.size())) {
+	fprintf(stderr, "%s: %s: no frame index\n", progname, seekable);
+	return 2;
+    }
+    std::vector<unsigned> ents;
+    unsigned first, count, i;
+    if (strcmp(key, "name") == 0) {
+	zi.findName(value, first, count);
+	for (i = first; i < first + count; i++)
+	    ents.push_back(i);
+    }
+    else if (strcmp(key, "srpm") == 0) {
+	zi.findSrpm(value, first, count);
+	for (i = first; i < first + count; i++)
+	    ents.push_back(zi.srpmEntry(i));
+    }
+    else if (strcmp(key, "file") == 0) {
+	if (zi.findFile(value, i))
+	    ents.push_back(i);
+    }
+    else {
+	fprintf(stderr, "%s: bad key: %s\n", progname, key);
+	return 2;
+    }
+    for (unsigned e : ents) {
+	size_t zsize;
+	const void *zblob = zi.frame(zi.frameOf(e), zsize);
+	// the frame must be there, and have the header
+	bool found = false;
+	size_t size;
+	const char *p = unzhdrFrame(zblob, zsize, size);
+	while (p && size && !found) {
+	    size_t hsize = rawhdrSize(p, size);
+	    if (hsize == 0)
+		break;
+	    const char *file = rawhdrString(p, hsize, CRPMTAG_FILENAME);
+	    found = file && strcmp(file, zi.file(e)) == 0;
+	    p += hsize, size -= hsize;
+	}
+	if (!found) {
+	    fprintf(stderr, "%s: %s: %s is not in frame %u\n", progname,
+		    seekable, zi.file(e), zi.frameOf(e));
+	    return 2;
+	}
+	printf("%u %s %s %s\n", zi.frameOf(e), zi.name(e), zi.srpm(e), zi.file(e));
+    }
+    return ents.empty();
+}
+
+// The packages of the snapshot, one per line, each followed by its
+// dependencies, "kind name flags [version]".
+static int dumpSnapshot(const char *path)
+{
+    Snapshot snap;
+    std::string err;
+    if (!snap.load(path, err)) {
+	fprintf(stderr, "%s: %s: %s\n", progname, path, err.c_str());
+	return 2;
+    }
+    static const char *kinds[SNAP_NDEPKIND] = { "P", "R", "C", "O" };
+    for (unsigned i = 0; i < snap.packages(); i++) {
+	printf("%s ", snap.name(i));
+	if (snap.epoch(i) != SNAP_NONE)
+	    printf("%u:", snap.epoch(i));
+	printf("%s-%s.%s %s %u %u %s\n", snap.version(i), snap.release(i), snap.arch(i),
+		snap.srpm(i) == SNAP_NONE ? "-" : snap.srpmName(snap.srpm(i)),
+		snap.installedSize(i), snap.fileSize(i), snap.fileName(i));
+	for (int k = 0; k < SNAP_NDEPKIND; k++) {
+	    unsigned first, count;
+	    snap.deps(k, i, first, count);
+	    for (unsigned j = first; j < first + count; j++) {
+		printf("\t%s %s %u", kinds[k], snap.depName(k, j), snap.depFlags(k, j));
+		if (*snap.depVersion(k, j))
+		    printf(" %s", snap.depVersion(k, j));
+		putchar('\n');
+	    }
+	}
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    progname = argv[0];
+    if (argc == 3 && strcmp(argv[1], "mklist") == 0)
+	return makeList(argv[2], false);
+    if (argc == 4 && strcmp(argv[1], "mklist") == 0 && strcmp(argv[2], "--raw") == 0)
+	return makeList(argv[3], true);
+    if (argc == 4 && strcmp(argv[1], "index") == 0)
+	return indexList(argv[2], argv[3]);
+    if (argc == 5 && strcmp(argv[1], "lookup") == 0)
+	return lookupIndex(argv[2], argv[3], argv[4]);
+    if (argc == 3 && strcmp(argv[1], "snapshot") == 0)
+	return dumpSnapshot(argv[2]);
+    fprintf(stderr, "Usage: %s mklist [--raw] <list> <description\n"
+		    "       %s index <list> <seekable-list>\n"
+		    "       %s lookup <seekable-list> name|srpm|file <value>\n"
+		    "       %s snapshot <snapshot>\n",
+		    progname, progname, progname, progname);
+    return 2;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,94 @@
+#!/bin/sh -efu
+# Round trips of pkglist-unmet: the dependency index saved with
+# --save-index must resolve the requires as the index made from the
+# lists does, and an index which does not check must be rejected.
+
+unmet=${PKGLIST_UNMET:-./pkglist-unmet}
+helper=${PKGLIST_TEST:-./pkglist-test}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+fail()
+{
+	echo "FAIL: $*" >&2
+	exit 1
+}
+
+# The flags are RPMSENSE_LESS 2, RPMSENSE_GREATER 4, RPMSENSE_EQUAL 8.
+# bar wants a newer foo and a library which nobody has.
+"$helper" mklist "$tmp/list" <<'EOF' ||
+s NAME foo
+i EPOCH 1
+s VERSION 1.0
+s RELEASE alt1
+s ARCH x86_64
+a PROVIDENAME libfoo.so.1()(64bit)
+i PROVIDEFLAGS 0
+a PROVIDEVERSION ""
+a BASENAMES sh foo
+a DIRNAMES /bin/ /usr/bin/
+i DIRINDEXES 0 1
+--
+s NAME bar
+s VERSION 2.0
+s RELEASE alt1
+s ARCH noarch
+a REQUIRENAME /bin/sh rpmlib(PayloadIsLzma) libfoo.so.1()(64bit) foo libbar.so.2 foo foo
+i REQUIREFLAGS 0 16777224 0 12 0 12 2
+a REQUIREVERSION "" 4.4.6-1 "" 2.0 "" 1.0 2.0
+--
+s NAME baz
+s VERSION 3.0
+s RELEASE alt1
+s ARCH noarch
+a REQUIRENAME /usr/bin/foo /usr/bin/baz
+i REQUIREFLAGS 0 0
+a REQUIREVERSION "" ""
+EOF
+	fail "cannot make the list"
+
+cat >"$tmp/expect" <<'EOF'
+bar-2.0-alt1.noarch	foo >= 2.0
+bar-2.0-alt1.noarch	libbar.so.2
+baz-3.0-alt1.noarch	/usr/bin/baz
+EOF
+
+check()
+{
+	name=$1
+	shift
+	rc=0
+	"$unmet" "$@" >"$tmp/out" || rc=$?
+	[ $rc = 1 ] ||
+		fail "$name: exits with $rc"
+	cmp -s "$tmp/expect" "$tmp/out" ||
+		fail "$name: $(cat "$tmp/out")"
+	echo "ok: $name"
+}
+check unmet "$tmp/list"
+check "save index" --save-index "$tmp/index" "$tmp/list"
+check "load index" --index "$tmp/index" "$tmp/list"
+
+# The index is in native byte order: the header is the magic and four
+# counts, and then go the package name offsets.
+bad()
+{
+	name=$1
+	rc=0
+	"$unmet" --index "$tmp/bad" "$tmp/list" >/dev/null 2>"$tmp/err" || rc=$?
+	[ $rc = 2 ] && grep -qs 'bad index' "$tmp/err" ||
+		fail "$name: the index is loaded"
+	echo "ok: $name"
+}
+size=$(wc -c <"$tmp/index")
+head -c $((size - 1)) "$tmp/index" >"$tmp/bad"
+bad "truncated index"
+cp "$tmp/index" "$tmp/bad"
+echo >>"$tmp/bad"
+bad "longer index"
+cp "$tmp/index" "$tmp/bad"
+printf 'X' | dd of="$tmp/bad" bs=1 conv=notrunc 2>/dev/null
+bad "bad magic"
+cp "$tmp/index" "$tmp/bad"
+printf '\377\377\377\177' | dd of="$tmp/bad" bs=1 seek=24 conv=notrunc 2>/dev/null
+bad "bad offset"
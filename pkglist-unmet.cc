@@ -0,0 +1,361 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <rpm/rpmlib.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "crpmtag.h"
+#include "zhdr.h"
+#include "zframe.h"
+#include "strtab.h"
+#include "rawhdr.h"
+#include "depindex.h"
+#include "listread.h"
+
+static const char *progname;
+
+// RPMSENSE_LESS, RPMSENSE_GREATER, RPMSENSE_EQUAL, RPMSENSE_RPMLIB
+enum { SENSE_LESS = 2, SENSE_GREATER = 4, SENSE_EQUAL = 8, SENSE_RPMLIB = 1 << 24 };
+enum { SENSE_MASK = SENSE_LESS | SENSE_GREATER | SENSE_EQUAL };
+
+// The threads parse the pieces of the lists (see listread.h) into records,
+// with the strings copied into the pool of the piece, so that parsing
+// does not allocate per string.
+enum { REC_PACKAGE, REC_PROVIDE, REC_REQUIRE, REC_FILE };
+
+struct depRec {
+    int kind;
+    uint32_t name; // offsets in the pool
+    uint32_t version;
+    uint32_t flags;
+};
+
+struct pieceDeps {
+    std::vector<char> pool;
+    std::vector<struct depRec> recs;
+    const char *err;
+};
+
+static uint32_t poolAdd(std::vector<char> &pool, const char *s, const char *s2 = "")
+{
+    uint32_t off = pool.size();
+    pool.insert(pool.end(), s, s + strlen(s));
+    pool.insert(pool.end(), s2, s2 + strlen(s2) + 1);
+    return off;
+}
+
+// The name, flags and version arrays of provides or requires.  The flags
+// and versions need not be there, and then the dependencies are unversioned.
+static void parseDeps(const char *h, size_t size, int32_t nameTag, int32_t flagsTag,
+	int32_t versionTag, int kind, struct pieceDeps &pd)
+{
+    std::vector<const char *> names, versions;
+    std::vector<uint32_t> flags;
+    if (!rawhdrStrings(h, size, nameTag, names))
+	return;
+    if (!rawhdrInt32s(h, size, flagsTag, flags) ||
+	!rawhdrStrings(h, size, versionTag, versions) ||
+	flags.size() != names.size() || versions.size() != names.size())
+	flags.clear(), versions.clear();
+    for (size_t i = 0; i < names.size(); i++) {
+	struct depRec r = { kind, poolAdd(pd.pool, names[i]), 0, 0 };
+	if (flags.size()) {
+	    r.flags = flags[i];
+	    if (*versions[i])
+		r.version = poolAdd(pd.pool, versions[i]);
+	}
+	pd.recs.push_back(r);
+    }
+}
+
+// Parse a header (with magic) into the records: the package, then its
+// provides (including name = [epoch:]version-release), requires and files.
+static bool parseHeader(const char *h, size_t size, struct pieceDeps &pd)
+{
+    const char *name = rawhdrString(h, size, RPMTAG_NAME);
+    const char *version = rawhdrString(h, size, RPMTAG_VERSION);
+    const char *release = rawhdrString(h, size, RPMTAG_RELEASE);
+    const char *arch = rawhdrString(h, size, RPMTAG_ARCH);
+    if (name == NULL || version == NULL || release == NULL)
+	return false;
+    std::string nvra = std::string(name) + '-' + version + '-' + release;
+    if (arch)
+	nvra += std::string(".") + arch;
+    // the offset 0 is for the unversioned
+    if (pd.pool.empty())
+	pd.pool.push_back('\0');
+    struct depRec pkg = { REC_PACKAGE, poolAdd(pd.pool, nvra.c_str()), 0, 0 };
+    pd.recs.push_back(pkg);
+    std::vector<uint32_t> epoch;
+    std::string evr;
+    if (rawhdrInt32s(h, size, RPMTAG_EPOCH, epoch) && epoch.size() == 1)
+	evr = std::to_string(epoch[0]) + ':';
+    evr += std::string(version) + '-' + release;
+    struct depRec self = { REC_PROVIDE, poolAdd(pd.pool, name),
+	poolAdd(pd.pool, evr.c_str()), SENSE_EQUAL };
+    pd.recs.push_back(self);
+    parseDeps(h, size, RPMTAG_PROVIDENAME, RPMTAG_PROVIDEFLAGS,
+	    RPMTAG_PROVIDEVERSION, REC_PROVIDE, pd);
+    parseDeps(h, size, RPMTAG_REQUIRENAME, RPMTAG_REQUIREFLAGS,
+	    RPMTAG_REQUIREVERSION, REC_REQUIRE, pd);
+    std::vector<const char *> basenames, dirnames;
+    std::vector<uint32_t> dirindexes;
+    if (rawhdrStrings(h, size, RPMTAG_BASENAMES, basenames) &&
+	rawhdrStrings(h, size, RPMTAG_DIRNAMES, dirnames) &&
+	rawhdrInt32s(h, size, RPMTAG_DIRINDEXES, dirindexes) &&
+	dirindexes.size() == basenames.size()) {
+	for (size_t i = 0; i < basenames.size(); i++) {
+	    if (dirindexes[i] >= dirnames.size())
+		return false;
+	    struct depRec r = { REC_FILE,
+		poolAdd(pd.pool, dirnames[dirindexes[i]], basenames[i]), 0, 0 };
+	    pd.recs.push_back(r);
+	}
+    }
+    return true;
+}
+
+static void parsePiece(const struct listPiece &lp, struct pieceDeps &pd)
+{
+    size_t size;
+    const char *p = listPieceRaw(lp, size);
+    if (p == NULL) {
+	pd.err = "bad lz4 frame";
+	return;
+    }
+    while (size) {
+	size_t hsize = rawhdrSize(p, size);
+	if (hsize == 0 || !parseHeader(p, hsize, pd)) {
+	    pd.err = "bad header";
+	    return;
+	}
+	p += hsize, size -= hsize;
+    }
+}
+
+// Compare [epoch:]version[-release].  A missing epoch in the requirement
+// matches any epoch, and a missing release matches any release.
+static int compareEVR(const char *provided, const char *required)
+{
+    auto split = [](const char *evr, std::string &e, std::string &v, std::string &r)
+    {
+	const char *s = evr;
+	while (*s >= '0' && *s <= '9')
+	    s++;
+	if (*s == ':')
+	    e.assign(evr, s - evr), evr = s + 1;
+	const char *dash = strrchr(evr, '-');
+	if (dash)
+	    v.assign(evr, dash - evr), r = dash + 1;
+	else
+	    v = evr;
+    };
+    std::string pe, pv, pr, re, rv, rr;
+    split(provided, pe, pv, pr);
+    split(required, re, rv, rr);
+    if (re.size()) {
+	unsigned long pen = strtoul(pe.c_str(), NULL, 10);
+	unsigned long ren = strtoul(re.c_str(), NULL, 10);
+	if (pen != ren)
+	    return pen < ren ? -1 : 1;
+    }
+    int cmp = rpmvercmp(pv.c_str(), rv.c_str());
+    if (cmp || pr.empty() || rr.empty())
+	return cmp;
+    return rpmvercmp(pr.c_str(), rr.c_str());
+}
+
+// Whether the provided version satisfies the required range, as
+// rpmRangesOverlap would tell.  The set-versions are only compared with
+// set-versions.
+static bool rangesOverlap(uint32_t pflags, const char *pversion,
+	uint32_t rflags, const char *rversion)
+{
+    if (!(pflags & SENSE_MASK) || !(rflags & SENSE_MASK) || !*pversion || !*rversion)
+	return true;
+    bool pset = strncmp(pversion, "set:", 4) == 0;
+    bool rset = strncmp(rversion, "set:", 4) == 0;
+    if (pset || rset) {
+#ifdef HAVE_RPMSETCMP
+	if (pset && rset)
+	    return rpmsetcmp(pversion, rversion) >= 0;
+#endif
+	return true;
+    }
+    int sense = compareEVR(pversion, rversion);
+    if (sense < 0)
+	return (pflags & SENSE_GREATER) || (rflags & SENSE_LESS);
+    if (sense > 0)
+	return (pflags & SENSE_LESS) || (rflags & SENSE_GREATER);
+    return ((pflags & SENSE_EQUAL) && (rflags & SENSE_EQUAL)) ||
+	   ((pflags & SENSE_LESS) && (rflags & SENSE_LESS)) ||
+	   ((pflags & SENSE_GREATER) && (rflags & SENSE_GREATER));
+}
+
+struct require {
+    const char *pkg;
+    const char *name;
+    uint32_t flags;
+    const char *version;
+};
+
+static bool resolve(const DepIndex &di, const struct require &req)
+{
+    if ((req.flags & SENSE_RPMLIB) || strncmp(req.name, "rpmlib(", 7) == 0)
+	return true;
+    unsigned first, count, pkg;
+    di.findProvides(req.name, first, count);
+    for (unsigned i = first; i < first + count; i++) {
+	const struct DepIndexProv &pr = di.provide(i);
+	if (rangesOverlap(pr.flags, di.str(pr.version), req.flags, req.version))
+	    return true;
+    }
+    return *req.name == '/' && di.findFile(req.name, pkg);
+}
+
+static void printRequire(const struct require &req)
+{
+    printf("%s\t%s", req.pkg, req.name);
+    if ((req.flags & SENSE_MASK) && *req.version) {
+	putchar(' ');
+	if (req.flags & SENSE_LESS)
+	    putchar('<');
+	if (req.flags & SENSE_GREATER)
+	    putchar('>');
+	if (req.flags & SENSE_EQUAL)
+	    putchar('=');
+	printf(" %s", req.version);
+    }
+    putchar('\n');
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: %s [<options>] <pkglist>...\n"
+	    "Options:\n"
+	    "   --index <file>       use the index made earlier, instead of making it\n"
+	    "                        from the lists; the lists only give the requires\n"
+	    "   --save-index <file>  save the index made from the lists\n"
+	    "Prints the unmet dependencies, \"package<TAB>requirement\" per line.\n"
+	    "Exit status is 1 if there are any, and 2 on errors.\n", progname);
+}
+
+int main(int argc, char *argv[])
+{
+    progname = argv[0];
+    const char *indexPath = NULL;
+    const char *savePath = NULL;
+    int ix = 1;
+    for (; ix < argc && strncmp(argv[ix], "--", 2) == 0; ix++) {
+	if (strcmp(argv[ix], "--index") == 0 && ix + 1 < argc)
+	    indexPath = argv[++ix];
+	else if (strcmp(argv[ix], "--save-index") == 0 && ix + 1 < argc)
+	    savePath = argv[++ix];
+	else if (strcmp(argv[ix], "--") == 0) {
+	    ix++;
+	    break;
+	}
+	else {
+	    usage();
+	    return 2;
+	}
+    }
+    if (ix == argc || (indexPath && savePath)) {
+	usage();
+	return 2;
+    }
+
+    ListReader lr;
+    std::string err;
+    for (; ix < argc; ix++)
+	if (!lr.add(argv[ix], err)) {
+	    fprintf(stderr, "%s: %s: %s\n", progname, argv[ix], err.c_str());
+	    return 2;
+	}
+    std::vector<struct pieceDeps> deps(lr.pieces.size());
+    parallelFor(deps.size(), 1, [&](size_t i)
+	    { deps[i].err = NULL; parsePiece(lr.pieces[i], deps[i]); });
+
+    DepIndex di;
+    if (indexPath && !di.load(indexPath, err)) {
+	fprintf(stderr, "%s: %s: %s\n", progname, indexPath, err.c_str());
+	return 2;
+    }
+    std::vector<struct require> reqs;
+    for (size_t i = 0; i < deps.size(); i++) {
+	const struct pieceDeps &pd = deps[i];
+	if (pd.err) {
+	    fprintf(stderr, "%s: %s: %s\n", progname, lr.pieces[i].list, pd.err);
+	    return 2;
+	}
+	const char *pool = pd.pool.data();
+	const char *nvra = NULL;
+	unsigned pkg = 0;
+	for (const struct depRec &r : pd.recs) {
+	    switch (r.kind) {
+	    case REC_PACKAGE:
+		nvra = pool + r.name;
+		if (!indexPath)
+		    pkg = di.addPackage(nvra);
+		break;
+	    case REC_PROVIDE:
+		if (!indexPath)
+		    di.addProvide(pkg, pool + r.name, r.flags, pool + r.version);
+		break;
+	    case REC_FILE:
+		if (!indexPath)
+		    di.addFile(pkg, pool + r.name);
+		break;
+	    case REC_REQUIRE: {
+		struct require req = { nvra, pool + r.name, r.flags, pool + r.version };
+		reqs.push_back(req);
+		break;
+	    }
+	    }
+	}
+    }
+    if (!indexPath)
+	di.finish();
+    if (savePath) {
+	FILE *fp = fopen(savePath, "w");
+	if (fp == NULL || !di.save(fp) || fclose(fp) != 0) {
+	    fprintf(stderr, "%s: %s: %s\n", progname, savePath, strerror(errno));
+	    return 2;
+	}
+    }
+
+    std::vector<char> met(reqs.size());
+    parallelFor(reqs.size(), 1024, [&](size_t i) { met[i] = resolve(di, reqs[i]); });
+    int rc = 0;
+    for (size_t i = 0; i < reqs.size(); i++) {
+	if (met[i])
+	    continue;
+	rc = 1;
+	// the same requirement of the same package, e.g. for %pre and %post
+	const struct require &req = reqs[i];
+	bool dup = false;
+	for (size_t j = i; j > 0 && reqs[j-1].pkg == req.pkg && !dup; j--)
+	    dup = !met[j-1] && strcmp(reqs[j-1].name, req.name) == 0 &&
+		  (reqs[j-1].flags & SENSE_MASK) == (req.flags & SENSE_MASK) &&
+		  strcmp(reqs[j-1].version, req.version) == 0;
+	if (!dup)
+	    printRequire(req);
+    }
+    return rc;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,118 @@
+/*
+ * Selecting the headers by their tags, before formatting
+ */
+#include <fnmatch.h>
+
+// The predicates are TAG=VALUE, and all of them must match.  The value is
+// a glob pattern if it has any of the glob characters, and an array tag
+// matches if any of its elements does, e.g. PROVIDENAME=libfoo.so.*
+// The predicates are checked right on the serialized header (see rawhdr.h),
+// so that the headers which are not selected are neither imported nor
+// formatted.  The predicates on the name, sourcerpm and file name can also
+// be checked against the frame index (see zindex.h), so that the frames
+// which have none of the headers are not even decompressed.
+class QueryFilter
+{
+    struct Pred {
+	int32_t tag;
+	std::string value;
+	bool glob;
+    };
+    std::vector<struct Pred> preds;
+    static bool matchString(const struct Pred &pred, const char *s)
+    {
+	if (pred.glob)
+	    return fnmatch(pred.value.c_str(), s, 0) == 0;
+	return strcmp(pred.value.c_str(), s) == 0;
+    }
+    static bool matchTag(const struct Pred &pred, const char *h, size_t size)
+    {
+	struct rawhdrEntry e;
+	if (!rawhdrFind(h, size, pred.tag, &e))
+	    return false;
+	const char *p = rawhdrData(h) + e.offset;
+	const char *end = h + size;
+	switch (e.type) {
+	case 6: // RPM_STRING_TYPE
+	    e.count = 1;
+	    // fall through
+	case 8: // RPM_STRING_ARRAY_TYPE
+	case 9: // RPM_I18NSTRING_TYPE, in any of the languages
+	    for (uint32_t i = 0; i < e.count; i++) {
+		const char *z = (const char *) memchr(p, '\0', end - p);
+		if (z == NULL)
+		    return false;
+		if (matchString(pred, p))
+		    return true;
+		p = z + 1;
+	    }
+	    return false;
+	case 4: // RPM_INT32_TYPE
+	    for (uint32_t i = 0; i < e.count && end - p >= 4; i++, p += 4) {
+		char buf[16];
+		snprintf(buf, sizeof buf, "%d", (int32_t) rawhdrBE32(p));
+		if (matchString(pred, buf))
+		    return true;
+	    }
+	    return false;
+	}
+	return false;
+    }
+    // The tags in the frame index.
+    static bool indexTag(int32_t tag)
+    {
+	return tag == RPMTAG_NAME || tag == RPMTAG_SOURCERPM || tag == CRPMTAG_FILENAME;
+    }
+public:
+    // Add TAG=VALUE; false if it does not parse, or if there is no such
+    // tag.  The tags are looked up by name, -1 if there is no such tag.
+    bool add(const char *expr, int32_t (*lookup)(const char *name))
+    {
+	const char *eq = strchr(expr, '=');
+	if (eq == NULL || eq == expr)
+	    return false;
+	int32_t tag = lookup(std::string(expr, eq - expr).c_str());
+	if (tag < 0)
+	    return false;
+	struct Pred pred = { tag, eq + 1, strpbrk(eq + 1, "*?[") != NULL };
+	preds.push_back(pred);
+	return true;
+    }
+    bool empty() const { return preds.empty(); }
+    // Whether the header (with magic) is selected.
+    bool match(const char *h, size_t size) const
+    {
+	for (const struct Pred &pred : preds)
+	    if (!matchTag(pred, h, size))
+		return false;
+	return true;
+    }
+    // Whether the frame index can tell which frames to skip.
+    bool useIndex() const
+    {
+	for (const struct Pred &pred : preds)
+	    if (indexTag(pred.tag))
+		return true;
+	return false;
+    }
+    // Whether the header of an index entry may be selected; only the
+    // predicates on the tags in the index are checked.  A header without
+    // the sourcerpm has it empty in the index.
+    bool matchEntry(const char *name, const char *srpm, const char *file) const
+    {
+	for (const struct Pred &pred : preds) {
+	    const char *s;
+	    switch (pred.tag) {
+	    case RPMTAG_NAME: s = name; break;
+	    case RPMTAG_SOURCERPM: s = srpm; break;
+	    case CRPMTAG_FILENAME: s = file; break;
+	    default: continue;
+	    }
+	    if (!matchString(pred, s))
+		return false;
+	}
+	return true;
+    }
+};
+
+// ex:set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,198 @@
+/*
+ * Query formats compiled once, and run on serialized headers
+ */
+
+// The common query formats only print a few tags as they are, e.g.
+// "%{NAME}\t%{VERSION}\n" or "[%{PROVIDENAME}\n]".  Such a format is
+// compiled into a plan, which is then run right on the serialized header
+// (see rawhdr.h), appending to a big output buffer: no headerImport,
+// no parsing the format again, no allocation per header.  Anything else
+// is left to librpm: the formats with widths, :modifiers, conditionals
+// and the like are not compiled at all, and the headers whose values
+// would not print the same (e.g. negative numbers, scalars mixed with
+// arrays, or the tags which are not in the header, such as the extension
+// tags NEVRA and FILENAMES) are formatted by librpm one by one.
+class QueryFormat
+{
+    enum { LITERAL, TAG, ARRAY_BEGIN, ARRAY_END };
+    // the tags within [], each of them with its own cursor
+    enum { MAXARRAY = 16 };
+    struct Item {
+	int kind;
+	std::string text;
+	int32_t tag;
+    };
+    std::vector<struct Item> items;
+    bool compiled;
+    static char escape(char c)
+    {
+	switch (c) {
+	case 'a': return '\a';
+	case 'b': return '\b';
+	case 'f': return '\f';
+	case 'n': return '\n';
+	case 'r': return '\r';
+	case 't': return '\t';
+	case 'v': return '\v';
+	}
+	return c;
+    }
+    void literal(char c)
+    {
+	if (items.empty() || items.back().kind != LITERAL) {
+	    struct Item item = { LITERAL, std::string(), 0 };
+	    items.push_back(item);
+	}
+	items.back().text += c;
+    }
+    bool compile(const char *fmt, int32_t (*lookup)(const char *name))
+    {
+	bool inArray = false;
+	int arrayTags = 0;
+	for (const char *p = fmt; *p; p++) {
+	    if (*p == '\\' && p[1]) {
+		literal(escape(*++p));
+		continue;
+	    }
+	    if (*p == '[' || *p == ']') {
+		if ((*p == '[') == inArray)
+		    return false;
+		inArray = !inArray;
+		arrayTags = 0;
+		struct Item item = { inArray ? ARRAY_BEGIN : ARRAY_END, std::string(), 0 };
+		items.push_back(item);
+		continue;
+	    }
+	    if (*p != '%') {
+		literal(*p);
+		continue;
+	    }
+	    if (p[1] == '%') {
+		literal(*++p);
+		continue;
+	    }
+	    // only the plain %{TAG}
+	    if (p[1] != '{')
+		return false;
+	    const char *name = p + 2;
+	    size_t len = strspn(name, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_");
+	    if (len == 0 || name[len] != '}')
+		return false;
+	    int32_t tag = lookup(std::string(name, len).c_str());
+	    if (tag < 0 || (inArray && ++arrayTags > MAXARRAY))
+		return false;
+	    struct Item item = { TAG, std::string(), tag };
+	    items.push_back(item);
+	    p = name + len;
+	}
+	return !inArray;
+    }
+    // Print the string at p, and move past it.
+    static bool str(const char *&p, const char *end, std::string &out)
+    {
+	const char *z = (const char *) memchr(p, '\0', end - p);
+	if (z == NULL)
+	    return false;
+	out.append(p, z - p);
+	p = z + 1;
+	return true;
+    }
+    static bool int32(const char *&p, const char *end, std::string &out)
+    {
+	if (end - p < 4)
+	    return false;
+	uint32_t x = rawhdrBE32(p);
+	// librpm may print them either way
+	if (x > INT32_MAX)
+	    return false;
+	char buf[16];
+	out.append(buf, snprintf(buf, sizeof buf, "%u", x));
+	p += 4;
+	return true;
+    }
+    // Print a scalar value; the arrays outside [] are left to librpm.
+    static bool value(const char *h, size_t size, const struct rawhdrEntry &e, std::string &out)
+    {
+	const char *p = rawhdrData(h) + e.offset;
+	const char *end = h + size;
+	switch (e.type) {
+	case 6: // RPM_STRING_TYPE
+	    return str(p, end, out);
+	case 9: // RPM_I18NSTRING_TYPE, only in one language
+	    return e.count == 1 && str(p, end, out);
+	case 4: // RPM_INT32_TYPE
+	    return e.count == 1 && int32(p, end, out);
+	}
+	return false;
+    }
+public:
+    // The tags are looked up by name, -1 if there is no such tag.
+    QueryFormat(const char *fmt, int32_t (*lookup)(const char *name))
+    {
+	compiled = compile(fmt, lookup);
+	if (!compiled)
+	    items.clear();
+    }
+    bool fast() const { return compiled; }
+    // Format the header (with magic), appending to out.  Returns false,
+    // with out as it was, if the header should be formatted by librpm.
+    bool format(const char *h, size_t size, std::string &out) const
+    {
+	size_t size0 = out.size();
+	auto fail = [&]()
+	{
+	    out.resize(size0);
+	    return false;
+	};
+	for (size_t i = 0; i < items.size(); i++) {
+	    const struct Item &item = items[i];
+	    if (item.kind == LITERAL) {
+		out += item.text;
+		continue;
+	    }
+	    if (item.kind == TAG) {
+		// the missing tags may be computed by librpm, e.g. NEVRA
+		struct rawhdrEntry e;
+		if (!rawhdrFind(h, size, item.tag, &e) || !value(h, size, e, out))
+		    return fail();
+		continue;
+	    }
+	    // the array items, all of the same size, as many times
+	    size_t j = i + 1;
+	    unsigned count = 0;
+	    const char *cur[MAXARRAY];
+	    uint32_t type[MAXARRAY];
+	    int n = 0;
+	    for (; items[j].kind != ARRAY_END; j++) {
+		if (items[j].kind != TAG)
+		    continue;
+		struct rawhdrEntry e;
+		if (!rawhdrFind(h, size, items[j].tag, &e) ||
+		    (e.type != 8 && e.type != 4) || e.count == 0 ||
+		    (count && e.count != count))
+		    return fail();
+		count = e.count;
+		cur[n] = rawhdrData(h) + e.offset;
+		type[n++] = e.type;
+	    }
+	    if (count == 0)
+		return fail();
+	    for (unsigned k = 0; k < count; k++) {
+		n = 0;
+		for (size_t m = i + 1; m < j; m++) {
+		    if (items[m].kind == LITERAL)
+			out += items[m].text;
+		    else if (!(type[n] == 8 ? str(cur[n], h + size, out)
+					    : int32(cur[n], h + size, out)))
+			return fail();
+		    else
+			n++;
+		}
+	    }
+	    i = j;
+	}
+	return true;
+    }
+};
+
+// ex:set ts=8 sts=4 sw=4 noet:
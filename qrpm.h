@@ -0,0 +1,69 @@
+/*
+ * The librpm side of the queries
+ */
+
+static char *formatHeader(Header h, const char *format, const char **err)
+{
+#ifdef HAVE_HEADERFORMAT
+    return headerFormat(h, format, err);
+#else
+    return headerSprintf(h, format, rpmTagTable, rpmHeaderFormats, err);
+#endif
+}
+
+// The tags of the lists, which librpm may not know about.
+static const struct {
+    const char *name;
+    int32_t tag;
+} listTags[] = {
+    { "CRPMTAG_FILENAME", CRPMTAG_FILENAME },
+    { "CRPMTAG_FILESIZE", CRPMTAG_FILESIZE },
+    { "CRPMTAG_MD5", CRPMTAG_MD5 },
+    { "CRPMTAG_SHA1", CRPMTAG_SHA1 },
+    { "CRPMTAG_DIRECTORY", CRPMTAG_DIRECTORY },
+    { "CRPMTAG_BINARY", CRPMTAG_BINARY },
+};
+
+static int32_t lookupTag(const char *name)
+{
+    for (size_t i = 0; i < sizeof listTags / sizeof listTags[0]; i++)
+	if (strcasecmp(name, listTags[i].name) == 0)
+	    return listTags[i].tag;
+#ifdef HAVE_HEADERFORMAT
+    return rpmTagGetValue(name);
+#else
+    for (const struct headerTagTableEntry_s *t = rpmTagTable; t->name; t++)
+	if (strcasecmp(name, t->name) == 0 || strcasecmp(name, t->name + 7) == 0)
+	    return t->val;
+    return -1;
+#endif
+}
+
+// Format a header (with magic), appending to out: right from its bytes
+// if the format is compiled (see qformat.h), otherwise with librpm.
+// The header is imported with HEADERIMPORT_COPY: without it, the header
+// would own (and free) the blob, which is part of a bigger buffer.
+static bool formatRaw(const char *h, size_t size, const char *format,
+	const QueryFormat &qf, std::string &out, const char **err)
+{
+    if (qf.fast() && qf.format(h, size, out))
+	return true;
+    Header hdr = headerImport((void *) (h + sizeof zhdr_magic), size - sizeof zhdr_magic,
+	    HEADERIMPORT_COPY | HEADERIMPORT_FAST);
+    if (hdr == NULL) {
+	*err = "bad header";
+	return false;
+    }
+    const char *ferr = "unknown error";
+    char *str = formatHeader(hdr, format, &ferr);
+    headerFree(hdr);
+    if (str == NULL) {
+	*err = ferr;
+	return false;
+    }
+    out += str;
+    free(str);
+    return true;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
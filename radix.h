@@ -0,0 +1,38 @@
+/*
+ * LSD radix sort by 64-bit keys
+ */
+
+// Sort n items by key(item), stably; tmp must have room for n items.
+// Byte positions which are the same in all the keys are skipped, so that
+// keys made of small integers only take a few passes.
+template<class T, class KeyOf>
+static void radixSort(T *v, T *tmp, size_t n, KeyOf key)
+{
+    if (n < 2)
+	return;
+    std::vector<size_t> count(8 * 256, 0);
+    for (size_t i = 0; i < n; i++) {
+	uint64_t k = key(v[i]);
+	for (int d = 0; d < 8; d++)
+	    count[d * 256 + ((k >> (8 * d)) & 255)]++;
+    }
+    T *src = v, *dst = tmp;
+    for (int d = 0; d < 8; d++) {
+	size_t *c = &count[d * 256];
+	if (c[(key(src[0]) >> (8 * d)) & 255] == n)
+	    continue;
+	size_t sum = 0;
+	for (int b = 0; b < 256; b++) {
+	    size_t cnt = c[b];
+	    c[b] = sum;
+	    sum += cnt;
+	}
+	for (size_t i = 0; i < n; i++)
+	    dst[c[(key(src[i]) >> (8 * d)) & 255]++] = src[i];
+	std::swap(src, dst);
+    }
+    if (src != v)
+	std::copy(src, src + n, v);
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,125 @@
+/*
+ * Reading serialized rpm headers in place
+ */
+#include <arpa/inet.h>
+
+// The headers in the lists are stored as with headerUnload, preceded by
+// the magic: the number of index entries and the size of the data, both
+// big-endian, then the index entries {tag, type, offset, count}, then
+// the data.  A few tags can be read right from these bytes, without
+// headerImport (which copies and swaps the whole index).
+struct rawhdrEntry {
+    int32_t tag;
+    uint32_t type;
+    int32_t offset;
+    uint32_t count;
+};
+
+static inline uint32_t rawhdrBE32(const void *p)
+{
+    uint32_t x;
+    memcpy(&x, p, 4);
+    return ntohl(x);
+}
+
+// The size of the header at p, with the magic, or 0 if it is not valid
+// within avail bytes.
+static size_t rawhdrSize(const void *p, size_t avail)
+{
+    static const unsigned char magic[3] = { 0x8e, 0xad, 0xe8 };
+    if (avail < 16 || memcmp(p, magic, 3))
+	return 0;
+    size_t il = rawhdrBE32((const char *) p + 8);
+    size_t dl = rawhdrBE32((const char *) p + 12);
+    if (il > (avail - 16) / 16)
+	return 0;
+    size_t size = 16 + il * 16 + dl;
+    if (size > avail)
+	return 0;
+    return size;
+}
+
+// Find the entry of the tag in the header of the given size.
+static bool rawhdrFind(const void *p, size_t size, int32_t tag, struct rawhdrEntry *e)
+{
+    const char *pe = (const char *) p + 16;
+    size_t il = rawhdrBE32((const char *) p + 8);
+    size_t dl = size - 16 - il * 16;
+    for (size_t i = 0; i < il; i++, pe += 16) {
+	if ((int32_t) rawhdrBE32(pe) != tag)
+	    continue;
+	e->tag = tag;
+	e->type = rawhdrBE32(pe + 4);
+	e->offset = rawhdrBE32(pe + 8);
+	e->count = rawhdrBE32(pe + 12);
+	if (e->offset < 0 || (size_t) e->offset >= dl)
+	    return false;
+	return true;
+    }
+    return false;
+}
+
+// The data of the header, where the entry offsets point.
+static inline const char *rawhdrData(const void *p)
+{
+    size_t il = rawhdrBE32((const char *) p + 8);
+    return (const char *) p + 16 + il * 16;
+}
+
+// The value of a string tag (RPM_STRING_TYPE, or the first string
+// of an array), or NULL.
+static const char *rawhdrString(const void *p, size_t size, int32_t tag)
+{
+    struct rawhdrEntry e;
+    if (!rawhdrFind(p, size, tag, &e))
+	return NULL;
+    // RPM_STRING_TYPE, RPM_STRING_ARRAY_TYPE, RPM_I18NSTRING_TYPE
+    if (e.type != 6 && e.type != 8 && e.type != 9)
+	return NULL;
+    const char *data = rawhdrData(p);
+    const char *end = (const char *) p + size;
+    const char *s = data + e.offset;
+    if (memchr(s, '\0', end - s) == NULL)
+	return NULL;
+    return s;
+}
+
+// The strings of a string array tag (or of a single string), appended
+// to v; false if there is no such tag, or if it does not check.
+static bool rawhdrStrings(const void *p, size_t size, int32_t tag, std::vector<const char *> &v)
+{
+    struct rawhdrEntry e;
+    if (!rawhdrFind(p, size, tag, &e))
+	return false;
+    if (e.type == 6)
+	e.count = 1;
+    else if (e.type != 8)
+	return false;
+    const char *s = rawhdrData(p) + e.offset;
+    const char *end = (const char *) p + size;
+    for (uint32_t i = 0; i < e.count; i++) {
+	const char *z = (const char *) memchr(s, '\0', end - s);
+	if (z == NULL)
+	    return false;
+	v.push_back(s);
+	s = z + 1;
+    }
+    return true;
+}
+
+// The values of an RPM_INT32_TYPE tag, appended to v.
+static bool rawhdrInt32s(const void *p, size_t size, int32_t tag, std::vector<uint32_t> &v)
+{
+    struct rawhdrEntry e;
+    if (!rawhdrFind(p, size, tag, &e) || e.type != 4)
+	return false;
+    const char *s = rawhdrData(p) + e.offset;
+    const char *end = (const char *) p + size;
+    if (e.count > (size_t) (end - s) / 4)
+	return false;
+    for (uint32_t i = 0; i < e.count; i++, s += 4)
+	v.push_back(rawhdrBE32(s));
+    return true;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
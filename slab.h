@@ -8,21 +8,51 @@ class Slab
     static const size_t slab_size = 4 << 20;
     char *slab;
     size_t fill;
+    // all the slabs allocated so far, and their total size
+    std::vector<char *> slabs;
+    size_t total;
 public:
-    Slab() : slab(NULL), fill(0) { }
-    void *put(const void *data, size_t size)
+    Slab() : slab(NULL), fill(0), total(0) { }
+    ~Slab() { clear(); }
+    // Reserve room for up to size bytes, to be filled in place
+    // and then committed with the actual size.
+    void *reserve(size_t size)
     {
 	if (slab == NULL || fill + size > slab_size) {
-	    slab = new char[size > slab_size ? size : slab_size];
+	    size_t alloc = size > slab_size ? size : slab_size;
+	    slab = new char[alloc];
+	    slabs.push_back(slab);
+	    total += alloc;
 	    fill = 0;
 	}
-	void *ret = memcpy(slab + fill, data, size);
+	return slab + fill;
+    }
+    void *commit(size_t size)
+    {
+	void *ret = slab + fill;
 	fill += size;
 	return ret;
     }
+    void *put(const void *data, size_t size)
+    {
+	memcpy(reserve(size), data, size);
+	return commit(size);
+    }
     char *strdup(const char *s)
     {
 	size_t len = strlen(s);
 	return (char *) put(s, len + 1);
     }
+    // Memory held by the slab, in bytes.
+    size_t size() const { return total; }
+    // Release everything at once; the pointers handed out so far
+    // become invalid.
+    void clear()
+    {
+	for (size_t i = 0; i < slabs.size(); i++)
+	    delete[] slabs[i];
+	slabs.clear();
+	slab = NULL;
+	fill = total = 0;
+    }
 };
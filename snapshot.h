@@ -0,0 +1,178 @@
+/*
+ * Columnar snapshots of the lists, made by pkglist-snapshot
+ */
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+
+// A snapshot has the packages of one or more lists, in the order of the
+// lists, one column per field, so that a whole branch is mapped and read
+// without decompressing anything, and without librpm.  The file is the
+// header, the columns, the sorted srpm names, and the string pool.
+// The strings are offsets into the pool, which starts with the empty
+// string, so that the missing strings are at offset 0.  The dependencies
+// of the i-th package are [first[i], first[i+1]) in the dependency columns
+// of their kind.  All of the columns are arrays of uint32_t, in native byte
+// order: the snapshots are made and read on the same host.
+//
+// The columns, in the order they are written:
+//	name, epoch, version, release, arch, srpm, size, filesize, filename
+//	    (npkg each; epoch is SNAP_NONE if there is none, srpm is the index
+//	    of the srpm name, SNAP_NONE for the srclists)
+//	first, name, flags, version
+//	    (npkg + 1, then ndep[k] each, for each kind of dependencies)
+//	srpms (nsrpm)
+#define SNAP_NONE 0xFFFFFFFF
+
+enum { SNAP_PROVIDES, SNAP_REQUIRES, SNAP_CONFLICTS, SNAP_OBSOLETES, SNAP_NDEPKIND };
+enum { SNAP_NAME, SNAP_EPOCH, SNAP_VERSION, SNAP_RELEASE, SNAP_ARCH,
+       SNAP_SRPM, SNAP_SIZE, SNAP_FILESIZE, SNAP_FILENAME, SNAP_NCOL };
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t npkg;
+    uint32_t nsrpm;
+    uint32_t ndep[SNAP_NDEPKIND];
+    uint32_t poolsize;
+    uint32_t reserved;
+};
+
+static const char snapshotMagic[8] = { 'p', 'k', 'g', 's', 'n', 'a', 'p', '1' };
+
+// The reader.  The columns are checked once, on load, so that the lookups
+// need not check anything.
+class Snapshot
+{
+    const char *base;
+    size_t size;
+    void *map;
+    const struct SnapshotHeader *hdr;
+    const uint32_t *cols[SNAP_NCOL];
+    struct {
+	const uint32_t *first, *name, *flags, *version;
+    } depcols[SNAP_NDEPKIND];
+    const uint32_t *srpms;
+    const char *pool;
+public:
+    Snapshot() : base(NULL), size(0), map(NULL), hdr(NULL) { }
+    ~Snapshot()
+    {
+	if (map)
+	    munmap(map, size);
+    }
+    // Point into the snapshot in memory, which must stay there.
+    bool setup(const void *b, size_t n)
+    {
+	const struct SnapshotHeader *h = (const struct SnapshotHeader *) b;
+	if (n < sizeof *h || memcmp(h->magic, snapshotMagic, sizeof h->magic))
+	    return false;
+	uint64_t need = SNAP_NCOL * (uint64_t) h->npkg + h->nsrpm;
+	for (int k = 0; k < SNAP_NDEPKIND; k++)
+	    need += h->npkg + 1 + 3ULL * h->ndep[k];
+	need = sizeof *h + 4 * need + h->poolsize;
+	if (need != n)
+	    return false;
+	const uint32_t *p = (const uint32_t *) (h + 1);
+	for (int c = 0; c < SNAP_NCOL; c++, p += h->npkg)
+	    cols[c] = p;
+	for (int k = 0; k < SNAP_NDEPKIND; k++) {
+	    depcols[k].first = p, p += h->npkg + 1;
+	    depcols[k].name = p, p += h->ndep[k];
+	    depcols[k].flags = p, p += h->ndep[k];
+	    depcols[k].version = p, p += h->ndep[k];
+	}
+	srpms = p, p += h->nsrpm;
+	const char *pl = (const char *) p;
+	uint32_t ps = h->poolsize;
+	if (ps == 0 || pl[0] || pl[ps-1])
+	    return false;
+	auto bad = [&](const uint32_t *v, size_t count, uint32_t limit, bool none)
+	{
+	    for (size_t i = 0; i < count; i++)
+		if (v[i] >= limit && !(none && v[i] == SNAP_NONE))
+		    return true;
+	    return false;
+	};
+	static const int strcols[] = { SNAP_NAME, SNAP_VERSION, SNAP_RELEASE,
+	    SNAP_ARCH, SNAP_FILENAME };
+	for (int c : strcols)
+	    if (bad(cols[c], h->npkg, ps, false))
+		return false;
+	if (bad(cols[SNAP_SRPM], h->npkg, h->nsrpm, true) || bad(srpms, h->nsrpm, ps, false))
+	    return false;
+	for (int k = 0; k < SNAP_NDEPKIND; k++) {
+	    const uint32_t *f = depcols[k].first;
+	    if (f[0] != 0 || f[h->npkg] != h->ndep[k])
+		return false;
+	    for (uint32_t i = 0; i < h->npkg; i++)
+		if (f[i] > f[i+1])
+		    return false;
+	    if (bad(depcols[k].name, h->ndep[k], ps, false) ||
+		bad(depcols[k].version, h->ndep[k], ps, false))
+		return false;
+	}
+	base = (const char *) b, size = n;
+	hdr = h, pool = pl;
+	return true;
+    }
+    // Map the snapshot file.
+    bool load(const char *path, std::string &err)
+    {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	    return err = strerror(errno), false;
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+	    err = strerror(errno);
+	    close(fd);
+	    return false;
+	}
+	if (st.st_size < (off_t) sizeof(struct SnapshotHeader)) {
+	    close(fd);
+	    return err = "bad snapshot", false;
+	}
+	void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED)
+	    return err = strerror(errno), false;
+	if (!setup(m, st.st_size)) {
+	    munmap(m, st.st_size);
+	    return err = "bad snapshot", false;
+	}
+	map = m;
+	return true;
+    }
+    unsigned packages() const { return hdr->npkg; }
+    // The raw columns, for the loops over all packages.
+    const uint32_t *column(int c) const { return cols[c]; }
+    const char *str(uint32_t off) const { return pool + off; }
+    const char *name(unsigned i) const { return pool + cols[SNAP_NAME][i]; }
+    uint32_t epoch(unsigned i) const { return cols[SNAP_EPOCH][i]; }
+    const char *version(unsigned i) const { return pool + cols[SNAP_VERSION][i]; }
+    const char *release(unsigned i) const { return pool + cols[SNAP_RELEASE][i]; }
+    const char *arch(unsigned i) const { return pool + cols[SNAP_ARCH][i]; }
+    uint32_t srpm(unsigned i) const { return cols[SNAP_SRPM][i]; }
+    uint32_t installedSize(unsigned i) const { return cols[SNAP_SIZE][i]; }
+    uint32_t fileSize(unsigned i) const { return cols[SNAP_FILESIZE][i]; }
+    const char *fileName(unsigned i) const { return pool + cols[SNAP_FILENAME][i]; }
+    // The srpm names, sorted.
+    unsigned srpmCount() const { return hdr->nsrpm; }
+    const char *srpmName(uint32_t id) const { return pool + srpms[id]; }
+    // The dependencies of the kind of the i-th package are
+    // depName(k, first) ... depName(k, first + count - 1), etc.
+    void deps(int k, unsigned i, unsigned &first, unsigned &count) const
+    {
+	first = depcols[k].first[i];
+	count = depcols[k].first[i+1] - first;
+    }
+    const char *depName(int k, unsigned j) const { return pool + depcols[k].name[j]; }
+    uint32_t depFlags(int k, unsigned j) const { return depcols[k].flags[j]; }
+    const char *depVersion(int k, unsigned j) const { return pool + depcols[k].version[j]; }
+};
+
+// ex:set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,287 @@
+/*
+ * The srpm index: which binary packages are built from each source rpm.
+ * genpkglist makes the index, and gensrclist puts it in the srclist.
+ * In the combined generator, the index is passed in memory from one
+ * thread to the other, and gensrclist waits for it only when it is
+ * about to write its output.
+ */
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// The index is compiled into a single blob, which is also the file format:
+// the header, the srpm table sorted by name, the binaries of all srpms
+// back to back, and the string pool.  The srpm table has a sentinel entry,
+// so that the binaries of the i-th srpm are [srpm[i].first, srpm[i+1].first).
+// Integers are in native byte order: the file is only passed between
+// the programs on the same host.
+struct SrpmIndexHeader {
+    char magic[8];
+    uint32_t nsrpm;
+    uint32_t nrpm;
+    uint32_t poolsize;
+    uint32_t reserved;
+};
+
+struct SrpmIndexEntry {
+    uint32_t name; // offset in the pool
+    uint32_t first; // index into the binaries
+};
+
+static const char srpmIndexMagic[8] = { 's', 'r', 'p', 'm', 'i', 'd', 'x', '1' };
+
+class SrpmIndex
+{
+    // the entries as they are added, grouped by srpm on finish
+    StrIntern srpms;
+    StrPool rpms;
+    std::vector<std::pair<unsigned, unsigned> > pairs;
+    // the compiled index, either in memory or mapped
+    std::vector<char> blob;
+    const char *base;
+    size_t size;
+    void *map;
+    const struct SrpmIndexHeader *hdr;
+    const struct SrpmIndexEntry *tab;
+    const uint32_t *bin;
+    const char *pool;
+    std::mutex mutex;
+    std::condition_variable cond;
+    // set when the index is complete, or when the producer gives up
+    bool done;
+    bool ok;
+    // set when the consumer no longer depends on the working directory
+    bool attached;
+    void compile()
+    {
+	std::vector<unsigned> ranks;
+	srpms.rank(ranks);
+	// the binaries of each srpm stay in the order they were added
+	std::stable_sort(pairs.begin(), pairs.end(),
+		[&](const std::pair<unsigned, unsigned> &a,
+		    const std::pair<unsigned, unsigned> &b)
+		{ return ranks[a.first] < ranks[b.first]; });
+	std::vector<unsigned> order(srpms.count());
+	for (unsigned id = 0; id < order.size(); id++)
+	    order[ranks[id]] = id;
+	StrPool out;
+	std::vector<struct SrpmIndexEntry> tabv;
+	std::vector<uint32_t> binv;
+	size_t pi = 0;
+	for (unsigned r = 0; r < order.size(); r++) {
+	    unsigned id = order[r];
+	    // left over from a bad text index
+	    if (pi == pairs.size() || pairs[pi].first != id)
+		continue;
+	    struct SrpmIndexEntry e = { out.add(srpms.str(id)), (uint32_t) binv.size() };
+	    tabv.push_back(e);
+	    for (; pi < pairs.size() && pairs[pi].first == id; pi++)
+		binv.push_back(out.add(rpms.get(pairs[pi].second)));
+	}
+	assert(pi == pairs.size());
+	struct SrpmIndexEntry sentinel = { 0, (uint32_t) binv.size() };
+	tabv.push_back(sentinel);
+	struct SrpmIndexHeader h;
+	memcpy(h.magic, srpmIndexMagic, sizeof h.magic);
+	h.nsrpm = tabv.size() - 1;
+	h.nrpm = binv.size();
+	h.poolsize = out.size();
+	h.reserved = 0;
+	blob.clear();
+	auto put = [&](const void *p, size_t n)
+	{
+	    blob.insert(blob.end(), (const char *) p, (const char *) p + n);
+	};
+	put(&h, sizeof h);
+	put(tabv.data(), tabv.size() * sizeof tabv[0]);
+	put(binv.data(), binv.size() * sizeof binv[0]);
+	if (out.size())
+	    put(out.get(0), out.size());
+	setup(blob.data(), blob.size());
+    }
+    // Point into the blob, after checking that it is consistent,
+    // so that lookups need not check anything.
+    bool setup(const char *b, size_t n)
+    {
+	if (n < sizeof *hdr)
+	    return false;
+	const struct SrpmIndexHeader *h = (const struct SrpmIndexHeader *) b;
+	if (memcmp(h->magic, srpmIndexMagic, sizeof h->magic))
+	    return false;
+	size_t need = sizeof *h + (h->nsrpm + 1ULL) * sizeof *tab +
+		      (size_t) h->nrpm * sizeof *bin + h->poolsize;
+	if (need != n)
+	    return false;
+	const struct SrpmIndexEntry *t = (const struct SrpmIndexEntry *) (h + 1);
+	const uint32_t *r = (const uint32_t *) (t + h->nsrpm + 1);
+	const char *p = (const char *) (r + h->nrpm);
+	if (h->poolsize && p[h->poolsize-1])
+	    return false;
+	for (uint32_t i = 0; i < h->nsrpm; i++)
+	    if (t[i].name >= h->poolsize || t[i].first > t[i+1].first ||
+		(i && strcmp(p + t[i-1].name, p + t[i].name) >= 0))
+		return false;
+	if (t[0].first != 0 || t[h->nsrpm].first != h->nrpm)
+	    return false;
+	for (uint32_t i = 0; i < h->nrpm; i++)
+	    if (r[i] >= h->poolsize)
+		return false;
+	base = b, size = n;
+	hdr = h, tab = t, bin = r, pool = p;
+	return true;
+    }
+    void complete(bool success)
+    {
+	std::lock_guard<std::mutex> lock(mutex);
+	done = true;
+	ok = success;
+	cond.notify_all();
+    }
+public:
+    SrpmIndex() : base(NULL), size(0), map(NULL), hdr(NULL), tab(NULL),
+	bin(NULL), pool(NULL), done(false), ok(false), attached(false)
+    { }
+    ~SrpmIndex()
+    {
+	if (map)
+	    munmap(map, size);
+    }
+    // Producer side.  The binaries of an srpm are listed in the order
+    // they are added.
+    void add(const char *srpm, const char *rpm)
+    {
+	pairs.push_back(std::make_pair(srpms.intern(srpm), rpms.add(rpm)));
+    }
+    // Compile the index and let the consumer proceed; only the first
+    // call has effect.
+    void finish(bool success)
+    {
+	{
+	    std::lock_guard<std::mutex> lock(mutex);
+	    if (done)
+		return;
+	}
+	if (success)
+	    compile();
+	complete(success);
+    }
+    // Map the index written by save, or read it in the old text format,
+    // one "srpm rpm" line per binary.
+    bool load(const char *path, std::string &err)
+    {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	    return err = strerror(errno), false;
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+	    err = strerror(errno);
+	    close(fd);
+	    return false;
+	}
+	char magic[sizeof srpmIndexMagic];
+	if (st.st_size >= (off_t) sizeof(struct SrpmIndexHeader) &&
+	    pread(fd, magic, sizeof magic, 0) == sizeof magic &&
+	    memcmp(magic, srpmIndexMagic, sizeof magic) == 0) {
+	    void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	    close(fd);
+	    if (m == MAP_FAILED)
+		return err = strerror(errno), false;
+	    if (!setup((const char *) m, st.st_size)) {
+		munmap(m, st.st_size);
+		return err = "bad index", false;
+	    }
+	    map = m;
+	    complete(true);
+	    return true;
+	}
+	FILE *fp = fdopen(fd, "r");
+	if (fp == NULL) {
+	    err = strerror(errno);
+	    close(fd);
+	    return false;
+	}
+	char *line = NULL;
+	size_t alloc = 0;
+	ssize_t len;
+	while ((len = getline(&line, &alloc, fp)) > 0) {
+	    if (line[len-1] == '\n')
+		line[--len] = '\0';
+	    char *val = strchr(line, ' ');
+	    if (val == NULL) {
+		free(line);
+		fclose(fp);
+		pairs.clear();
+		return err = "bad index", false;
+	    }
+	    *val++ = '\0';
+	    add(line, val);
+	}
+	free(line);
+	fclose(fp);
+	finish(true);
+	return true;
+    }
+    // Write the compiled index.
+    bool save(FILE *fp) const
+    {
+	return fwrite(base, 1, size, fp) == size;
+    }
+    // Consumer side: wait for the index to complete; returns false
+    // if it will not.
+    bool wait()
+    {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (!done)
+	    cond.wait(lock);
+	return ok;
+    }
+    // The binaries of srpm are rpm(first) ... rpm(first + count - 1).
+    // Only valid after wait.
+    bool find(const char *srpm, unsigned &first, unsigned &count) const
+    {
+	unsigned lo = 0, hi = hdr->nsrpm;
+	while (lo < hi) {
+	    unsigned mid = lo + (hi - lo) / 2;
+	    int cmp = strcmp(pool + tab[mid].name, srpm);
+	    if (cmp == 0) {
+		first = tab[mid].first;
+		count = tab[mid+1].first - first;
+		return true;
+	    }
+	    if (cmp < 0)
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+	return false;
+    }
+    const char *rpm(unsigned i) const
+    {
+	return pool + bin[i];
+    }
+    // The compiled index, for the fingerprint.
+    const void *data(size_t &n) const
+    {
+	n = size;
+	return base;
+    }
+    // The handshake which lets the consumer set up before the producer
+    // changes directories.
+    void attach()
+    {
+	std::lock_guard<std::mutex> lock(mutex);
+	attached = true;
+	cond.notify_all();
+    }
+    void waitAttached()
+    {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (!attached)
+	    cond.wait(lock);
+    }
+};
+
+// ex:set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,112 @@
+/*
+ * Compact string tables
+ */
+
+// Strings stored back to back in a single buffer, addressed by offsets.
+// The pointers returned by get() are only valid until the next add().
+class StrPool
+{
+    std::vector<char> buf;
+public:
+    unsigned add(const char *s, size_t len)
+    {
+	unsigned off = buf.size();
+	buf.insert(buf.end(), s, s + len + 1);
+	return off;
+    }
+    unsigned add(const char *s)
+    {
+	return add(s, strlen(s));
+    }
+    const char *get(unsigned off) const
+    {
+	return &buf[off];
+    }
+    size_t size() const { return buf.size(); }
+};
+
+// Maps strings to dense integer IDs 0, 1, 2, ...
+class StrIntern
+{
+    StrPool pool;
+    std::vector<unsigned> offs; // id -> offset in the pool
+    std::vector<unsigned> slots; // open addressing, id + 1 or 0 if empty
+    static size_t hash(const char *s, size_t len)
+    {
+	// FNV-1a
+	size_t h = 2166136261U;
+	for (size_t i = 0; i < len; i++) {
+	    h ^= (unsigned char) s[i];
+	    h *= 16777619U;
+	}
+	return h;
+    }
+    void grow()
+    {
+	std::vector<unsigned> old(slots.size() ? slots.size() * 2 : 1024, 0);
+	old.swap(slots);
+	size_t mask = slots.size() - 1;
+	for (unsigned id = 0; id < offs.size(); id++) {
+	    const char *s = pool.get(offs[id]);
+	    size_t i = hash(s, strlen(s)) & mask;
+	    while (slots[i])
+		i = (i + 1) & mask;
+	    slots[i] = id + 1;
+	}
+    }
+public:
+    unsigned intern(const char *s)
+    {
+	// keep the load factor below 1/2
+	if (2 * (offs.size() + 1) > slots.size())
+	    grow();
+	size_t len = strlen(s);
+	size_t mask = slots.size() - 1;
+	size_t i = hash(s, len) & mask;
+	while (slots[i]) {
+	    unsigned id = slots[i] - 1;
+	    if (strcmp(pool.get(offs[id]), s) == 0)
+		return id;
+	    i = (i + 1) & mask;
+	}
+	unsigned id = offs.size();
+	offs.push_back(pool.add(s, len));
+	slots[i] = id + 1;
+	return id;
+    }
+    // The ID of the string, or -1 if it has not been interned.
+    int find(const char *s) const
+    {
+	if (slots.empty())
+	    return -1;
+	size_t mask = slots.size() - 1;
+	size_t i = hash(s, strlen(s)) & mask;
+	while (slots[i]) {
+	    unsigned id = slots[i] - 1;
+	    if (strcmp(pool.get(offs[id]), s) == 0)
+		return id;
+	    i = (i + 1) & mask;
+	}
+	return -1;
+    }
+    const char *str(unsigned id) const
+    {
+	return pool.get(offs[id]);
+    }
+    unsigned count() const { return offs.size(); }
+    // Rank the IDs by collation order: ranks[id] is the position
+    // of the string among all the strings sorted with strcmp.
+    void rank(std::vector<unsigned> &ranks) const
+    {
+	std::vector<unsigned> ids(offs.size());
+	for (unsigned id = 0; id < ids.size(); id++)
+	    ids[id] = id;
+	std::sort(ids.begin(), ids.end(), [this](unsigned a, unsigned b)
+		{ return strcmp(str(a), str(b)) < 0; });
+	ranks.resize(ids.size());
+	for (unsigned i = 0; i < ids.size(); i++)
+	    ranks[ids[i]] = i;
+    }
+};
+
+// ex:set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,712 @@
+// Copyright (c) 2017 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#define _GNU_SOURCE // memmem
+#include "xwrite.h"
+
+// Helpers to fill err[2] arg.
+#define ERRNO(func) err[0] = func, err[1] = xstrerror(errno)
+#define ERRSTR(str) err[0] = __func__, err[1] = str
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <lzma.h>
+#include <bzlib.h>
+#include <zstd.h>
+#include <rpm/rpmpgp.h>
+#include "teewriter.h"
+
+// The input is cut into chunks, at header boundaries, and each chunk
+// is compressed into an independent stream; the streams are then written
+// out in order.  Concatenated streams make a valid .xz, .bz2 and .zst file.
+// The cut points are content-defined: past MINCHUNK, a rolling hash of the
+// input is armed to fire with the probability of 1/(MASK+1) per byte, and
+// the chunk is cut at the next header.  Thus the chunks of a list which
+// has changed only a little are mostly the same as before, and their
+// compressed form can be taken from the cache.  Chunks average about 8M,
+// which is the dictionary size of xz -6, so that little is lost in terms
+// of compression ratio.  If there is no cut point by MAXCHUNK, the chunk
+// is cut at the first header past MAXCHUNK; it grows by STEP bytes at a
+// time until then.
+#define MINCHUNK (4 << 20)
+#define MAXCHUNK (16 << 20)
+#define MASK ((1 << 22) - 1)
+#define STEP (1 << 20)
+
+/* Formats */
+
+static size_t xz_bound(size_t size)
+{
+    return lzma_stream_buffer_bound(size);
+}
+
+static uint64_t xz_memusage(void)
+{
+    return lzma_easy_encoder_memusage(6);
+}
+
+static bool xz_compress(const void *in, size_t size, void *out, size_t *zsize, const char *err[2])
+{
+    size_t pos = 0;
+    // The same as xz(1) does by default.
+    lzma_ret ret = lzma_easy_buffer_encode(6, LZMA_CHECK_CRC64, NULL,
+					   in, size, out, &pos, *zsize);
+    if (ret != LZMA_OK)
+	return err[0] = "lzma_easy_buffer_encode",
+	       err[1] = ret == LZMA_MEM_ERROR ? xstrerror(ENOMEM) : "xz encoder error",
+	       false;
+    *zsize = pos;
+    return true;
+}
+
+static size_t bz2_bound(size_t size)
+{
+    // From the bzip2 manual: 1% larger + 600 bytes.
+    return size + size / 100 + 600;
+}
+
+static uint64_t bz2_memusage(void)
+{
+    // From the bzip2 manual: 400k + (8 x block size).
+    return 400000 + 8 * 900000;
+}
+
+static bool bz2_compress(const void *in, size_t size, void *out, size_t *zsize, const char *err[2])
+{
+    unsigned len = *zsize;
+    // The same as bzip2(1) does by default.
+    int ret = BZ2_bzBuffToBuffCompress(out, &len, (char *) in, size, 9, 0, 0);
+    if (ret != BZ_OK)
+	return err[0] = "BZ2_bzBuffToBuffCompress",
+	       err[1] = ret == BZ_MEM_ERROR ? xstrerror(ENOMEM) : "bzip2 encoder error",
+	       false;
+    *zsize = len;
+    return true;
+}
+
+static size_t zst_bound(size_t size)
+{
+    return ZSTD_compressBound(size);
+}
+
+static uint64_t zst_memusage(void)
+{
+    // ZSTD_estimateCCtxSize is not in the stable API; level 3 has a 2M
+    // window, and takes a few megabytes.
+    return 8 << 20;
+}
+
+static bool zst_compress(const void *in, size_t size, void *out, size_t *zsize, const char *err[2])
+{
+    // The same as zstd(1) does by default.
+    size_t ret = ZSTD_compress(out, *zsize, in, size, 3);
+    if (ZSTD_isError(ret))
+	return err[0] = "ZSTD_compress", err[1] = ZSTD_getErrorName(ret), false;
+    *zsize = ret;
+    return true;
+}
+
+struct format {
+    const char *name;
+    // goes into the cache key, along with the chunk
+    const char *settings;
+    size_t (*bound)(size_t size);
+    // the memory taken by the encoder
+    uint64_t (*memusage)(void);
+    bool (*compress)(const void *in, size_t size, void *out, size_t *zsize, const char *err[2]);
+};
+
+static const struct format formats[] = {
+    { "xz", "xz -6 crc64", xz_bound, xz_memusage, xz_compress },
+    { "bz2", "bzip2 -9", bz2_bound, bz2_memusage, bz2_compress },
+    { "zst", "zstd -3", zst_bound, zst_memusage, zst_compress },
+};
+
+#define NFMT (sizeof formats / sizeof formats[0])
+
+/* Writer */
+
+// A compressed chunk waiting for its turn to be written out.
+struct result {
+    bool ready;
+    unsigned char *zbuf;
+    size_t zsize;
+};
+
+// An output file.
+struct stream {
+    const struct format *fmt;
+    // written to tmp, renamed to path on success
+    char *path;
+    char *tmp;
+    bool renamed;
+    int fd;
+    // the number of chunks written out (or skipped after an error)
+    uint64_t nwritten;
+    // some thread is writing out ready results
+    bool writing;
+    bool error;
+    const char *err[2];
+    // indexed by chunk number % maxq
+    struct result *results;
+};
+
+struct chunk {
+    unsigned char *buf;
+    size_t size, alloc;
+    // the digest, computed by the first job which needs it
+    bool hashing, hashed;
+    char digest[65];
+};
+
+struct teewriter {
+    pthread_mutex_t mutex;
+    // workers wait for jobs
+    pthread_cond_t produced;
+    // the writer waits for a free chunk
+    pthread_cond_t consumed;
+    // the jobs wait for the digest of the chunk
+    pthread_cond_t hashed;
+    int nthreads;
+    pthread_t *threads;
+    int nstream;
+    struct stream stream[NFMT];
+    // the number of chunks in flight
+    size_t maxq;
+    struct chunk *chunks;
+    // the number of chunks submitted, jobs taken
+    uint64_t nput;
+    uint64_t njob;
+    bool eof;
+    DIGEST_CTX md5;
+    uint64_t total;
+    // content-defined chunking, see above
+    uint64_t gear;
+    bool armed;
+    size_t scanned;
+    // compressed chunks, by their digest
+    char *cachedir;
+};
+
+/* Cache */
+
+static void sha256(const void *data, size_t size, char hex[65])
+{
+    DIGEST_CTX ctx = rpmDigestInit(PGPHASHALGO_SHA256, RPMDIGEST_NONE);
+    rpmDigestUpdate(ctx, data, size);
+    char *s = NULL;
+    rpmDigestFinal(ctx, (void **) &s, NULL, 1);
+    hex[0] = '\0';
+    if (s)
+	strncat(hex, s, 64);
+    free(s);
+}
+
+// The key is the digest of the encoder settings and of the digest of
+// the chunk.  The chunk is hashed only once, by the first of its jobs,
+// however many formats there are.
+static void cacheKey(struct teewriter *tw, const struct format *fmt, struct chunk *c, char key[65])
+{
+    pthread_mutex_lock(&tw->mutex);
+    while (c->hashing)
+	pthread_cond_wait(&tw->hashed, &tw->mutex);
+    bool mine = !c->hashed;
+    c->hashing = mine;
+    pthread_mutex_unlock(&tw->mutex);
+    if (mine) {
+	sha256(c->buf, c->size, c->digest);
+	pthread_mutex_lock(&tw->mutex);
+	c->hashing = false, c->hashed = true;
+	pthread_cond_broadcast(&tw->hashed);
+	pthread_mutex_unlock(&tw->mutex);
+    }
+    size_t len = strlen(fmt->settings) + 1;
+    char buf[len + 64];
+    memcpy(buf, fmt->settings, len);
+    memcpy(buf + len, c->digest, 64);
+    sha256(buf, len + 64, key);
+}
+
+// Loads the compressed chunk, if cached.  The mtime of the cached file
+// is updated, so that the files which are no longer used can be pruned.
+static bool cacheGet(const char *path, struct result *r)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+	return false;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0 && st.st_size > 0;
+    if (ok) {
+	r->zsize = st.st_size;
+	r->zbuf = malloc(r->zsize);
+	ok = r->zbuf && read(fd, r->zbuf, r->zsize) == (ssize_t) r->zsize;
+	if (ok)
+	    futimens(fd, NULL);
+	else
+	    free(r->zbuf), r->zbuf = NULL;
+    }
+    close(fd);
+    return ok;
+}
+
+// Puts the compressed chunk into the cache, atomically.  Errors are
+// not fatal: the cache is only an optimization.
+static void cachePut(const char *path, const struct result *r)
+{
+    char tmp[strlen(path) + 8];
+    sprintf(tmp, "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    if (fd < 0)
+	return;
+    bool ok = xwrite(fd, r->zbuf, r->zsize);
+    if (close(fd) < 0)
+	ok = false;
+    if (!(ok && rename(tmp, path) == 0))
+	unlink(tmp);
+}
+
+// Random numbers for the rolling hash, made up with splitmix64.
+static uint64_t gearTab[256];
+static pthread_once_t gearOnce = PTHREAD_ONCE_INIT;
+
+static void gearInit(void)
+{
+    uint64_t x = 0;
+    for (int i = 0; i < 256; i++) {
+	uint64_t z = (x += 0x9e3779b97f4a7c15);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+	gearTab[i] = z ^ (z >> 31);
+    }
+}
+
+// Compresses a chunk into one of the formats.
+static void job(struct teewriter *tw, uint64_t seq, struct stream *s)
+{
+    struct chunk *c = &tw->chunks[seq % tw->maxq];
+    struct result r = { true, NULL, 0 };
+    const char *err[2];
+    bool ok = !s->error;
+    char path[tw->cachedir ? strlen(tw->cachedir) + 70 : 1];
+    bool cached = false;
+    if (ok && tw->cachedir) {
+	char key[65];
+	cacheKey(tw, s->fmt, c, key);
+	sprintf(path, "%s/%.2s/%s", tw->cachedir, key, key + 2);
+	cached = cacheGet(path, &r);
+    }
+    if (ok && !cached) {
+	r.zsize = s->fmt->bound(c->size);
+	r.zbuf = malloc(r.zsize);
+	if (!r.zbuf)
+	    ERRNO("malloc"), ok = false;
+	else if (!s->fmt->compress(c->buf, c->size, r.zbuf, &r.zsize, err))
+	    ok = false;
+	else if (tw->cachedir) {
+	    char *slash = strrchr(path, '/');
+	    *slash = '\0';
+	    mkdir(path, 0777);
+	    *slash = '/';
+	    cachePut(path, &r);
+	}
+    }
+    pthread_mutex_lock(&tw->mutex);
+    if (!ok && !s->error)
+	s->error = true, s->err[0] = err[0], s->err[1] = err[1];
+    s->results[seq % tw->maxq] = r;
+    // Write out the results in order, unless another thread is doing it.
+    if (s->writing)
+	return (void) pthread_mutex_unlock(&tw->mutex);
+    s->writing = true;
+    while (1) {
+	struct result *rp = &s->results[s->nwritten % tw->maxq];
+	if (!rp->ready)
+	    break;
+	r = *rp;
+	pthread_mutex_unlock(&tw->mutex);
+	ok = true;
+	if (r.zbuf && !s->error)
+	    if (!xwrite(s->fd, r.zbuf, r.zsize))
+		ERRNO("write"), ok = false;
+	free(r.zbuf);
+	pthread_mutex_lock(&tw->mutex);
+	if (!ok && !s->error)
+	    s->error = true, s->err[0] = err[0], s->err[1] = err[1];
+	rp->ready = false, rp->zbuf = NULL;
+	s->nwritten++;
+	pthread_cond_signal(&tw->consumed);
+    }
+    s->writing = false;
+    pthread_mutex_unlock(&tw->mutex);
+}
+
+static void *worker(void *arg)
+{
+    struct teewriter *tw = arg;
+    pthread_mutex_lock(&tw->mutex);
+    while (1) {
+	while (tw->njob == tw->nput * tw->nstream && !tw->eof)
+	    pthread_cond_wait(&tw->produced, &tw->mutex);
+	if (tw->njob == tw->nput * tw->nstream)
+	    break;
+	uint64_t j = tw->njob++;
+	pthread_mutex_unlock(&tw->mutex);
+	job(tw, j / tw->nstream, &tw->stream[j % tw->nstream]);
+	pthread_mutex_lock(&tw->mutex);
+    }
+    pthread_mutex_unlock(&tw->mutex);
+    return NULL;
+}
+
+// Stops the threads which have been started, frees everything.
+static void teardown(struct teewriter *tw, int nstarted)
+{
+    pthread_mutex_lock(&tw->mutex);
+    tw->eof = true;
+    pthread_cond_broadcast(&tw->produced);
+    pthread_mutex_unlock(&tw->mutex);
+    for (int i = 0; i < nstarted; i++)
+	pthread_join(tw->threads[i], NULL);
+    for (int i = 0; i < tw->nstream; i++) {
+	struct stream *s = &tw->stream[i];
+	if (s->fd >= 0)
+	    close(s->fd);
+	if (s->tmp && !s->renamed)
+	    unlink(s->tmp);
+	free(s->path);
+	free(s->tmp);
+	if (s->results)
+	    for (size_t j = 0; j < tw->maxq; j++)
+		free(s->results[j].zbuf);
+	free(s->results);
+    }
+    if (tw->chunks)
+	for (size_t j = 0; j < tw->maxq; j++)
+	    free(tw->chunks[j].buf);
+    free(tw->chunks);
+    free(tw->threads);
+    free(tw->cachedir);
+    if (tw->md5) {
+	void *md5 = NULL;
+	rpmDigestFinal(tw->md5, &md5, NULL, 1);
+	free(md5);
+    }
+    pthread_cond_destroy(&tw->produced);
+    pthread_cond_destroy(&tw->consumed);
+    pthread_cond_destroy(&tw->hashed);
+    pthread_mutex_destroy(&tw->mutex);
+    free(tw);
+}
+
+// A thread takes the encoder memory, its chunk, and the compressed chunk.
+// The memory is given out by the cores: the threads of a teewriter may
+// take up to half of RAM times nthreads/ncpu.  Thus the teewriters which
+// share the cores, as genbasedir makes them do with --jobs, take no more
+// than half of RAM together.
+static int memThreads(struct teewriter *tw, int nthreads, long ncpu)
+{
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long pagesize = sysconf(_SC_PAGESIZE);
+    if (pages < 1 || pagesize < 1)
+	return nthreads;
+    uint64_t enc = 0;
+    for (int i = 0; i < tw->nstream; i++) {
+	uint64_t m = tw->stream[i].fmt->memusage();
+	if (enc < m)
+	    enc = m;
+    }
+    uint64_t perThread = enc + 2 * (uint64_t) MAXCHUNK;
+    uint64_t budget = (uint64_t) pages * pagesize / 2 / ncpu * nthreads;
+    uint64_t n = budget / perThread;
+    if (n < 1)
+	n = 1;
+    return n < (uint64_t) nthreads ? (int) n : nthreads;
+}
+
+struct teewriter *teewriter_open(const char *base, const char *fmts, const char *cachedir, int nthreads, const char *err[2])
+{
+    struct teewriter *tw = calloc(1, sizeof *tw);
+    if (!tw)
+	return ERRNO("calloc"), NULL;
+    pthread_mutex_init(&tw->mutex, NULL);
+    pthread_cond_init(&tw->produced, NULL);
+    pthread_cond_init(&tw->consumed, NULL);
+    pthread_cond_init(&tw->hashed, NULL);
+
+    if (cachedir) {
+	tw->cachedir = strdup(cachedir);
+	if (!tw->cachedir)
+	    return ERRNO("strdup"),
+		   teardown(tw, 0), NULL;
+	if (mkdir(cachedir, 0777) < 0 && errno != EEXIST)
+	    return ERRNO("mkdir"),
+		   teardown(tw, 0), NULL;
+    }
+
+    tw->md5 = rpmDigestInit(PGPHASHALGO_MD5, RPMDIGEST_NONE);
+    if (!tw->md5)
+	return ERRSTR("cannot initialize md5"),
+	       teardown(tw, 0), NULL;
+
+    const char *p = fmts;
+    while (*p) {
+	size_t len = strcspn(p, ",");
+	const struct format *fmt = NULL;
+	for (size_t i = 0; i < NFMT; i++)
+	    if (strlen(formats[i].name) == len && memcmp(formats[i].name, p, len) == 0)
+		fmt = &formats[i];
+	if (!fmt)
+	    return ERRSTR("unknown compression format"),
+		   teardown(tw, 0), NULL;
+	p += len;
+	if (*p == ',')
+	    p++;
+	bool dup = false;
+	for (int i = 0; i < tw->nstream; i++)
+	    if (tw->stream[i].fmt == fmt)
+		dup = true;
+	if (dup)
+	    continue;
+
+	struct stream *s = &tw->stream[tw->nstream++];
+	s->fmt = fmt;
+	s->fd = -1;
+	s->path = malloc(strlen(base) + len + 2);
+	s->tmp = malloc(strlen(base) + len + 6);
+	if (!s->path || !s->tmp)
+	    return ERRNO("malloc"),
+		   teardown(tw, 0), NULL;
+	sprintf(s->path, "%s.%s", base, fmt->name);
+	sprintf(s->tmp, "%s.tmp", s->path);
+	s->fd = open(s->tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (s->fd < 0)
+	    return ERRNO("open"),
+		   teardown(tw, 0), NULL;
+    }
+    if (tw->nstream == 0)
+	return tw;
+
+    // One thread per core by default; a few more chunks than threads,
+    // so that the threads are kept busy while the next chunk is being
+    // filled.
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1)
+	ncpu = 1;
+    if (nthreads <= 0)
+	nthreads = ncpu;
+    tw->nthreads = memThreads(tw, nthreads, ncpu);
+    tw->maxq = tw->nthreads + 2;
+    pthread_once(&gearOnce, gearInit);
+
+    tw->chunks = calloc(tw->maxq, sizeof *tw->chunks);
+    tw->threads = malloc(tw->nthreads * sizeof *tw->threads);
+    if (!tw->chunks || !tw->threads)
+	return ERRNO("malloc"),
+	       teardown(tw, 0), NULL;
+    for (int i = 0; i < tw->nstream; i++) {
+	struct stream *s = &tw->stream[i];
+	s->results = calloc(tw->maxq, sizeof *s->results);
+	if (!s->results)
+	    return ERRNO("calloc"),
+		   teardown(tw, 0), NULL;
+    }
+
+    for (int i = 0; i < tw->nthreads; i++) {
+	int rc = pthread_create(&tw->threads[i], NULL, worker, tw);
+	if (rc)
+	    return err[0] = "pthread_create", err[1] = xstrerror(rc),
+		   teardown(tw, i), NULL;
+    }
+
+    return tw;
+}
+
+// Submits the chunk being filled, waits until the next one is free.
+static void put(struct teewriter *tw)
+{
+    pthread_mutex_lock(&tw->mutex);
+    tw->nput++;
+    pthread_cond_broadcast(&tw->produced);
+    for (int i = 0; i < tw->nstream; i++)
+	while (tw->nput - tw->stream[i].nwritten >= tw->maxq)
+	    pthread_cond_wait(&tw->consumed, &tw->mutex);
+    pthread_mutex_unlock(&tw->mutex);
+    struct chunk *c = &tw->chunks[tw->nput % tw->maxq];
+    c->size = 0, c->hashed = false;
+    // a chunk which has grown past MAXCHUNK does not keep the memory
+    if (c->alloc > MAXCHUNK)
+	free(c->buf), c->buf = NULL, c->alloc = 0;
+    tw->gear = 0, tw->armed = false, tw->scanned = 0;
+}
+
+// Appends to the chunk being filled.
+static bool append(struct teewriter *tw, const void *buf, size_t size, const char *err[2])
+{
+    struct chunk *c = &tw->chunks[tw->nput % tw->maxq];
+    if (c->size + size > c->alloc) {
+	size_t alloc = c->alloc ? c->alloc : MAXCHUNK;
+	while (alloc < c->size + size)
+	    alloc += STEP;
+	unsigned char *p = realloc(c->buf, alloc);
+	if (!p)
+	    return ERRNO("realloc"), false;
+	c->buf = p, c->alloc = alloc;
+    }
+    memcpy(c->buf + c->size, buf, size);
+    c->size += size;
+    return true;
+}
+
+static const unsigned char headerMagic[8] = {
+    0x8e, 0xad, 0xe8, 0x01, 0x00, 0x00, 0x00, 0x00
+};
+
+// Scans the newly appended data for a cut point; returns 0 if none.
+// The hash only depends on the last 64 bytes, so it starts a bit
+// before MINCHUNK.
+static size_t scan(struct teewriter *tw, const struct chunk *c)
+{
+    size_t i = tw->scanned;
+    if (i < MINCHUNK - 64)
+	i = MINCHUNK - 64;
+    if (!tw->armed) {
+	uint64_t h = tw->gear;
+	for (; i < c->size; i++) {
+	    h = (h << 1) + gearTab[c->buf[i]];
+	    if (i >= MINCHUNK && (h & MASK) == 0) {
+		tw->armed = true, i++;
+		break;
+	    }
+	}
+	tw->gear = h;
+    }
+    tw->scanned = i;
+    if (!tw->armed || i >= c->size)
+	return 0;
+    const unsigned char *m = memmem(c->buf + i, c->size - i, headerMagic, sizeof headerMagic);
+    if (m)
+	return m - c->buf;
+    // the magic can straddle the writes
+    if (c->size - i >= sizeof headerMagic)
+	tw->scanned = c->size - (sizeof headerMagic - 1);
+    return 0;
+}
+
+bool teewriter_write(struct teewriter *tw, const void *buf, size_t size, const char *err[2])
+{
+    rpmDigestUpdate(tw->md5, buf, size);
+    tw->total += size;
+    if (tw->nstream == 0)
+	return true;
+    while (size) {
+	struct chunk *c = &tw->chunks[tw->nput % tw->maxq];
+	size_t n = c->size < MAXCHUNK ? MAXCHUNK - c->size : STEP;
+	if (n > size)
+	    n = size;
+	if (!append(tw, buf, n, err))
+	    return false;
+	buf = (const char *) buf + n, size -= n;
+	size_t cut = scan(tw, c);
+	if (cut) {
+	    // the rest goes to the next chunk
+	    size_t tail = c->size - cut;
+	    c->size = cut;
+	    put(tw);
+	    if (!append(tw, c->buf + cut, tail, err))
+		return false;
+	}
+	else if (c->size >= MAXCHUNK && !tw->armed) {
+	    // no cut point: take the next header
+	    tw->armed = true;
+	    tw->scanned = c->size - (sizeof headerMagic - 1);
+	}
+    }
+    return true;
+}
+
+bool teewriter_close(struct teewriter *tw, char md5[33], uint64_t *size, const char *err[2])
+{
+    bool ok = true;
+    if (tw->nstream) {
+	// even empty input makes a valid compressed file
+	if (tw->chunks[tw->nput % tw->maxq].size || tw->nput == 0) {
+	    if (!append(tw, "", 0, err))
+		return teardown(tw, 0), false;
+	    put(tw);
+	}
+	pthread_mutex_lock(&tw->mutex);
+	tw->eof = true;
+	pthread_cond_broadcast(&tw->produced);
+	pthread_mutex_unlock(&tw->mutex);
+	for (int i = 0; i < tw->nthreads; i++)
+	    pthread_join(tw->threads[i], NULL);
+	tw->nthreads = 0;
+	for (int i = 0; i < tw->nstream; i++) {
+	    struct stream *s = &tw->stream[i];
+	    assert(s->nwritten == tw->nput);
+	    if (ok && s->error)
+		err[0] = s->err[0], err[1] = s->err[1], ok = false;
+	    int rc = close(s->fd);
+	    s->fd = -1;
+	    if (rc < 0 && ok)
+		ERRNO("close"), ok = false;
+	}
+    }
+
+    char *hex = NULL;
+    rpmDigestFinal(tw->md5, (void **) &hex, NULL, 1);
+    tw->md5 = NULL;
+    if (hex) {
+	strncpy(md5, hex, 32);
+	md5[32] = '\0';
+	free(hex);
+    }
+    else if (ok)
+	ERRSTR("cannot compute md5"), ok = false;
+    *size = tw->total;
+
+    // The files are replaced only when everything is fine.
+    for (int i = 0; ok && i < tw->nstream; i++) {
+	struct stream *s = &tw->stream[i];
+	if (rename(s->tmp, s->path) < 0)
+	    ERRNO("rename"), ok = false;
+	else
+	    s->renamed = true;
+    }
+
+    teardown(tw, 0);
+    return ok;
+}
+
+void teewriter_abort(struct teewriter *tw)
+{
+    // the pending jobs are skipped, as after a write error
+    pthread_mutex_lock(&tw->mutex);
+    for (int i = 0; i < tw->nstream; i++)
+	tw->stream[i].error = true;
+    pthread_mutex_unlock(&tw->mutex);
+    teardown(tw, tw->nthreads);
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
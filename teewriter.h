@@ -0,0 +1,53 @@
+// Copyright (c) 2017 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// The teewriter takes the uncompressed stream of headers which is being
+// written to the .lz4 list, and compresses it into .xz, .bz2 and .zst
+// files along the way, using all the cores.  It also computes the size
+// and md5 of the uncompressed stream.
+
+#ifndef TEEWRITER_H
+#define TEEWRITER_H
+
+#ifdef __cplusplus
+extern "C" {
+#else
+#include <stdbool.h>
+#endif
+
+#include <stdint.h>
+
+// Formats are given by a comma-separated list, e.g. "xz,bz2,zst".
+// The output files are named by appending the format to base.
+// With empty formats, only the size and md5 are computed.  If cachedir
+// is not NULL, compressed chunks are looked up there and saved there.
+// The chunks are compressed by nthreads threads, or by one thread per
+// core if nthreads is 0; by fewer threads if their encoders and chunks
+// would take more than their share of half of RAM.
+struct teewriter *teewriter_open(const char *base, const char *formats, const char *cachedir, int nthreads, const char *err[2]) __attribute__((nonnull(1,2,5)));
+bool teewriter_write(struct teewriter *tw, const void *buf, size_t size, const char *err[2]) __attribute__((nonnull));
+bool teewriter_close(struct teewriter *tw, char md5[33], uint64_t *size, const char *err[2]) __attribute__((nonnull));
+// Drops the output: stops the threads, removes the temporary files.
+void teewriter_abort(struct teewriter *tw) __attribute__((nonnull));
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,73 @@
+// Copyright (c) 2017 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef XWRITE_H
+#define XWRITE_H
+
+#include <stdbool.h>
+#include <assert.h>
+#include <unistd.h>
+#include <errno.h>
+
+// Writes exactly size bytes.
+static bool xwrite(int fd, const void *buf, size_t size)
+{
+    assert(size);
+    bool zero = false;
+    do {
+	ssize_t ret = write(fd, buf, size);
+	if (ret < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return false;
+	}
+	if (ret == 0) {
+	    if (zero) {
+		// write(2) keeps returning zero
+		errno = EAGAIN;
+		return false;
+	    }
+	    zero = true;
+	    continue;
+	}
+	zero = false;
+	assert(ret <= size);
+	buf = (char *) buf + ret;
+	size -= ret;
+    } while (size);
+
+    return true;
+}
+
+#include <stdio.h> // sys_errlist
+
+// A thread-safe strerror(3) replacement.
+static const char *xstrerror(int errnum)
+{
+    // Some of the great minds say that sys_errlist is deprecated.
+    // Well, at least it's thread-safe, and it does not deadlock.
+    if (errnum > 0 && errnum < sys_nerr)
+	return sys_errlist[errnum];
+    return "Unknown error";
+}
+
+#endif
+
+// ex:set ts=8 sts=4 sw=4 noet:
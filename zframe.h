@@ -0,0 +1,76 @@
+/*
+ * Walking the LZ4 frames of a list
+ */
+
+// The frames are found without decompressing them, from the frame
+// descriptors and the block sizes.
+static inline uint32_t zframeLE32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+// The size of the frame at buf, or 0 if there is no valid frame within
+// avail bytes.  Skippable frames are recognized too, and reported
+// with *skippable set.
+static size_t zframeSize(const void *buf, size_t avail, bool *skippable)
+{
+    const unsigned char *p = (const unsigned char *) buf;
+    *skippable = false;
+    if (avail < 8)
+	return 0;
+    uint32_t magic = zframeLE32(p);
+    if ((magic & 0xFFFFFFF0) == 0x184D2A50) {
+	uint32_t size = zframeLE32(p + 4);
+	if (size > avail - 8)
+	    return 0;
+	*skippable = true;
+	return 8 + (size_t) size;
+    }
+    if (magic != 0x184D2204)
+	return 0;
+    unsigned flg = p[4];
+    // version 01, reserved bit clear
+    if ((flg >> 6) != 1 || (flg & 2))
+	return 0;
+    bool blockChecksum = flg & 0x10;
+    bool contentSize = flg & 0x08;
+    bool contentChecksum = flg & 0x04;
+    bool dictID = flg & 0x01;
+    // magic, FLG, BD, the optional fields, HC
+    size_t pos = 4 + 2 + (contentSize ? 8 : 0) + (dictID ? 4 : 0) + 1;
+    if (pos > avail)
+	return 0;
+    while (1) {
+	if (avail - pos < 4)
+	    return 0;
+	uint32_t bsize = zframeLE32(p + pos) & 0x7FFFFFFF;
+	pos += 4;
+	if (bsize == 0)
+	    break; // EndMark
+	size_t need = bsize + (blockChecksum ? 4 : 0);
+	if (need > avail - pos)
+	    return 0;
+	pos += need;
+    }
+    if (contentChecksum) {
+	if (avail - pos < 4)
+	    return 0;
+	pos += 4;
+    }
+    return pos;
+}
+
+// The hash of the frame bytes, to match the frames of two lists
+// without decompressing them (FNV-1a).
+static uint64_t zframeHash(const void *buf, size_t size)
+{
+    const unsigned char *p = (const unsigned char *) buf;
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+	h ^= p[i];
+	h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
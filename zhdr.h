@@ -14,71 +14,208 @@ static unsigned char zhdr_magic[8] = {
     0x8e, 0xad, 0xe8, 0x01, 0x00, 0x00, 0x00, 0x00
 };
 
-// Compress a few headers in a single chunk.
-// Headers have magic, to be written to pkglist.
-static void *zhdrv(std::vector<Header> const& hh, size_t& zsize)
+// Per-thread state: the LZ4F contexts are created once, and the buffers
+// only grow, so that in the steady state compressing and decompressing
+// the groups does not allocate (except for what headerUnload does).
+struct zhdr_ctx {
+    LZ4F_compressionContext_t cctx;
+    LZ4F_decompressionContext_t dctx;
+    // the headers with magic, back to back
+    std::vector<char> raw;
+    size_t rawSize;
+    // header sizes, and the compressed output of zhdrv
+    std::vector<size_t> ss;
+    std::vector<char> zbuf;
+    zhdr_ctx() : rawSize(0)
+    {
+	size_t ret = LZ4F_createCompressionContext(&cctx, LZ4F_VERSION);
+	assert(!LZ4F_isError(ret));
+	ret = LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
+	assert(!LZ4F_isError(ret));
+    }
+    ~zhdr_ctx()
+    {
+	LZ4F_freeCompressionContext(cctx);
+	LZ4F_freeDecompressionContext(dctx);
+    }
+};
+
+static zhdr_ctx &zhdr_tls()
+{
+    static thread_local zhdr_ctx ctx;
+    return ctx;
+}
+
+// Same preferences as LZ4F_compressFrame would pick, so that
+// the output does not depend on how the frame is made.
+static void zhdrPref(LZ4F_preferences_t& pref, size_t ssum)
+{
+    memset(&pref, 0, sizeof pref);
+    pref.frameInfo.blockSizeID = ssum <= (64 << 10) ? LZ4F_max64KB : LZ4F_max256KB;
+    if (ssum <= (256 << 10))
+	pref.frameInfo.blockMode = LZ4F_blockIndependent;
+    pref.frameInfo.contentSize = ssum;
+    pref.autoFlush = 1;
+}
+
+// The bound on the compressed size of ssum bytes.
+static size_t zhdrBound(size_t ssum)
+{
+    LZ4F_preferences_t pref;
+    zhdrPref(pref, ssum);
+    return LZ4F_compressFrameBound(ssum, &pref);
+}
+
+// Serialize a few headers, with magic, into the per-thread buffer.
+// Returns the bound on the compressed size, to be passed to zhdrCompress.
+static size_t zhdrPrepare(std::vector<Header> const& hh)
 {
     assert(hh.size() >= 1);
-    std::vector<size_t> ss;
-    ss.reserve(hh.size());
+    zhdr_ctx &ctx = zhdr_tls();
+    if (ctx.ss.size() < hh.size())
+	ctx.ss.resize(hh.size());
     size_t ssum = hh.size() * sizeof zhdr_magic;
     for (size_t i = 0; i < hh.size(); i++) {
 	size_t size = headerSizeof(hh[i], HEADER_MAGIC_NO);
-	ss[i] = size;
+	ctx.ss[i] = size;
 	ssum += size;
     }
-    char *bb = (char *) malloc(ssum);
-    assert(bb);
-    char *pp = bb;
+    if (ctx.raw.size() < ssum)
+	ctx.raw.resize(ssum);
+    char *pp = ctx.raw.data();
     for (size_t i = 0; i < hh.size(); i++) {
 	void *blob = headerUnload(hh[i]);
 	assert(blob);
 	memcpy(pp, zhdr_magic, sizeof zhdr_magic);
-	memcpy(pp + sizeof zhdr_magic, blob, ss[i]);
+	memcpy(pp + sizeof zhdr_magic, blob, ctx.ss[i]);
 	free(blob);
-	pp += ss[i] + sizeof zhdr_magic;
+	pp += ctx.ss[i] + sizeof zhdr_magic;
     }
-    assert(pp == bb + ssum);
+    assert(pp == ctx.raw.data() + ssum);
+    ctx.rawSize = ssum;
+    return zhdrBound(ssum);
+}
+
+// The headers serialized by zhdrPrepare, or decompressed by unzhdrv.
+static const void *zhdrRaw(size_t& size)
+{
+    zhdr_ctx &ctx = zhdr_tls();
+    size = ctx.rawSize;
+    return ctx.raw.data();
+}
+
+// Compress serialized headers into zbuf, which must be at least
+// zhdrBound(size) bytes.  Headers can be serialized in one thread
+// and compressed in another.
+static size_t zhdrCompressRaw(const void *raw, size_t size, void *zbuf, size_t bound)
+{
+    zhdr_ctx &ctx = zhdr_tls();
     LZ4F_preferences_t pref;
-    memset(&pref, 0, sizeof pref);
-    pref.frameInfo.blockSizeID = LZ4F_max256KB;
-    pref.frameInfo.contentSize = ssum;
-    zsize = LZ4F_compressFrameBound(ssum, &pref);
-    void *zblob = malloc(zsize);
-    assert(zblob);
-    zsize = LZ4F_compressFrame(zblob, zsize, bb, ssum, &pref);
+    zhdrPref(pref, size);
+    char *zp = (char *) zbuf;
+    size_t zsize = LZ4F_compressBegin(ctx.cctx, zp, bound, &pref);
     assert(!LZ4F_isError(zsize));
-    free(bb);
-    // NB: zblob alloc size is suboptimal; the caller may want
-    // to reallocate it or, better yet, to put it on a slab.
-    return zblob;
+    size_t ret = LZ4F_compressUpdate(ctx.cctx, zp + zsize, bound - zsize,
+				     raw, size, NULL);
+    assert(!LZ4F_isError(ret));
+    zsize += ret;
+    ret = LZ4F_compressEnd(ctx.cctx, zp + zsize, bound - zsize, NULL);
+    assert(!LZ4F_isError(ret));
+    zsize += ret;
+    return zsize;
+}
+
+// Compress the headers prepared by zhdrPrepare into zbuf.
+static size_t zhdrCompress(void *zbuf, size_t bound)
+{
+    zhdr_ctx &ctx = zhdr_tls();
+    return zhdrCompressRaw(ctx.raw.data(), ctx.rawSize, zbuf, bound);
+}
+
+// Compress a few headers in a single chunk.
+// Headers have magic, to be written to pkglist.
+// The chunk is only valid until the next call in the same thread.
+static const void *zhdrv(std::vector<Header> const& hh, size_t& zsize)
+{
+    zhdr_ctx &ctx = zhdr_tls();
+    size_t bound = zhdrPrepare(hh);
+    if (ctx.zbuf.size() < bound)
+	ctx.zbuf.resize(bound);
+    zsize = zhdrCompress(ctx.zbuf.data(), bound);
+    return ctx.zbuf.data();
 }
 
 #include <arpa/inet.h>
 
-// Decompress the headers.
-static void unzhdrv(std::vector<Header>& hh, const void *zblob, size_t zsize)
+// Decompress the headers, with magic, into the per-thread buffer.
+// The result is only valid until the next call in the same thread.
+static const void *unzhdrRaw(const void *zblob, size_t zsize, size_t& size)
 {
-    LZ4F_decompressionContext_t dctx;
-    size_t ret = LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
-    assert(!LZ4F_isError(ret));
+    zhdr_ctx &ctx = zhdr_tls();
     LZ4F_frameInfo_t frameInfo;
     size_t zread = zsize;
-    ret = LZ4F_getFrameInfo(dctx, &frameInfo, zblob, &zread);
+    size_t ret = LZ4F_getFrameInfo(ctx.dctx, &frameInfo, zblob, &zread);
     assert(!LZ4F_isError(ret));
     zblob = (char *) zblob + zread, zsize -= zread;
     size_t blobsize = frameInfo.contentSize;
     assert(blobsize);
-    void *blob = malloc(blobsize);
-    assert(blob);
+    if (ctx.raw.size() < blobsize)
+	ctx.raw.resize(blobsize);
     zread = zsize;
     // The docs say that LZ4F_decompress should be called in a loop.  However,
     // this is only useful for piecemeal decompression.  LZ4F_decompress also
     // seems to be able to decompress the whole thing at once.
-    ret = LZ4F_decompress(dctx, blob, &blobsize, zblob, &zread, NULL);
+    ret = LZ4F_decompress(ctx.dctx, ctx.raw.data(), &blobsize, zblob, &zread, NULL);
     assert(ret == 0);
     assert(blobsize == frameInfo.contentSize);
-    char *p = (char *) blob;
+    ctx.rawSize = size = blobsize;
+    return ctx.raw.data();
+}
+
+// Decompress a frame of a list into the per-thread buffer; NULL if the
+// frame does not decompress.  Unlike unzhdrRaw, the frame need not have
+// the content size: the lists written in one piece by lz4writer may not
+// have it.
+static const char *unzhdrFrame(const void *zblob, size_t zsize, size_t &size)
+{
+    zhdr_ctx &ctx = zhdr_tls();
+    auto fail = [&]() -> const char *
+    {
+	LZ4F_resetDecompressionContext(ctx.dctx);
+	return NULL;
+    };
+    LZ4F_frameInfo_t frameInfo;
+    size_t zread = zsize;
+    size_t ret = LZ4F_getFrameInfo(ctx.dctx, &frameInfo, zblob, &zread);
+    if (LZ4F_isError(ret))
+	return fail();
+    const char *zp = (const char *) zblob + zread;
+    zsize -= zread;
+    size_t alloc = frameInfo.contentSize ? frameInfo.contentSize : 4 * zsize + 1024;
+    if (ctx.raw.size() < alloc)
+	ctx.raw.resize(alloc);
+    size = 0;
+    do {
+	if (size == ctx.raw.size())
+	    ctx.raw.resize(2 * size);
+	size_t out = ctx.raw.size() - size;
+	zread = zsize;
+	ret = LZ4F_decompress(ctx.dctx, ctx.raw.data() + size, &out, zp, &zread, NULL);
+	if (LZ4F_isError(ret))
+	    return fail();
+	size += out, zp += zread, zsize -= zread;
+    } while (ret && (zsize || size == ctx.raw.size()));
+    // ret is non-zero if the frame is truncated
+    if (ret)
+	return fail();
+    return ctx.raw.data();
+}
+
+// Decompress the headers.
+static void unzhdrv(std::vector<Header>& hh, const void *zblob, size_t zsize)
+{
+    size_t blobsize;
+    char *p = (char *) unzhdrRaw(zblob, zsize, blobsize);
     do {
 	assert(blobsize > sizeof zhdr_magic);
 	assert(memcmp(p, zhdr_magic, sizeof zhdr_magic) == 0);
@@ -94,6 +231,4 @@ static void unzhdrv(std::vector<Header>& hh, const void *zblob, size_t zsize)
 	assert(hsize <= blobsize);
 	p += hsize, blobsize -= hsize;
     } while (blobsize);
-    free(blob);
-    LZ4F_freeDecompressionContext(dctx);
 }
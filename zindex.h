@@ -0,0 +1,297 @@
+/*
+ * The frame index of a seekable list
+ */
+#include <endian.h>
+
+// A list written in frames (see zhdr.h) can end with an LZ4 skippable
+// frame, which the decompressors pass over, with the index of the frames:
+// the name, sourcerpm and file name of each header, and the frame which
+// has it.  A single header can then be found and decompressed without
+// reading the rest of the list.  The index frame is the last one in the
+// file, and ends with a footer, so that it can be found from the end.
+// Unlike the srpm index, the lists are published, so the integers are
+// little-endian.
+//
+// The payload of the skippable frame: the header, the frame table,
+// the entry table sorted by name and file name, the entry numbers sorted
+// by sourcerpm, the entry numbers sorted by file name, the string pool
+// padded to 4 bytes, and the footer.
+#define ZINDEX_SKIPPABLE 0x184D2A5E
+
+struct ZIndexHeader {
+    char magic[8];
+    uint32_t nframe;
+    uint32_t nent;
+    uint32_t poolsize;
+    uint32_t reserved;
+};
+
+struct ZIndexFrame {
+    uint64_t offset; // in the list file
+    uint32_t zsize;
+    uint32_t count; // headers in the frame
+};
+
+struct ZIndexEntry {
+    uint32_t name; // offsets in the pool
+    uint32_t srpm;
+    uint32_t file;
+    uint32_t frame;
+};
+
+struct ZIndexFooter {
+    uint32_t size; // of the whole skippable frame
+    char magic[4];
+};
+
+static const char zindexMagic[8] = { 'z', 'i', 'n', 'd', 'e', 'x', '0', '1' };
+static const char zindexFooterMagic[4] = { 'Z', 'I', 'D', 'X' };
+
+class ZIndexWriter
+{
+    StrIntern strs;
+    std::vector<struct ZIndexFrame> frames;
+    std::vector<struct ZIndexEntry> ents;
+public:
+    // A frame has been written at the offset.
+    void addFrame(uint64_t offset, size_t zsize)
+    {
+	struct ZIndexFrame f = { offset, (uint32_t) zsize, 0 };
+	frames.push_back(f);
+    }
+    // A header of the last frame.
+    void addHeader(const char *name, const char *srpm, const char *file)
+    {
+	assert(frames.size());
+	struct ZIndexEntry e = { strs.intern(name), strs.intern(srpm ? : ""),
+	    strs.intern(file), (uint32_t) frames.size() - 1 };
+	ents.push_back(e);
+	frames.back().count++;
+    }
+    // The headers of the last frame, from its uncompressed bytes.
+    bool addRaw(const void *raw, size_t rawSize)
+    {
+	const char *p = (const char *) raw;
+	while (rawSize) {
+	    size_t size = rawhdrSize(p, rawSize);
+	    if (size == 0)
+		return false;
+	    const char *name = rawhdrString(p, size, RPMTAG_NAME);
+	    const char *srpm = rawhdrString(p, size, RPMTAG_SOURCERPM);
+	    const char *file = rawhdrString(p, size, CRPMTAG_FILENAME);
+	    if (name == NULL || file == NULL)
+		return false;
+	    addHeader(name, srpm, file);
+	    p += size, rawSize -= size;
+	}
+	return true;
+    }
+    // Make the skippable frame.
+    void finish(std::vector<char> &out)
+    {
+	std::vector<unsigned> ranks;
+	strs.rank(ranks);
+	std::vector<unsigned> order(ents.size());
+	for (unsigned i = 0; i < order.size(); i++)
+	    order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b)
+		{ return ranks[ents[a].name] < ranks[ents[b].name] ||
+			 (ranks[ents[a].name] == ranks[ents[b].name] &&
+			  ranks[ents[a].file] < ranks[ents[b].file]); });
+	std::vector<struct ZIndexEntry> sorted(ents.size());
+	for (unsigned i = 0; i < order.size(); i++)
+	    sorted[i] = ents[order[i]];
+	std::vector<uint32_t> bysrpm(sorted.size()), byfile(sorted.size());
+	for (unsigned i = 0; i < sorted.size(); i++)
+	    bysrpm[i] = byfile[i] = i;
+	std::stable_sort(bysrpm.begin(), bysrpm.end(), [&](uint32_t a, uint32_t b)
+		{ return ranks[sorted[a].srpm] < ranks[sorted[b].srpm]; });
+	std::stable_sort(byfile.begin(), byfile.end(), [&](uint32_t a, uint32_t b)
+		{ return ranks[sorted[a].file] < ranks[sorted[b].file]; });
+	StrPool pool;
+	std::vector<unsigned> offs(strs.count());
+	for (unsigned id = 0; id < offs.size(); id++)
+	    offs[id] = pool.add(strs.str(id));
+	size_t poolsize = pool.size();
+	size_t pad = -poolsize & 3;
+
+	size_t payload = sizeof(struct ZIndexHeader) +
+		frames.size() * sizeof(struct ZIndexFrame) +
+		sorted.size() * (sizeof(struct ZIndexEntry) + 8) +
+		poolsize + pad + sizeof(struct ZIndexFooter);
+	out.clear();
+	auto put32 = [&](uint32_t x)
+	{
+	    x = htole32(x);
+	    out.insert(out.end(), (char *) &x, (char *) &x + 4);
+	};
+	auto put64 = [&](uint64_t x)
+	{
+	    x = htole64(x);
+	    out.insert(out.end(), (char *) &x, (char *) &x + 8);
+	};
+	put32(ZINDEX_SKIPPABLE);
+	put32(payload);
+	out.insert(out.end(), zindexMagic, zindexMagic + sizeof zindexMagic);
+	put32(frames.size());
+	put32(sorted.size());
+	put32(poolsize);
+	put32(0);
+	for (const struct ZIndexFrame &f : frames) {
+	    put64(f.offset);
+	    put32(f.zsize);
+	    put32(f.count);
+	}
+	for (const struct ZIndexEntry &e : sorted) {
+	    put32(offs[e.name]);
+	    put32(offs[e.srpm]);
+	    put32(offs[e.file]);
+	    put32(e.frame);
+	}
+	for (uint32_t i : bysrpm)
+	    put32(i);
+	for (uint32_t i : byfile)
+	    put32(i);
+	if (poolsize)
+	    out.insert(out.end(), pool.get(0), pool.get(0) + poolsize);
+	out.insert(out.end(), pad, '\0');
+	put32(8 + payload);
+	out.insert(out.end(), zindexFooterMagic, zindexFooterMagic + sizeof zindexFooterMagic);
+	assert(out.size() == 8 + payload);
+    }
+};
+
+// Looking up the index in a mapped list.
+class ZIndex
+{
+    const char *base; // the list
+    uint32_t nframe, nent, poolsize;
+    const char *frameTab, *entTab, *bysrpm, *byfile, *pool;
+    static uint32_t le32(const char *p)
+    {
+	uint32_t x;
+	memcpy(&x, p, 4);
+	return le32toh(x);
+    }
+    static uint64_t le64(const char *p)
+    {
+	uint64_t x;
+	memcpy(&x, p, 8);
+	return le64toh(x);
+    }
+    uint32_t field(unsigned i, int k) const
+    {
+	return le32(entTab + 16 * i + 4 * k);
+    }
+    // The range of entries in the permutation (or in the entry order,
+    // if perm is NULL) whose field k equals s.
+    void range(const char *perm, int k, const char *s, unsigned &first, unsigned &count) const
+    {
+	auto at = [&](unsigned j)
+	{
+	    return perm ? le32(perm + 4 * j) : j;
+	};
+	unsigned lo = 0, hi = nent;
+	while (lo < hi) {
+	    unsigned mid = lo + (hi - lo) / 2;
+	    if (strcmp(pool + field(at(mid), k), s) < 0)
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+	first = lo;
+	for (hi = lo; hi < nent && strcmp(pool + field(at(hi), k), s) == 0; hi++)
+	    ;
+	count = hi - lo;
+    }
+public:
+    ZIndex() : base(NULL), nframe(0), nent(0) { }
+    // Find the index at the end of the list; false if there is none,
+    // or if it does not check.
+    bool load(const void *map, size_t size)
+    {
+	const char *b = (const char *) map;
+	if (size < 8 + sizeof(struct ZIndexHeader) + sizeof(struct ZIndexFooter))
+	    return false;
+	const char *foot = b + size - sizeof(struct ZIndexFooter);
+	if (memcmp(foot + 4, zindexFooterMagic, 4))
+	    return false;
+	uint32_t zsize = le32(foot);
+	if (zsize > size || zsize < 8 + sizeof(struct ZIndexHeader) + sizeof(struct ZIndexFooter))
+	    return false;
+	const char *z = b + size - zsize;
+	if (le32(z) != ZINDEX_SKIPPABLE || le32(z + 4) != zsize - 8 ||
+	    memcmp(z + 8, zindexMagic, sizeof zindexMagic))
+	    return false;
+	const char *h = z + 8;
+	uint32_t nf = le32(h + 8), ne = le32(h + 12), ps = le32(h + 16);
+	uint64_t need = 8 + sizeof(struct ZIndexHeader) +
+		(uint64_t) nf * sizeof(struct ZIndexFrame) +
+		(uint64_t) ne * (sizeof(struct ZIndexEntry) + 8) +
+		ps + (-ps & 3) + sizeof(struct ZIndexFooter);
+	if (need != zsize)
+	    return false;
+	const char *ft = h + sizeof(struct ZIndexHeader);
+	const char *et = ft + nf * sizeof(struct ZIndexFrame);
+	const char *bs = et + ne * sizeof(struct ZIndexEntry);
+	const char *bf = bs + 4 * ne;
+	const char *p = bf + 4 * ne;
+	if (ps ? p[ps-1] != '\0' : ne != 0)
+	    return false;
+	uint64_t zoff = size - zsize;
+	for (uint32_t i = 0; i < nf; i++) {
+	    uint64_t off = le64(ft + 16 * i);
+	    uint32_t fz = le32(ft + 16 * i + 8);
+	    if (off > zoff || fz > zoff - off)
+		return false;
+	}
+	for (uint32_t i = 0; i < ne; i++) {
+	    for (int k = 0; k < 3; k++)
+		if (le32(et + 16 * i + 4 * k) >= ps)
+		    return false;
+	    if (le32(et + 16 * i + 12) >= nf)
+		return false;
+	    if (le32(bs + 4 * i) >= ne || le32(bf + 4 * i) >= ne)
+		return false;
+	}
+	base = b;
+	nframe = nf, nent = ne, poolsize = ps;
+	frameTab = ft, entTab = et, bysrpm = bs, byfile = bf, pool = p;
+	return true;
+    }
+    unsigned entries() const { return nent; }
+    unsigned frames() const { return nframe; }
+    const char *name(unsigned i) const { return pool + field(i, 0); }
+    const char *srpm(unsigned i) const { return pool + field(i, 1); }
+    const char *file(unsigned i) const { return pool + field(i, 2); }
+    unsigned frameOf(unsigned i) const { return field(i, 3); }
+    // The compressed frame, within the mapped list.
+    const void *frame(unsigned f, size_t &zsize) const
+    {
+	zsize = le32(frameTab + 16 * f + 8);
+	return base + le64(frameTab + 16 * f);
+    }
+    // The entries with the name are first ... first + count - 1.
+    void findName(const char *s, unsigned &first, unsigned &count) const
+    {
+	range(NULL, 0, s, first, count);
+    }
+    // The entries with the sourcerpm are srpmEntry(first) ...
+    void findSrpm(const char *s, unsigned &first, unsigned &count) const
+    {
+	range(bysrpm, 1, s, first, count);
+    }
+    unsigned srpmEntry(unsigned j) const { return le32(bysrpm + 4 * j); }
+    // The entry with the file name.
+    bool findFile(const char *s, unsigned &i) const
+    {
+	unsigned first, count;
+	range(byfile, 2, s, first, count);
+	if (count == 0)
+	    return false;
+	i = le32(byfile + 4 * first);
+	return true;
+    }
+};
+
+// ex:set ts=8 sts=4 sw=4 noet: